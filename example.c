@@ -0,0 +1,183 @@
+// Copyright (c) 2016 Dominik Zeromski <dzeromsk@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Single binary for all supported gens: the per-gen examples are built with
+// their main renamed (see Makefile) and picked here from the PCI device ID.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <libdrm/drm.h>
+#include <libdrm/intel_bufmgr.h>
+
+int hsw_main(int argc, char *argv[]);
+int bdw_main(int argc, char *argv[]);
+int skl_main(int argc, char *argv[]);
+
+// PCI device IDs of each family, as listed in i915_pciids.h. Kaby Lake,
+// Amber Lake, Coffee Lake, Whiskey Lake and Comet Lake are gen9 as well and
+// run the skl backend. Broxton and Gemini Lake are gen9 LP, whose L3 the skl
+// presets do not fit, and stay unsupported.
+static const uint16_t hsw_ids[] = {
+    // GT1
+    0x0402, 0x0406, 0x040a, 0x040b, 0x040e, 0x0c02, 0x0c06, 0x0c0a, 0x0c0b,
+    0x0c0e, 0x0a02, 0x0a06, 0x0a0a, 0x0a0b, 0x0a0e, 0x0d02, 0x0d06, 0x0d0a,
+    0x0d0b, 0x0d0e,
+    // GT2
+    0x0412, 0x0416, 0x041a, 0x041b, 0x041e, 0x0c12, 0x0c16, 0x0c1a, 0x0c1b,
+    0x0c1e, 0x0a12, 0x0a16, 0x0a1a, 0x0a1b, 0x0a1e, 0x0d12, 0x0d16, 0x0d1a,
+    0x0d1b, 0x0d1e,
+    // GT3
+    0x0422, 0x0426, 0x042a, 0x042b, 0x042e, 0x0c22, 0x0c26, 0x0c2a, 0x0c2b,
+    0x0c2e, 0x0a22, 0x0a26, 0x0a2a, 0x0a2b, 0x0a2e, 0x0d22, 0x0d26, 0x0d2a,
+    0x0d2b, 0x0d2e,
+};
+
+static const uint16_t bdw_ids[] = {
+    // GT1, GT2, GT3 and reserved
+    0x1602, 0x1606, 0x160a, 0x160b, 0x160d, 0x160e, 0x1612, 0x1616,
+    0x161a, 0x161b, 0x161d, 0x161e, 0x1622, 0x1626, 0x162a, 0x162b,
+    0x162d, 0x162e, 0x1632, 0x1636, 0x163a, 0x163b, 0x163d, 0x163e,
+};
+
+static const uint16_t skl_ids[] = {
+    // Skylake GT1, GT2, GT3 and GT4
+    0x1902, 0x1906, 0x190a, 0x190b, 0x190e, 0x1912, 0x1916, 0x191a, 0x191b,
+    0x191d, 0x191e, 0x1921, 0x1923, 0x1926, 0x1927, 0x192a, 0x192b, 0x192d,
+    0x1932, 0x193a, 0x193b, 0x193d,
+    // Kaby Lake and Amber Lake
+    0x5902, 0x5906, 0x5908, 0x590a, 0x590b, 0x590e, 0x5912, 0x5913, 0x5915,
+    0x5916, 0x5917, 0x591a, 0x591b, 0x591c, 0x591d, 0x591e, 0x5921, 0x5923,
+    0x5926, 0x5927, 0x593b, 0x87c0, 0x87ca,
+    // Coffee Lake and Whiskey Lake
+    0x3e90, 0x3e91, 0x3e92, 0x3e93, 0x3e94, 0x3e96, 0x3e98, 0x3e99, 0x3e9a,
+    0x3e9b, 0x3e9c, 0x3ea0, 0x3ea1, 0x3ea2, 0x3ea3, 0x3ea4, 0x3ea5, 0x3ea6,
+    0x3ea7, 0x3ea8, 0x3ea9,
+    // Comet Lake
+    0x9b21, 0x9b41, 0x9ba2, 0x9ba4, 0x9ba5, 0x9ba8, 0x9baa, 0x9bac, 0x9bc2,
+    0x9bc4, 0x9bc5, 0x9bc6, 0x9bc8, 0x9bca, 0x9bcc, 0x9be6, 0x9bf6,
+};
+
+typedef struct backend {
+  const char *name;
+  int (*main)(int argc, char *argv[]);
+  const uint16_t *ids;
+  size_t id_count;
+  uint32_t capture_gen; // gen recorded in the header of its captures
+} backend_t;
+
+#define BACKEND(gen, n)                                                        \
+  { #gen, gen##_main, gen##_ids, sizeof gen##_ids / sizeof gen##_ids[0], n }
+
+static const backend_t backends[] = {
+    BACKEND(hsw, 7),
+    BACKEND(bdw, 8),
+    BACKEND(skl, 9),
+};
+
+#define CAPTURE_MAGIC 0x43555047 // "GPUC", as the backends write it
+
+static const backend_t *backend_for_devid(int devid) {
+  size_t i, j;
+
+  for (i = 0; i < sizeof backends / sizeof backends[0]; i++) {
+    for (j = 0; j < backends[i].id_count; j++) {
+      if (backends[i].ids[j] == devid)
+        return &backends[i];
+    }
+  }
+  return NULL;
+}
+
+// Backend that wrote the capture at path, from the magic and gen of its
+// header, NULL if it is not a capture.
+static const backend_t *backend_for_capture(const char *path) {
+  uint32_t header[3]; // magic, version, gen
+  size_t i;
+
+  FILE *file = fopen(path, "rb");
+  if (!file)
+    return NULL;
+  size_t n = fread(header, sizeof header, 1, file);
+  fclose(file);
+  if (n != 1 || header[0] != CAPTURE_MAGIC)
+    return NULL;
+  for (i = 0; i < sizeof backends / sizeof backends[0]; i++) {
+    if (backends[i].capture_gen == header[2])
+      return &backends[i];
+  }
+  return NULL;
+}
+
+// Backend of this machine, $GPGPU_GEN names one explicitly. Without a GPU a
+// --replay runs on the backend of the gen the capture was taken on. The
+// choice is made once.
+static const backend_t *detect_backend(int argc, char *argv[]) {
+  static const backend_t *backend;
+  int devid = 0;
+  const char *gen = getenv("GPGPU_GEN");
+  int i;
+
+  if (backend)
+    return backend;
+  if (gen) {
+    for (i = 0; i < sizeof backends / sizeof backends[0]; i++) {
+      if (!strcmp(gen, backends[i].name))
+        backend = &backends[i];
+    }
+    if (!backend)
+      fprintf(stderr, "Unknown GPGPU_GEN '%s'\n", gen);
+    return backend;
+  }
+
+  int fd = open("/dev/dri/card0", O_RDWR);
+  if (fd >= 0) {
+    drm_intel_bufmgr *bufmgr = drm_intel_bufmgr_gem_init(fd, 4096);
+    if (bufmgr) {
+      devid = drm_intel_bufmgr_gem_get_devid(bufmgr);
+      drm_intel_bufmgr_destroy(bufmgr);
+    }
+    close(fd);
+  }
+
+  // without a usable GPU every backend falls back to the same CPU code, only
+  // a capture needs the backend of its gen
+  if (!devid) {
+    if (argc == 3 && !strcmp(argv[1], "--replay"))
+      backend = backend_for_capture(argv[2]);
+    if (!backend)
+      backend = &backends[0];
+    return backend;
+  }
+  backend = backend_for_devid(devid);
+  if (!backend)
+    fprintf(stderr, "Unsupported device 0x%04x\n", devid);
+  return backend;
+}
+
+int main(int argc, char *argv[]) {
+  const backend_t *backend = detect_backend(argc, argv);
+  if (!backend)
+    return 1;
+  return backend->main(argc, argv);
+}
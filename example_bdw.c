@@ -20,11 +20,25 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <pthread.h>
+#include <emmintrin.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <libdrm/drm.h>
+#include <libdrm/i915_drm.h>
+#include <xf86drm.h>
 #include <libdrm/intel_bufmgr.h>
 
 #define CMD(PIPELINE, OP, SUB_OP)                                              \
@@ -34,22 +48,162 @@
 #define CMD_PIPELINE_SELECT CMD(1, 1, 4)
 #define PIPELINE_SELECT_GPGPU 2
 #define CMD_STATE_BASE_ADDRESS CMD(0, 1, 1)
-#define CMD_MEDIA_STATE_POINTERS CMD(2, 0, 0)
+#define CMD_MEDIA_VFE_STATE CMD(2, 0, 0)
 #define CMD_MEDIA_CURBE_LOAD CMD(2, 0, 1)
 #define CMD_MEDIA_INTERFACE_DESCRIPTOR_LOAD CMD(2, 0, 2)
 #define CMD_GPGPU_WALKER CMD(2, 1, 5)
 #define CMD_MEDIA_STATE_FLUSH CMD(2, 0, 4)
+#define GPGPU_WALKER_INDIRECT (1 << 10)
+
+// thread group counts of an indirect GPGPU_WALKER
+#define GPGPU_DISPATCHDIMX (0x2500)
+#define GPGPU_DISPATCHDIMY (0x2504)
+#define GPGPU_DISPATCHDIMZ (0x2508)
 
 #define CMD_LOAD_REGISTER_IMM (0x22 << 23)
+#define CMD_LOAD_REGISTER_MEM (0x29 << 23)
+#define CMD_NOOP (0x0 << 23)
 #define CMD_BATCH_BUFFER_END (0xA << 23)
+#define CMD_BATCH_BUFFER_START (0x31 << 23)
+#define BATCH_BUFFER_SECOND_LEVEL (1 << 22)
+#define BATCH_BUFFER_PPGTT (1 << 8)
 
 // l3 cache
 #define GEN8_L3_CNTL_REG_ADDRESS_OFFSET (0x7034)
+#define GEN8_L3_CNTL_REG 0x60000160     // {SLM=0, URB=384, Rest=384}
+#define GEN8_L3_CNTL_REG_SLM 0x60000121 // {SLM=192, URB=128, Rest=384}
+#define GEN8_L3_CNTL(slm, urb, all, dc, ro)                                    \
+  ((slm) | (urb) << 1 | (ro) << 11 | (dc) << 18 | (all) << 25)
+#define L3_SWEEP_RUNS 16
 
 #define SRFC_OFFSET (0x0400)
 #define CURB_OFFSET (0x4400)
 #define IDRT_OFFSET (0x8400)
 
+// batch layout, the dispatch commands follow either the prologue or the call
+// to a prologue recorded in its own buffer
+#define PROLOGUE_DWORDS 41
+#define CALL_DWORDS 3
+
+// dispatch
+#define SIMD_WIDTH 16
+#define GROUP_THREADS 4
+#define GROUP_SIZE (SIMD_WIDTH * GROUP_THREADS)
+
+// kernel arguments
+#define ARG_BUFFER 0 // a surface, and its address in CURBE
+#define ARG_SCALAR 1 // a dword in CURBE
+#define ARG_LOCAL 2  // SLM bytes per group, and their SLM offset in CURBE
+#define KERNEL_MAX_ARGS 8
+
+// reductions
+#define REDUCE_SUM 0
+#define REDUCE_MIN 1
+#define REDUCE_MAX 2
+#define REDUCE_ARGMAX 3
+#define REDUCE_SLM_INDEX 64 // byte offset of the partial indices in SLM
+
+// element types of the typed kernels, always packed into dwords
+#define ELEM_INT32 0
+#define ELEM_FLOAT32 1
+#define ELEM_FLOAT16 2
+#define ELEM_INT16 3
+#define ELEM_INT8 4
+#define ELEM_INT64 5
+
+// cache policies of buffer surfaces
+#define CACHE_LLC_L3 0    // cached in LLC and L3, data that is reused
+#define CACHE_L3 1        // cached in L3 only
+#define CACHE_STREAMING 2 // uncached, read or written once
+#define CACHE_REUSE_BYTES (256 * 1024)
+
+// submit benchmark
+#define SUBMIT_GROUPS 16
+#define SUBMIT_PASSES 4
+#define SUBMIT_BATCHES 64 // batch buffers reused round robin
+
+// completion handles
+#define COMPLETION_MAX_WAIT 64 // sync_files polled at once
+#define COMPLETION_TIMEOUT_NS 2000000000ll // a dispatch running longer hung
+#define COMPLETION_TICK_NS 1000000         // event loop tick of --completions
+#define REACTOR_MAX_EVENTS 16
+
+// direct submission
+#define EXEC_MAX_OBJECTS 8
+#define EXEC_MAX_RELOCS 16
+#define SOFTPIN_BASE (1ull << 32) // above any buffer without 48-bit support
+#define SOFTPIN_MAX_FREE 256       // released ranges kept for reuse
+
+// surface state heap
+#define HEAP_TABLE_ENTRIES 8 // binding table indices a dispatch can use
+#define HEAP_TABLES (256 / HEAP_TABLE_ENTRIES)
+#define HEAP_SURFACES 256
+#define HEAP_IN_FLIGHT 16 // dispatches of --heap submitted at once
+
+// autotuning
+#define AUTOTUNE_RUNS 3
+#define PROFILE_ENTRIES 64
+#define PROFILE_PATH "gpgpu.profile" // unless $GPGPU_PROFILE is set
+
+// capture files
+#define CAPTURE_MAGIC 0x43555047 // "GPUC"
+#define CAPTURE_VERSION 1
+#define CAPTURE_GEN 8
+#define CAPTURE_RUNS 100
+#define CAPTURE_MAX_SIZE (256u << 20) // largest buffer a capture may hold
+
+// OA performance counters, in I915_OA_FORMAT_A32u40_A4u32_B8_C8 reports
+#define CMD_REPORT_PERF_COUNT (0x28 << 23)
+#define OA_FORMAT I915_OA_FORMAT_A32u40_A4u32_B8_C8
+#define OA_REPORT_SIZE 256
+#define OA_REPORT_BEGIN 0xb0 // report ids, written to dword 0 of each report
+#define OA_REPORT_END 0xe0
+#define OA_TIMESTAMP_NS 80.0 // 12.5 MHz
+#define OA_MAGIC 0x414f5047  // "GPOA"
+#define OA_VERSION 1
+#define OA_METRICS_PATH "/sys/class/drm/card0/metrics"
+#define OA_A(n) (n) // counter indices, A0-35 then B0-7 and C0-7
+#define OA_B(n) (36 + (n))
+#define OA_C(n) (44 + (n))
+#define OA_COUNTERS 52
+
+// streaming
+#define STREAM_SLOTS 3
+#define STREAM_MAX_CHUNK (1 << 30)
+
+// CPU backend and CPU/GPU splitting
+#define CPU_MAX_THREADS 64
+#define SPLIT_PROBE (1 << 22)
+#define SPLIT_PROBE_RUNS 2
+
+// software executor
+#define SIM_GRF_SIZE (128 * 32)
+#define SIM_MAX_OPS 512
+#define SIM_MAX_DEPTH 16 // nested ifs
+#define SIM_CACHE_SIZE 16
+#define SIM_SURFACES 4 // binding table entries, the kernels use 2 and 3
+#define SIM_RUN 0
+#define SIM_WAIT 1 // blocked on the notification count
+#define SIM_DONE 2
+#define SIM_FAULT 3
+#define SIM_LINE_SIZE 64
+#define SIM_L3_WAY_BYTES 8192 // GEN8_L3_CNTL allocations are in 8 KB ways
+#define SIM_LLC_BYTES (8 << 20)
+#define SIM_LLC_WAYS 16
+#define SIM_CACHE_PASSES 2 // the second pass shows what stayed cached
+#define SIM_EUS 24 // of a GT2, simulated threads are spread over them
+#define SIM_EU_THREADS 7
+#define SIM_CLOCK_MHZ 1000
+#define SIM_MEMORY_GBPS 25.6 // dual channel DDR3-1600
+#define SIM_ALU_LATENCY 8  // cycles from the last issue cycle to the result
+#define SIM_SEND_ISSUE 2
+#define SIM_BARRIER_LATENCY 32 // gateway, from the last arrival to the release
+#define SIM_EOT_LATENCY 32     // thread spawner, until the EU thread is free
+#define SIM_LEVEL_SLM 0 // where a message was served, for its latency
+#define SIM_LEVEL_L3 1
+#define SIM_LEVEL_LLC 2
+#define SIM_LEVEL_MEMORY 3
+
 typedef struct gen8_interface_descriptor {
   struct {
     uint32_t pad6 : 6;
@@ -313,6 +467,305 @@ typedef struct gen7_sampler_border_color {
   float r, g, b, a;
 } gen7_sampler_border_color_t;
 
+// EU instruction encoding, see "EU Instruction Formats" in the BDW PRM
+#define GEN_OPCODE_MOV 0x01
+#define GEN_OPCODE_SEL 0x02
+#define GEN_OPCODE_NOT 0x04
+#define GEN_OPCODE_AND 0x05
+#define GEN_OPCODE_OR 0x06
+#define GEN_OPCODE_XOR 0x07
+#define GEN_OPCODE_SHR 0x08
+#define GEN_OPCODE_SHL 0x09
+#define GEN_OPCODE_ASR 0x0c
+#define GEN_OPCODE_CMP 0x10
+#define GEN_OPCODE_IF 0x22
+#define GEN_OPCODE_ENDIF 0x25
+#define GEN_OPCODE_WAIT 0x30
+#define GEN_OPCODE_SEND 0x31
+#define GEN_OPCODE_SENDC 0x32
+#define GEN_OPCODE_ADD 0x40
+#define GEN_OPCODE_MUL 0x41
+#define GEN_OPCODE_NOP 0x7e
+
+#define GEN_COND_Z 1
+#define GEN_COND_NZ 2
+#define GEN_COND_G 3
+#define GEN_COND_GE 4
+#define GEN_COND_L 5
+#define GEN_COND_LE 6
+
+#define GEN_FILE_ARF 0
+#define GEN_FILE_GRF 1
+#define GEN_FILE_IMM 3
+
+#define GEN_TYPE_UD 0
+#define GEN_TYPE_D 1
+#define GEN_TYPE_UW 2
+#define GEN_TYPE_W 3
+#define GEN_TYPE_UB 4
+#define GEN_TYPE_B 5
+#define GEN_TYPE_DF 6
+#define GEN_TYPE_F 7
+#define GEN_TYPE_UQ 8
+#define GEN_TYPE_Q 9
+#define GEN_TYPE_HF 10
+
+#define GEN_ARF_NULL 0x00
+#define GEN_ARF_NOTIFICATION 0x90
+
+#define GEN_SFID_GATEWAY 0x3
+#define GEN_SFID_THREAD_SPAWNER 0x7
+#define GEN_SFID_DATAPORT_DATA 0xa
+#define GEN_SFID_DATAPORT1 0xc
+
+#define GEN_BTI_SLM 254
+
+// message descriptor fields the software executor understands
+#define GEN_MSG_UNTYPED_READ 1
+#define GEN_MSG_MEMORY_FENCE 7
+#define GEN_MSG_UNTYPED_WRITE 9
+#define GEN_SIMD_MODE_SIMD16 1
+#define GEN_SIMD_MODE_SIMD8 2
+#define GEN_GATEWAY_BARRIER 4
+
+// instruction control bits for gen_emit
+#define GEN_NOMASK (1 << 0)
+#define GEN_PRED (1 << 1)
+#define GEN_SWITCH (1 << 2)
+#define GEN_EOT (1 << 3)
+#define GEN_CMOD(x) ((x) << 8)
+
+typedef struct gen_reg {
+  uint32_t file : 2;
+  uint32_t type : 4;
+  uint32_t nr : 8;
+  uint32_t subnr : 5; /* in bytes */
+  uint32_t vstride : 4;
+  uint32_t width : 3;
+  uint32_t hstride : 2;
+  uint32_t negate : 1;
+  uint32_t imm;
+} gen_reg_t;
+
+typedef struct gen_program {
+  uint32_t *store;
+  int nr; /* instructions emitted so far */
+} gen_program_t;
+
+static const int gen_type_size[] = {4, 4, 2, 2, 1, 1, 8, 4, 8, 8, 2};
+
+// rN.0<8;8,1>
+static gen_reg_t gen_vec(int nr, int type) {
+  gen_reg_t r = {GEN_FILE_GRF, type, nr, 0, 4, 3, 1, 0, 0};
+  return r;
+}
+
+// rN.sub<0;1,0>
+static gen_reg_t gen_scalar(int nr, int sub, int type) {
+  gen_reg_t r = {GEN_FILE_GRF, type, nr, sub * gen_type_size[type], 0, 0, 0,
+                 0, 0};
+  return r;
+}
+
+// rN.sub<w;w,1>, or a scalar for a width of 1
+static gen_reg_t gen_region(int nr, int sub, int type, int width) {
+  gen_reg_t r = gen_scalar(nr, sub, type);
+  if (width > 1) {
+    r.vstride = ffs(width);
+    r.width = ffs(width) - 1;
+    r.hstride = 1;
+  }
+  return r;
+}
+
+// rN.sub<8*s;8,s>, every s-th element of packed data
+static gen_reg_t gen_strided(int nr, int sub, int type, int stride) {
+  gen_reg_t r = gen_region(nr, sub, type, 8);
+  r.vstride = ffs(8 * stride);
+  r.hstride = ffs(stride);
+  return r;
+}
+
+static gen_reg_t gen_imm(int type, uint32_t value) {
+  gen_reg_t r = {GEN_FILE_IMM, type, 0, 0, 0, 0, 0, 0, value};
+  return r;
+}
+
+static gen_reg_t gen_arf(int nr, int type) {
+  gen_reg_t r = {GEN_FILE_ARF, type, nr, 0, 4, 3, 1, 0, 0};
+  return r;
+}
+
+static gen_reg_t gen_neg(gen_reg_t r) {
+  r.negate = 1;
+  return r;
+}
+
+static void gen_bits(uint32_t *inst, int hi, int lo, uint32_t value) {
+  uint32_t mask = (hi - lo == 31 ? ~0u : (1u << (hi - lo + 1)) - 1);
+  inst[lo / 32] &= ~(mask << (lo % 32));
+  inst[lo / 32] |= (value & mask) << (lo % 32);
+}
+
+static uint32_t gen_field(const uint32_t *inst, int hi, int lo) {
+  uint32_t mask = (hi - lo == 31 ? ~0u : (1u << (hi - lo + 1)) - 1);
+  return inst[lo / 32] >> (lo % 32) & mask;
+}
+
+static uint32_t *gen_emit(gen_program_t *p, int opcode, int exec_size,
+                          uint32_t ctrl) {
+  uint32_t *inst = p->store + 4 * p->nr++;
+  memset(inst, 0, 16);
+  gen_bits(inst, 6, 0, opcode);
+  gen_bits(inst, 15, 14, ctrl & GEN_SWITCH ? 2 : 0);
+  gen_bits(inst, 19, 16, ctrl & GEN_PRED ? 1 : 0);
+  gen_bits(inst, 23, 21, ffs(exec_size) - 1);
+  gen_bits(inst, 27, 24, ctrl >> 8);
+  gen_bits(inst, 34, 34, ctrl & GEN_NOMASK ? 1 : 0);
+  return inst;
+}
+
+static void gen_set_dst(uint32_t *inst, gen_reg_t r) {
+  gen_bits(inst, 36, 35, r.file);
+  gen_bits(inst, 40, 37, r.type);
+  gen_bits(inst, 52, 48, r.subnr);
+  gen_bits(inst, 60, 53, r.nr);
+  gen_bits(inst, 62, 61, r.hstride ? r.hstride : 1);
+}
+
+static void gen_set_src0(uint32_t *inst, gen_reg_t r) {
+  gen_bits(inst, 42, 41, r.file);
+  gen_bits(inst, 46, 43, r.type);
+  if (r.file == GEN_FILE_IMM) {
+    gen_bits(inst, 94, 91, r.type);
+    inst[3] = r.imm;
+    return;
+  }
+  gen_bits(inst, 68, 64, r.subnr);
+  gen_bits(inst, 76, 69, r.nr);
+  gen_bits(inst, 78, 78, r.negate);
+  gen_bits(inst, 81, 80, r.hstride);
+  gen_bits(inst, 84, 82, r.width);
+  gen_bits(inst, 88, 85, r.vstride);
+}
+
+static void gen_set_src1(uint32_t *inst, gen_reg_t r) {
+  gen_bits(inst, 90, 89, r.file);
+  gen_bits(inst, 94, 91, r.type);
+  if (r.file == GEN_FILE_IMM) {
+    inst[3] = r.imm;
+    return;
+  }
+  gen_bits(inst, 100, 96, r.subnr);
+  gen_bits(inst, 108, 101, r.nr);
+  gen_bits(inst, 110, 110, r.negate);
+  gen_bits(inst, 113, 112, r.hstride);
+  gen_bits(inst, 116, 114, r.width);
+  gen_bits(inst, 120, 117, r.vstride);
+}
+
+static void gen_alu1(gen_program_t *p, int opcode, int exec_size,
+                     uint32_t ctrl, gen_reg_t dst, gen_reg_t src0) {
+  uint32_t *inst = gen_emit(p, opcode, exec_size, ctrl);
+  gen_set_dst(inst, dst);
+  gen_set_src0(inst, src0);
+}
+
+static void gen_alu2(gen_program_t *p, int opcode, int exec_size,
+                     uint32_t ctrl, gen_reg_t dst, gen_reg_t src0,
+                     gen_reg_t src1) {
+  uint32_t *inst = gen_emit(p, opcode, exec_size, ctrl);
+  gen_set_dst(inst, dst);
+  gen_set_src0(inst, src0);
+  gen_set_src1(inst, src1);
+}
+
+static void gen_send(gen_program_t *p, int exec_size, uint32_t ctrl, int sfid,
+                     gen_reg_t dst, int src0, uint32_t desc) {
+  uint32_t *inst = gen_emit(p, GEN_OPCODE_SEND, exec_size, ctrl);
+  gen_bits(inst, 27, 24, sfid);
+  gen_set_dst(inst, dst);
+  gen_set_src0(inst, gen_vec(src0, GEN_TYPE_UD));
+  gen_set_src1(inst, ctrl & GEN_EOT ? gen_imm(GEN_TYPE_UD, desc | 1u << 31)
+                                    : gen_imm(GEN_TYPE_D, desc));
+}
+
+// waits on the notification count n0.0, e.g. for a barrier to be signaled
+static void gen_wait(gen_program_t *p) {
+  gen_reg_t n0 = {GEN_FILE_ARF, GEN_TYPE_UD, GEN_ARF_NOTIFICATION, 0, 0, 0, 0,
+                  0, 0};
+  gen_alu1(p, GEN_OPCODE_WAIT, 1, GEN_NOMASK, n0, n0);
+}
+
+typedef struct l3_preset {
+  const char *name;
+  uint32_t cntl; // L3CNTLREG
+  int slm;       // SLM is partitioned off, required by kernels using SLM
+} l3_preset_t;
+
+#define L3_PRESET_DEFAULT 0
+#define L3_PRESET_SLM 1
+
+// GEN8_L3_CNTL(SLM enable, URB, ALL, DC, RO) allocations are in ways of L3
+static const l3_preset_t l3_presets[] = {
+    {"default", GEN8_L3_CNTL_REG, 0},
+    {"slm", GEN8_L3_CNTL_REG_SLM, 1},
+    {"all-cache", GEN8_L3_CNTL(0, 32, 64, 0, 0), 0},
+    {"dc-ro", GEN8_L3_CNTL(0, 48, 0, 16, 32), 0},
+    {"ro-heavy", GEN8_L3_CNTL(0, 32, 0, 0, 64), 0},
+    {"slm-dc", GEN8_L3_CNTL(1, 16, 0, 32, 16), 1},
+};
+
+// MOCS for each CACHE_* policy, {LLC/eLLC type, target cache, LRU age}
+static const uint32_t cache_mocs[] = {
+    0x78, // {WB, L3+LLC+eLLC, 0}
+    0x38, // {UC, L3+LLC+eLLC, 0}, LLC/eLLC bypassed
+    0x28, // {UC, LLC, 0}, neither L3 nor LLC
+};
+
+typedef struct dispatch {
+  uint32_t groups;        // thread groups along X
+  uint32_t group_threads; // SIMD16 threads per group
+  uint32_t slm_size;      // shared local memory per group in bytes
+  int barrier;            // threads of a group synchronize with barriers
+  const l3_preset_t *l3;  // L3 partition, NULL picks one by slm_size
+  int input_cache;        // CACHE_* policy of the input surface
+  int output_cache;       // CACHE_* policy of the output surface
+  drm_intel_bo *indirect; // if set, {x, y, z} group counts replace groups
+  drm_intel_bo *query;    // if set, OA reports before and after the walker
+  uint32_t offset;        // global id of the first work item
+} dispatch_t;
+
+// Where the compiler placed a kernel argument
+typedef struct kernel_arg {
+  int kind;       // ARG_*
+  int curb_dword; // in every thread's CURBE slice, two dwords for an address
+  int bti;        // binding table index of an ARG_BUFFER
+} kernel_arg_t;
+
+typedef struct kernel_args {
+  const kernel_arg_t *arg;
+  int count;
+  uint32_t set; // mask of the arguments given a value
+  struct {
+    drm_intel_bo *bo; // of an ARG_BUFFER, NULL to lay out the surface only
+    uint32_t size;    // bytes of an ARG_BUFFER surface or an ARG_LOCAL
+    int cache;        // CACHE_* policy of an ARG_BUFFER
+    uint32_t value;   // of an ARG_SCALAR
+  } value[KERNEL_MAX_ARGS];
+} kernel_args_t;
+
+// The example kernels take an input and an output buffer the way Beignet lays
+// out global pointers: at binding table entries 2 and 3, with their addresses
+// following the payload in CURBE. A dispatch also passes the global id of its
+// first work item as a scalar and the SLM of a group as a local. The kernels
+// address SLM from 0 and never read the first CURBE dword, which takes the SLM
+// offset.
+static const kernel_arg_t io_args[] = {{ARG_BUFFER, 58, 2},
+                                       {ARG_BUFFER, 60, 3},
+                                       {ARG_SCALAR, 63, 0},
+                                       {ARG_LOCAL, 0, 0}};
+
 static void setup_input(uint8_t *data) {
   int *input = (int *)data;
   int i;
@@ -320,7 +773,7 @@ static void setup_input(uint8_t *data) {
     input[i] = i;
 }
 
-char kernel[] = {
+static char kernel[] = {
     // mov (16) r1.0<1>:uw 0xffff:uw { align1, h1, nomask }
     "\x01\x00\x80\x00\x4c\x16\x20\x20\x00\x00\x00\x10\xff\xff\x00\x00"
 
@@ -398,216 +851,5786 @@ static void setup_kernel0(uint8_t *data) {
   memcpy(data, kernel, sizeof kernel);
 }
 
-static void setup_curb0(uint8_t *data) {
+// Reverses every work-group of group_size values through shared local memory.
+// All threads of the group have to finish their SLM writes before any of them
+// reads back, so the kernel fences SLM and waits on the group barrier.
+static int setup_slm_kernel0(uint8_t *data, int group_size) {
+  gen_program_t p = {(uint32_t *)data, 0};
+
+  // gid = group id * local size + global offset + local id
+  gen_alu2(&p, GEN_OPCODE_MUL, 1, GEN_NOMASK, gen_scalar(10, 0, GEN_TYPE_D),
+           gen_scalar(0, 1, GEN_TYPE_D), gen_scalar(8, 6, GEN_TYPE_D));
+  gen_alu2(&p, GEN_OPCODE_ADD, 1, GEN_NOMASK, gen_scalar(10, 0, GEN_TYPE_D),
+           gen_scalar(10, 0, GEN_TYPE_D), gen_scalar(8, 7, GEN_TYPE_D));
+  gen_alu2(&p, GEN_OPCODE_ADD, 16, 0, gen_vec(12, GEN_TYPE_D),
+           gen_scalar(10, 0, GEN_TYPE_D), gen_vec(2, GEN_TYPE_D));
+  gen_alu2(&p, GEN_OPCODE_SHL, 16, 0, gen_vec(14, GEN_TYPE_UD),
+           gen_vec(12, GEN_TYPE_UD), gen_imm(GEN_TYPE_UD, 2));
+
+  // slm[lid] = input[gid]
+  gen_send(&p, 16, 0, GEN_SFID_DATAPORT1, gen_vec(16, GEN_TYPE_UW), 14,
+           0x04205e02);
+  gen_alu2(&p, GEN_OPCODE_SHL, 16, 0, gen_vec(18, GEN_TYPE_UD),
+           gen_vec(2, GEN_TYPE_UD), gen_imm(GEN_TYPE_UD, 2));
+  gen_alu1(&p, GEN_OPCODE_MOV, 16, 0, gen_vec(20, GEN_TYPE_UD),
+           gen_vec(16, GEN_TYPE_UD));
+  gen_send(&p, 16, 0, GEN_SFID_DATAPORT1, gen_arf(GEN_ARF_NULL, GEN_TYPE_UW),
+           18, 0x08025e00 | GEN_BTI_SLM);
+
+  // commit the SLM writes, then wait for the rest of the group
+  gen_alu1(&p, GEN_OPCODE_MOV, 8, GEN_NOMASK, gen_vec(22, GEN_TYPE_UD),
+           gen_vec(0, GEN_TYPE_UD));
+  gen_send(&p, 8, GEN_NOMASK, GEN_SFID_DATAPORT_DATA,
+           gen_vec(23, GEN_TYPE_UD), 22, 0x0219e000);
+  gen_alu1(&p, GEN_OPCODE_MOV, 8, GEN_NOMASK,
+           gen_arf(GEN_ARF_NULL, GEN_TYPE_UD), gen_vec(23, GEN_TYPE_UD));
+  gen_alu1(&p, GEN_OPCODE_MOV, 8, GEN_NOMASK, gen_vec(24, GEN_TYPE_UD),
+           gen_imm(GEN_TYPE_UD, 0));
+  gen_alu2(&p, GEN_OPCODE_AND, 1, GEN_NOMASK, gen_scalar(24, 2, GEN_TYPE_UD),
+           gen_scalar(0, 2, GEN_TYPE_UD), gen_imm(GEN_TYPE_UD, 0x0f000000));
+  gen_send(&p, 8, GEN_NOMASK, GEN_SFID_GATEWAY,
+           gen_arf(GEN_ARF_NULL, GEN_TYPE_UD), 24, 0x02000004);
+  gen_wait(&p);
+
+  // output[gid] = slm[group_size - 1 - lid]
+  gen_alu2(&p, GEN_OPCODE_ADD, 16, 0, gen_vec(26, GEN_TYPE_D),
+           gen_neg(gen_vec(18, GEN_TYPE_D)),
+           gen_imm(GEN_TYPE_D, (group_size - 1) * 4));
+  gen_send(&p, 16, 0, GEN_SFID_DATAPORT1, gen_vec(28, GEN_TYPE_UW), 26,
+           0x04205e00 | GEN_BTI_SLM);
+  gen_alu1(&p, GEN_OPCODE_MOV, 16, 0, gen_vec(112, GEN_TYPE_UD),
+           gen_vec(14, GEN_TYPE_UD));
+  gen_alu1(&p, GEN_OPCODE_MOV, 16, 0, gen_vec(114, GEN_TYPE_UD),
+           gen_vec(28, GEN_TYPE_UD));
+  gen_send(&p, 16, 0, GEN_SFID_DATAPORT1, gen_arf(GEN_ARF_NULL, GEN_TYPE_UW),
+           112, 0x08025e03);
+
+  gen_alu1(&p, GEN_OPCODE_MOV, 8, GEN_NOMASK, gen_vec(127, GEN_TYPE_UD),
+           gen_vec(0, GEN_TYPE_UD));
+  gen_send(&p, 8, GEN_NOMASK | GEN_EOT, GEN_SFID_THREAD_SPAWNER,
+           gen_arf(GEN_ARF_NULL, GEN_TYPE_UD), 127, 0x02000010);
+
+  return p.nr * 16;
+}
+
+// Folds the upper half of the lanes of value (and index for ARGMAX) into the
+// lower half until lane 0 holds the reduction of all of them. ARGMAX only
+// takes the upper lane if it is strictly greater, so ties keep the lowest
+// index.
+static void gen_reduce_lanes(gen_program_t *p, int op, int type, int value,
+                             int index, int lanes) {
+  int w;
+  for (w = lanes / 2; w >= 1; w /= 2) {
+    gen_reg_t a = gen_region(value, 0, type, w);
+    gen_reg_t b = gen_region(value + w / 8, w % 8, type, w);
+    switch (op) {
+    case REDUCE_SUM:
+      gen_alu2(p, GEN_OPCODE_ADD, w, GEN_NOMASK, a, a, b);
+      break;
+    case REDUCE_MIN:
+      gen_alu2(p, GEN_OPCODE_SEL, w, GEN_NOMASK | GEN_CMOD(GEN_COND_L), a, a,
+               b);
+      break;
+    case REDUCE_MAX:
+      gen_alu2(p, GEN_OPCODE_SEL, w, GEN_NOMASK | GEN_CMOD(GEN_COND_GE), a, a,
+               b);
+      break;
+    case REDUCE_ARGMAX:
+      gen_alu2(p, GEN_OPCODE_CMP, w, GEN_NOMASK | GEN_CMOD(GEN_COND_G),
+               gen_arf(GEN_ARF_NULL, type), b, a);
+      gen_alu1(p, GEN_OPCODE_MOV, w, GEN_NOMASK | GEN_PRED, a, b);
+      gen_alu1(p, GEN_OPCODE_MOV, w, GEN_NOMASK | GEN_PRED,
+               gen_region(index, 0, GEN_TYPE_D, w),
+               gen_region(index + w / 8, w % 8, GEN_TYPE_D, w));
+      break;
+    }
+  }
+}
+
+// Reduces every work-group to a single value. Each thread folds its SIMD16
+// lanes in registers and parks the result in SLM, after the barrier every
+// thread folds the partials of its group and stores the same result to
+// output[group id], or the (value, index) pair to output[2 * group id] for
+// ARGMAX. The host reduces the partials by dispatching the kernel again.
+static int setup_reduce_kernel0(uint8_t *data, int op, int type,
+                                int group_threads, uint32_t identity) {
+  gen_program_t p = {(uint32_t *)data, 0};
+
+  // gid = group id * local size + global offset + local id
+  gen_alu2(&p, GEN_OPCODE_MUL, 1, GEN_NOMASK, gen_scalar(10, 0, GEN_TYPE_D),
+           gen_scalar(0, 1, GEN_TYPE_D), gen_scalar(8, 6, GEN_TYPE_D));
+  gen_alu2(&p, GEN_OPCODE_ADD, 1, GEN_NOMASK, gen_scalar(10, 0, GEN_TYPE_D),
+           gen_scalar(10, 0, GEN_TYPE_D), gen_scalar(8, 7, GEN_TYPE_D));
+  gen_alu2(&p, GEN_OPCODE_ADD, 16, 0, gen_vec(12, GEN_TYPE_D),
+           gen_scalar(10, 0, GEN_TYPE_D), gen_vec(2, GEN_TYPE_D));
+  gen_alu2(&p, GEN_OPCODE_SHL, 16, 0, gen_vec(14, GEN_TYPE_UD),
+           gen_vec(12, GEN_TYPE_UD), gen_imm(GEN_TYPE_UD, 2));
+
+  // value = input[gid], index = gid
+  gen_send(&p, 16, 0, GEN_SFID_DATAPORT1, gen_vec(16, GEN_TYPE_UW), 14,
+           0x04205e02);
+  gen_alu1(&p, GEN_OPCODE_MOV, 16, 0, gen_vec(18, GEN_TYPE_D),
+           gen_vec(12, GEN_TYPE_D));
+  gen_reduce_lanes(&p, op, type, 16, 18, SIMD_WIDTH);
+
+  // slm[thread] = value, every lane stores the same dword
+  gen_alu2(&p, GEN_OPCODE_SHR, 16, 0, gen_vec(26, GEN_TYPE_UD),
+           gen_scalar(2, 0, GEN_TYPE_UD), gen_imm(GEN_TYPE_UD, 2));
+  gen_alu1(&p, GEN_OPCODE_MOV, 16, 0, gen_vec(28, GEN_TYPE_UD),
+           gen_scalar(16, 0, GEN_TYPE_UD));
+  gen_send(&p, 16, 0, GEN_SFID_DATAPORT1, gen_arf(GEN_ARF_NULL, GEN_TYPE_UW),
+           26, 0x08025e00 | GEN_BTI_SLM);
+  if (op == REDUCE_ARGMAX) {
+    gen_alu2(&p, GEN_OPCODE_ADD, 16, 0, gen_vec(30, GEN_TYPE_UD),
+             gen_vec(26, GEN_TYPE_UD), gen_imm(GEN_TYPE_UD, REDUCE_SLM_INDEX));
+    gen_alu1(&p, GEN_OPCODE_MOV, 16, 0, gen_vec(32, GEN_TYPE_UD),
+             gen_scalar(18, 0, GEN_TYPE_UD));
+    gen_send(&p, 16, 0, GEN_SFID_DATAPORT1,
+             gen_arf(GEN_ARF_NULL, GEN_TYPE_UW), 30,
+             0x08025e00 | GEN_BTI_SLM);
+  }
+
+  // commit the SLM writes, then wait for the rest of the group
+  gen_alu1(&p, GEN_OPCODE_MOV, 8, GEN_NOMASK, gen_vec(22, GEN_TYPE_UD),
+           gen_vec(0, GEN_TYPE_UD));
+  gen_send(&p, 8, GEN_NOMASK, GEN_SFID_DATAPORT_DATA,
+           gen_vec(23, GEN_TYPE_UD), 22, 0x0219e000);
+  gen_alu1(&p, GEN_OPCODE_MOV, 8, GEN_NOMASK,
+           gen_arf(GEN_ARF_NULL, GEN_TYPE_UD), gen_vec(23, GEN_TYPE_UD));
+  gen_alu1(&p, GEN_OPCODE_MOV, 8, GEN_NOMASK, gen_vec(24, GEN_TYPE_UD),
+           gen_imm(GEN_TYPE_UD, 0));
+  gen_alu2(&p, GEN_OPCODE_AND, 1, GEN_NOMASK, gen_scalar(24, 2, GEN_TYPE_UD),
+           gen_scalar(0, 2, GEN_TYPE_UD), gen_imm(GEN_TYPE_UD, 0x0f000000));
+  gen_send(&p, 8, GEN_NOMASK, GEN_SFID_GATEWAY,
+           gen_arf(GEN_ARF_NULL, GEN_TYPE_UD), 24, 0x02000004);
+  gen_wait(&p);
+
+  // lane i loads the partial of thread min(i, group_threads - 1), lanes past
+  // the last thread are then reset to the identity
+  gen_alu2(&p, GEN_OPCODE_AND, 16, 0, gen_vec(20, GEN_TYPE_UD),
+           gen_vec(2, GEN_TYPE_UD), gen_imm(GEN_TYPE_UD, SIMD_WIDTH - 1));
+  gen_alu2(&p, GEN_OPCODE_SEL, 16, GEN_CMOD(GEN_COND_L),
+           gen_vec(34, GEN_TYPE_UD), gen_vec(20, GEN_TYPE_UD),
+           gen_imm(GEN_TYPE_UD, group_threads - 1));
+  gen_alu2(&p, GEN_OPCODE_SHL, 16, 0, gen_vec(34, GEN_TYPE_UD),
+           gen_vec(34, GEN_TYPE_UD), gen_imm(GEN_TYPE_UD, 2));
+  gen_send(&p, 16, 0, GEN_SFID_DATAPORT1, gen_vec(16, GEN_TYPE_UW), 34,
+           0x04205e00 | GEN_BTI_SLM);
+  if (op == REDUCE_ARGMAX) {
+    gen_alu2(&p, GEN_OPCODE_ADD, 16, 0, gen_vec(30, GEN_TYPE_UD),
+             gen_vec(34, GEN_TYPE_UD), gen_imm(GEN_TYPE_UD, REDUCE_SLM_INDEX));
+    gen_send(&p, 16, 0, GEN_SFID_DATAPORT1, gen_vec(18, GEN_TYPE_UW), 30,
+             0x04205e00 | GEN_BTI_SLM);
+  }
+  gen_alu2(&p, GEN_OPCODE_CMP, 16, GEN_CMOD(GEN_COND_GE),
+           gen_arf(GEN_ARF_NULL, GEN_TYPE_UD), gen_vec(20, GEN_TYPE_UD),
+           gen_imm(GEN_TYPE_UD, group_threads));
+  gen_alu1(&p, GEN_OPCODE_MOV, 16, GEN_PRED, gen_vec(16, GEN_TYPE_UD),
+           gen_imm(GEN_TYPE_UD, identity));
+  gen_reduce_lanes(&p, op, type, 16, 18, SIMD_WIDTH);
+
+  // output[group id] = value, or for ARGMAX even lanes store the value and
+  // odd lanes the index
+  gen_alu1(&p, GEN_OPCODE_MOV, 16, 0, gen_vec(38, GEN_TYPE_UD),
+           gen_scalar(16, 0, GEN_TYPE_UD));
+  if (op == REDUCE_ARGMAX) {
+    gen_alu2(&p, GEN_OPCODE_AND, 16, 0, gen_vec(40, GEN_TYPE_UD),
+             gen_vec(2, GEN_TYPE_UD), gen_imm(GEN_TYPE_UD, 1));
+    gen_alu2(&p, GEN_OPCODE_SHL, 1, GEN_NOMASK, gen_scalar(10, 1, GEN_TYPE_UD),
+             gen_scalar(0, 1, GEN_TYPE_UD), gen_imm(GEN_TYPE_UD, 3));
+    gen_alu2(&p, GEN_OPCODE_SHL, 16, 0, gen_vec(36, GEN_TYPE_UD),
+             gen_vec(40, GEN_TYPE_UD), gen_imm(GEN_TYPE_UD, 2));
+    gen_alu2(&p, GEN_OPCODE_ADD, 16, 0, gen_vec(36, GEN_TYPE_UD),
+             gen_vec(36, GEN_TYPE_UD), gen_scalar(10, 1, GEN_TYPE_UD));
+    gen_alu2(&p, GEN_OPCODE_CMP, 16, GEN_CMOD(GEN_COND_NZ),
+             gen_arf(GEN_ARF_NULL, GEN_TYPE_UD), gen_vec(40, GEN_TYPE_UD),
+             gen_imm(GEN_TYPE_UD, 0));
+    gen_alu1(&p, GEN_OPCODE_MOV, 16, GEN_PRED, gen_vec(38, GEN_TYPE_UD),
+             gen_scalar(18, 0, GEN_TYPE_UD));
+  } else {
+    gen_alu2(&p, GEN_OPCODE_SHL, 16, 0, gen_vec(36, GEN_TYPE_UD),
+             gen_scalar(0, 1, GEN_TYPE_UD), gen_imm(GEN_TYPE_UD, 2));
+  }
+  gen_send(&p, 16, 0, GEN_SFID_DATAPORT1, gen_arf(GEN_ARF_NULL, GEN_TYPE_UW),
+           36, 0x08025e03);
+
+  gen_alu1(&p, GEN_OPCODE_MOV, 8, GEN_NOMASK, gen_vec(127, GEN_TYPE_UD),
+           gen_vec(0, GEN_TYPE_UD));
+  gen_send(&p, 8, GEN_NOMASK | GEN_EOT, GEN_SFID_THREAD_SPAWNER,
+           gen_arf(GEN_ARF_NULL, GEN_TYPE_UD), 127, 0x02000010);
+
+  return p.nr * 16;
+}
+
+// Doubles every element of the input. Each work-item loads one dword through
+// the raw surface, so a SIMD16 thread covers 64 bytes whatever the element
+// size, and the ALU then works on strided views of the packed elements.
+static int setup_typed_kernel0(uint8_t *data, int elem) {
+  gen_program_t p = {(uint32_t *)data, 0};
+  int i, type, stride;
+
+  // gid = group id * local size + global offset + local id
+  gen_alu2(&p, GEN_OPCODE_MUL, 1, GEN_NOMASK, gen_scalar(10, 0, GEN_TYPE_D),
+           gen_scalar(0, 1, GEN_TYPE_D), gen_scalar(8, 6, GEN_TYPE_D));
+  gen_alu2(&p, GEN_OPCODE_ADD, 1, GEN_NOMASK, gen_scalar(10, 0, GEN_TYPE_D),
+           gen_scalar(10, 0, GEN_TYPE_D), gen_scalar(8, 7, GEN_TYPE_D));
+  gen_alu2(&p, GEN_OPCODE_ADD, 16, 0, gen_vec(12, GEN_TYPE_D),
+           gen_scalar(10, 0, GEN_TYPE_D), gen_vec(2, GEN_TYPE_D));
+  gen_alu2(&p, GEN_OPCODE_SHL, 16, 0, gen_vec(14, GEN_TYPE_UD),
+           gen_vec(12, GEN_TYPE_UD), gen_imm(GEN_TYPE_UD, 2));
+  gen_send(&p, 16, 0, GEN_SFID_DATAPORT1, gen_vec(16, GEN_TYPE_UW), 14,
+           0x04205e02);
+
+  // output = input + input on the element type, r16-r17 hold 64 bytes
+  switch (elem) {
+  case ELEM_INT32:
+  case ELEM_FLOAT32:
+    type = elem == ELEM_INT32 ? GEN_TYPE_D : GEN_TYPE_F;
+    gen_alu2(&p, GEN_OPCODE_ADD, 16, 0, gen_vec(16, type), gen_vec(16, type),
+             gen_vec(16, type));
+    break;
+  case ELEM_FLOAT16:
+  case ELEM_INT16:
+  case ELEM_INT8:
+    type = elem == ELEM_FLOAT16 ? GEN_TYPE_HF
+                                : elem == ELEM_INT16 ? GEN_TYPE_W : GEN_TYPE_B;
+    stride = 4 / gen_type_size[type];
+    for (i = 0; i < stride; i++) {
+      gen_reg_t r = gen_strided(16, i, type, stride);
+      gen_alu2(&p, GEN_OPCODE_ADD, 16, 0, r, r, r);
+    }
+    break;
+  case ELEM_INT64:
+    gen_alu2(&p, GEN_OPCODE_ADD, 8, 0, gen_vec(16, GEN_TYPE_Q),
+             gen_vec(16, GEN_TYPE_Q), gen_vec(16, GEN_TYPE_Q));
+    break;
+  }
+
+  gen_alu1(&p, GEN_OPCODE_MOV, 16, 0, gen_vec(112, GEN_TYPE_UD),
+           gen_vec(14, GEN_TYPE_UD));
+  gen_alu1(&p, GEN_OPCODE_MOV, 16, 0, gen_vec(114, GEN_TYPE_UD),
+           gen_vec(16, GEN_TYPE_UD));
+  gen_send(&p, 16, 0, GEN_SFID_DATAPORT1, gen_arf(GEN_ARF_NULL, GEN_TYPE_UW),
+           112, 0x08025e03);
+
+  gen_alu1(&p, GEN_OPCODE_MOV, 8, GEN_NOMASK, gen_vec(127, GEN_TYPE_UD),
+           gen_vec(0, GEN_TYPE_UD));
+  gen_send(&p, 8, GEN_NOMASK | GEN_EOT, GEN_SFID_THREAD_SPAWNER,
+           gen_arf(GEN_ARF_NULL, GEN_TYPE_UD), 127, 0x02000010);
+
+  return p.nr * 16;
+}
+
+// Sizes a dispatch over the element count in dword 0 of the input: writes
+// {groups, 1, 1} for an indirect GPGPU_WALKER to the output. Runs as a single
+// thread.
+static int setup_count_kernel0(uint8_t *data) {
+  gen_program_t p = {(uint32_t *)data, 0};
+
+  // every lane loads the count
+  gen_alu1(&p, GEN_OPCODE_MOV, 16, 0, gen_vec(14, GEN_TYPE_UD),
+           gen_imm(GEN_TYPE_UD, 0));
+  gen_send(&p, 16, 0, GEN_SFID_DATAPORT1, gen_vec(16, GEN_TYPE_UW), 14,
+           0x04205e02);
+  gen_alu2(&p, GEN_OPCODE_ADD, 16, 0, gen_vec(16, GEN_TYPE_UD),
+           gen_vec(16, GEN_TYPE_UD), gen_imm(GEN_TYPE_UD, GROUP_SIZE - 1));
+  gen_alu2(&p, GEN_OPCODE_SHR, 16, 0, gen_vec(16, GEN_TYPE_UD),
+           gen_vec(16, GEN_TYPE_UD), gen_imm(GEN_TYPE_UD, ffs(GROUP_SIZE) - 1));
+
+  // output[lane] = lane ? 1 : groups, lanes past z fill the rest of the 64 byte
+  // surface with 1 and the walker only loads dwords 0-2
+  gen_alu2(&p, GEN_OPCODE_AND, 16, 0, gen_vec(20, GEN_TYPE_UD),
+           gen_vec(2, GEN_TYPE_UD), gen_imm(GEN_TYPE_UD, SIMD_WIDTH - 1));
+  gen_alu2(&p, GEN_OPCODE_SHL, 16, 0, gen_vec(36, GEN_TYPE_UD),
+           gen_vec(20, GEN_TYPE_UD), gen_imm(GEN_TYPE_UD, 2));
+  gen_alu1(&p, GEN_OPCODE_MOV, 16, 0, gen_vec(38, GEN_TYPE_UD),
+           gen_imm(GEN_TYPE_UD, 1));
+  gen_alu2(&p, GEN_OPCODE_CMP, 16, GEN_CMOD(GEN_COND_Z),
+           gen_arf(GEN_ARF_NULL, GEN_TYPE_UD), gen_vec(20, GEN_TYPE_UD),
+           gen_imm(GEN_TYPE_UD, 0));
+  gen_alu1(&p, GEN_OPCODE_MOV, 16, GEN_PRED, gen_vec(38, GEN_TYPE_UD),
+           gen_vec(16, GEN_TYPE_UD));
+  gen_send(&p, 16, 0, GEN_SFID_DATAPORT1, gen_arf(GEN_ARF_NULL, GEN_TYPE_UW),
+           36, 0x08025e03);
+
+  gen_alu1(&p, GEN_OPCODE_MOV, 8, GEN_NOMASK, gen_vec(127, GEN_TYPE_UD),
+           gen_vec(0, GEN_TYPE_UD));
+  gen_send(&p, 8, GEN_NOMASK | GEN_EOT, GEN_SFID_THREAD_SPAWNER,
+           gen_arf(GEN_ARF_NULL, GEN_TYPE_UD), 127, 0x02000010);
+
+  return p.nr * 16;
+}
+
+static void setup_curb0(uint8_t *data, const dispatch_t *d) {
   int *curb = (int *)data;
   int i, j;
   int id_offset = 8;
   int count_offset = 60;
-  for (i = 0; i < 4; i++) {
+  int local_size_offset = 62;
+  for (i = 0; i < d->group_threads; i++) {
     int slice = i * 64;
-    for (j = 0; j < 16; j++) {
-      curb[slice + id_offset + j] = j + (i * 16);
+    for (j = 0; j < SIMD_WIDTH; j++) {
+      curb[slice + id_offset + j] = j + (i * SIMD_WIDTH);
     }
     // curb[slice + count_offset] = 64;
+    curb[slice + local_size_offset] = d->group_threads * SIMD_WIDTH;
   }
 }
 
-static void setup_idrt0(uint8_t *data) {
+// SLM is allocated in power of two multiples of 4K
+static uint32_t slm_size_encoding(uint32_t size) {
+  uint32_t slm = 4096;
+  if (!size)
+    return 0;
+  while (slm < size)
+    slm <<= 1;
+  return slm / 4096;
+}
+
+// Bytes of SLM an encoding allocates, the inverse of slm_size_encoding.
+static uint32_t slm_size_bytes(uint32_t encoding) {
+  return encoding * 4096;
+}
+
+static void setup_idrt0(uint8_t *data, const dispatch_t *d) {
   gen8_interface_descriptor_t *idrt = (gen8_interface_descriptor_t *)data;
   // idrt[0].desc3.sampler_state_pointer = 1088;
   idrt[0].desc5.curbe_read_len = 8;
-  idrt[0].desc6.group_threads_num = 4;
+  idrt[0].desc6.group_threads_num = d->group_threads;
+  idrt[0].desc6.barrier_enable = d->barrier;
+  idrt[0].desc6.slm_sz = slm_size_encoding(d->slm_size);
 }
 
-static void setup_heap0(uint8_t *data) {
-  uint32_t *bind = (uint32_t *)data;
-  gen8_surface_state_t *srfc = (gen8_surface_state_t *)(data + 1024);
+static void setup_buffer_surface(gen8_surface_state_t *srfc, uint32_t size,
+                                 int cache) {
+  // buffer size - 1 is split across width[6:0], height[20:7], depth[30:21]
+  uint32_t n = size - 1;
+  srfc->ss0.surface_format = 511;
+  srfc->ss0.surface_type = 4;
+  srfc->ss1.mem_obj_ctrl_state = cache_mocs[cache];
+  srfc->ss2.width = n & 0x7f;
+  srfc->ss2.height = (n >> 7) & 0x3fff;
+  srfc->ss3.depth = (n >> 21) & 0x3ff;
+}
 
-  bind[2] = 1152;
-  bind[3] = 1216;
+static void kernel_args_init(kernel_args_t *a, const kernel_arg_t *arg,
+                             int count) {
+  a->arg = arg;
+  a->count = count;
+  a->set = 0;
+}
 
-  srfc[2].ss0.surface_format = 511;
-  srfc[2].ss0.surface_type = 4;
-  srfc[2].ss1.mem_obj_ctrl_state = 120;
-  srfc[2].ss2.width = 127;
-  srfc[2].ss2.height = 1;
-  srfc[3].ss0.surface_format = 511;
-  srfc[3].ss0.surface_type = 4;
-  srfc[3].ss1.mem_obj_ctrl_state = 120;
-  srfc[3].ss2.width = 127;
-  srfc[3].ss2.height = 1;
+// clSetKernelArg for each kind of argument, -EINVAL if argument i is not of
+// that kind
+static int kernel_set_buffer(kernel_args_t *a, int i, drm_intel_bo *bo,
+                             uint32_t size, int cache) {
+  if (i >= a->count || a->arg[i].kind != ARG_BUFFER)
+    return -EINVAL;
+  a->value[i].bo = bo;
+  a->value[i].size = size;
+  a->value[i].cache = cache;
+  a->set |= 1u << i;
+  return 0;
 }
 
-static void setup_batch0(uint8_t *data) {
-  uint32_t *batch = (uint32_t *)data;
-  int i = 0;
+static int kernel_set_scalar(kernel_args_t *a, int i, uint32_t value) {
+  if (i >= a->count || a->arg[i].kind != ARG_SCALAR)
+    return -EINVAL;
+  a->value[i].value = value;
+  a->set |= 1u << i;
+  return 0;
+}
+
+static int kernel_set_local(kernel_args_t *a, int i, uint32_t size) {
+  if (i >= a->count || a->arg[i].kind != ARG_LOCAL)
+    return -EINVAL;
+  a->value[i].size = size;
+  a->set |= 1u << i;
+  return 0;
+}
+
+// Packs the arguments into the state buffer in one pass: the binding table
+// entry and surface state of each buffer, the value of each scalar and the
+// SLM offset of each local in every thread's CURBE slice. Buffer addresses
+// are left to emit_arg_relocs0. Returns the SLM bytes of the locals.
+static uint32_t setup_args0(uint8_t *data, const kernel_args_t *a,
+                            const dispatch_t *d) {
+  surface_heap_t *heap = (surface_heap_t *)data;
+  uint32_t *curb = (uint32_t *)(data + CURB_OFFSET);
+  uint32_t value, slm = 0;
+  int i, t;
+
+  for (i = 0; i < a->count; i++) {
+    const kernel_arg_t *arg = &a->arg[i];
+    if (!(a->set & 1u << i))
+      continue;
+    if (arg->kind == ARG_BUFFER) {
+      heap->binding_table[arg->bti] =
+          SRFC_OFFSET + arg->bti * sizeof(gen8_surface_state_t);
+      setup_buffer_surface(&heap->surface[arg->bti], a->value[i].size,
+                           a->value[i].cache);
+      continue;
+    }
+    value = arg->kind == ARG_SCALAR ? a->value[i].value : slm;
+    if (arg->kind == ARG_LOCAL)
+      slm += a->value[i].size;
+    for (t = 0; t < d->group_threads; t++)
+      curb[t * 64 + arg->curb_dword] = value;
+  }
+  return slm;
+}
+
+// Binds the buffers of d and passes its offset and SLM as arguments. Returns
+// the SLM bytes per group the arguments ask for.
+static uint32_t setup_heap0(uint8_t *data, uint32_t size,
+                            const dispatch_t *d) {
+  kernel_args_t a;
+
+  kernel_args_init(&a, io_args, 4);
+  kernel_set_buffer(&a, 0, NULL, size, d->input_cache);
+  kernel_set_buffer(&a, 1, NULL, size, d->output_cache);
+  kernel_set_scalar(&a, 2, d->offset);
+  if (d->slm_size)
+    kernel_set_local(&a, 3, d->slm_size);
+  return setup_args0(data, &a, d);
+}
+
+static const l3_preset_t *dispatch_l3(const dispatch_t *d) {
+  return d->l3 ? d->l3
+               : &l3_presets[d->slm_size ? L3_PRESET_SLM : L3_PRESET_DEFAULT];
+}
+
+// Command packets. The dword length in the header is derived from the packet
+// size and every packet is checked against its PRM length at build time, so
+// fields are set by name and OUT_PACKET stores the whole packet at once.
+#define CMD_LENGTH(type) (sizeof(type) / sizeof(uint32_t) - 2)
+#define CMD_DWORDS(type, n)                                                    \
+  _Static_assert(sizeof(type) == (n) * sizeof(uint32_t), #type " length")
+#define OUT_PACKET(type, cmd, ...)                                             \
+  do {                                                                         \
+    const type packet = {.header = (cmd) | CMD_LENGTH(type), __VA_ARGS__};     \
+    memcpy(batch + i, &packet, sizeof(packet));                                \
+    i += sizeof(packet) / sizeof(uint32_t);                                    \
+  } while (0)
+
+typedef struct gen8_pipe_control {
+  uint32_t header;
+  struct {
+    uint32_t pad : 5;
+    uint32_t dc_flush_enable : 1;
+    uint32_t pad2 : 4;
+    uint32_t texture_cache_invalidation_enable : 1;
+    uint32_t pad3 : 1;
+    uint32_t render_target_cache_flush_enable : 1;
+    uint32_t pad4 : 7;
+    uint32_t cs_stall : 1;
+    uint32_t pad5 : 11;
+  } flags;
+  uint32_t address_lo;
+  uint32_t address_hi;
+  uint32_t immediate_lo;
+  uint32_t immediate_hi;
+} gen8_pipe_control_t;
+CMD_DWORDS(gen8_pipe_control_t, 6);
+
+typedef struct gen8_load_register_imm {
+  uint32_t header;
+  uint32_t register_offset;
+  uint32_t data;
+} gen8_load_register_imm_t;
+CMD_DWORDS(gen8_load_register_imm_t, 3);
+
+typedef struct gen8_load_register_mem {
+  uint32_t header;
+  uint32_t register_address;
+  uint32_t memory_address_lo;
+  uint32_t memory_address_hi;
+} gen8_load_register_mem_t;
+CMD_DWORDS(gen8_load_register_mem_t, 4);
+
+typedef struct gen8_report_perf_count {
+  uint32_t header;
+  uint32_t address_lo; // 64 byte aligned
+  uint32_t address_hi;
+  uint32_t report_id;
+} gen8_report_perf_count_t;
+CMD_DWORDS(gen8_report_perf_count_t, 4);
+
+typedef struct gen8_batch_buffer_start {
+  uint32_t header;
+  uint32_t address_lo;
+  uint32_t address_hi;
+} gen8_batch_buffer_start_t;
+CMD_DWORDS(gen8_batch_buffer_start_t, 3);
+
+typedef struct gen8_base_address {
+  uint32_t modify : 1;
+  uint32_t pad : 3;
+  uint32_t mocs : 7;
+  uint32_t pad2 : 1;
+  uint32_t address : 20;
+  uint32_t address_hi;
+} gen8_base_address_t;
+
+typedef struct gen8_buffer_size {
+  uint32_t modify : 1;
+  uint32_t pad : 11;
+  uint32_t size : 20; /* in pages */
+} gen8_buffer_size_t;
+
+typedef struct gen8_state_base_address {
+  uint32_t header;
+  gen8_base_address_t general_state;
+  struct {
+    uint32_t pad : 16;
+    uint32_t mocs : 7;
+    uint32_t pad2 : 9;
+  } stateless_data_port;
+  gen8_base_address_t surface_state;
+  gen8_base_address_t dynamic_state;
+  gen8_base_address_t indirect_object;
+  gen8_base_address_t instruction;
+  gen8_buffer_size_t general_state_size;
+  gen8_buffer_size_t dynamic_state_size;
+  gen8_buffer_size_t indirect_object_size;
+  gen8_buffer_size_t instruction_size;
+} gen8_state_base_address_t;
+CMD_DWORDS(gen8_state_base_address_t, 16);
+
+typedef struct gen8_media_vfe_state {
+  uint32_t header;
+  uint32_t scratch_space;
+  uint32_t scratch_space_hi;
+  struct {
+    uint32_t pad : 6;
+    uint32_t bypass_gateway_control : 1;
+    uint32_t reset_gateway_timer : 1;
+    uint32_t number_of_urb_entries : 8;
+    uint32_t maximum_number_of_threads : 16;
+  } dw3;
+  uint32_t dw4;
+  struct {
+    uint32_t curbe_allocation_size : 16;
+    uint32_t urb_entry_allocation_size : 16;
+  } dw5;
+  uint32_t scoreboard[3];
+} gen8_media_vfe_state_t;
+CMD_DWORDS(gen8_media_vfe_state_t, 9);
+
+// MEDIA_CURBE_LOAD and MEDIA_INTERFACE_DESCRIPTOR_LOAD
+typedef struct gen8_media_load {
+  uint32_t header;
+  uint32_t pad;
+  uint32_t length;
+  uint32_t address;
+} gen8_media_load_t;
+CMD_DWORDS(gen8_media_load_t, 4);
+
+typedef struct gen8_gpgpu_walker {
+  uint32_t header;
+  uint32_t interface_descriptor_offset;
+  uint32_t indirect_data_length;
+  uint32_t indirect_data_address;
+  struct {
+    uint32_t thread_width_max : 6;
+    uint32_t pad : 2;
+    uint32_t thread_height_max : 6;
+    uint32_t pad2 : 2;
+    uint32_t thread_depth_max : 6;
+    uint32_t pad3 : 8;
+    uint32_t simd_size : 2; /* 0 - SIMD8, 1 - SIMD16, 2 - SIMD32 */
+  } threads;
+  uint32_t group_x;
+  uint32_t pad;
+  uint32_t groups_x;
+  uint32_t group_y;
+  uint32_t pad2;
+  uint32_t groups_y;
+  uint32_t group_z;
+  uint32_t groups_z;
+  uint32_t right_mask;
+  uint32_t bottom_mask;
+} gen8_gpgpu_walker_t;
+CMD_DWORDS(gen8_gpgpu_walker_t, 15);
+
+typedef struct gen8_media_state_flush {
+  uint32_t header;
+  uint32_t flags;
+} gen8_media_state_flush_t;
+CMD_DWORDS(gen8_media_state_flush_t, 2);
+
+#define STATE_MOCS 0x78
+#define BASE_ADDRESS {.modify = 1, .mocs = STATE_MOCS}
+#define BUFFER_SIZE_MAX {.modify = 1, .size = 0xfffff}
+#define FLUSH_FLAGS                                                            \
+  {.dc_flush_enable = 1, .texture_cache_invalidation_enable = 1,               \
+   .render_target_cache_flush_enable = 1, .cs_stall = 1}
+
+// relocations are emitted at fixed dwords of the prologue and the call
+_Static_assert(PROLOGUE_DWORDS == (2 * sizeof(gen8_pipe_control_t) +
+                                   sizeof(gen8_load_register_imm_t) +
+                                   sizeof(uint32_t) +
+                                   sizeof(gen8_state_base_address_t) +
+                                   sizeof(gen8_media_vfe_state_t)) /
+                                      sizeof(uint32_t),
+               "prologue length");
+_Static_assert(CALL_DWORDS == sizeof(gen8_batch_buffer_start_t) /
+                                  sizeof(uint32_t),
+               "call length");
 
 #define OUT_BATCH(x) batch[i++] = x
 
-  OUT_BATCH(CMD_PIPE_CONTROL | 4);
-  OUT_BATCH(0x00000000);
-  OUT_BATCH(0x00101420);
-  OUT_BATCH(0x00000000);
-  OUT_BATCH(0x00000000);
-  OUT_BATCH(0x00000000);
+// Commands shared by all dispatches with the same state buffer, kernel buffer
+// and L3 configuration.
+static int emit_prologue0(uint32_t *batch, const dispatch_t *d) {
+  const l3_preset_t *l3 = dispatch_l3(d);
+  int i = 0;
+
+  OUT_PACKET(gen8_pipe_control_t, CMD_PIPE_CONTROL, .flags = FLUSH_FLAGS);
 
-  OUT_BATCH(CMD_LOAD_REGISTER_IMM | 1);
-  OUT_BATCH(GEN8_L3_CNTL_REG_ADDRESS_OFFSET);
-  OUT_BATCH(0x60000160);
+  OUT_PACKET(gen8_load_register_imm_t, CMD_LOAD_REGISTER_IMM,
+             .register_offset = GEN8_L3_CNTL_REG_ADDRESS_OFFSET,
+             .data = l3->cntl);
 
-  OUT_BATCH(CMD_PIPE_CONTROL | 4);
-  OUT_BATCH(0x00000000);
-  OUT_BATCH(0x00101420);
-  OUT_BATCH(0x00000000);
-  OUT_BATCH(0x00000000);
-  OUT_BATCH(0x00000000);
+  OUT_PACKET(gen8_pipe_control_t, CMD_PIPE_CONTROL, .flags = FLUSH_FLAGS);
 
   OUT_BATCH(CMD_PIPELINE_SELECT | PIPELINE_SELECT_GPGPU);
 
-  OUT_BATCH(CMD_STATE_BASE_ADDRESS | 14);
-  OUT_BATCH(0x00000781);
-  OUT_BATCH(0x00000000);
-  OUT_BATCH(0x00780000);
-  OUT_BATCH(0x00000781);
-  OUT_BATCH(0x00000000);
-  OUT_BATCH(0x00000781);
-  OUT_BATCH(0x00000000);
-  OUT_BATCH(0x00000781);
-  OUT_BATCH(0x00000000);
-  OUT_BATCH(0x00000781);
-  OUT_BATCH(0x00000000);
-  OUT_BATCH(0xfffff001);
-  OUT_BATCH(0xfffff001);
-  OUT_BATCH(0xfffff001);
-  OUT_BATCH(0xfffff001);
-
-  OUT_BATCH(CMD_MEDIA_STATE_POINTERS | (9 - 2));
-  OUT_BATCH(0x00000000);
-  OUT_BATCH(0x00000000);
-  OUT_BATCH(0x014f02c0);
-  OUT_BATCH(0x00000000);
-  OUT_BATCH(0x00020200);
-  OUT_BATCH(0x00000000);
-  OUT_BATCH(0x00000000);
-  OUT_BATCH(0x00000000);
-
-  OUT_BATCH(CMD_MEDIA_CURBE_LOAD | (4 - 2));
-  OUT_BATCH(0x00000000);
-  OUT_BATCH(0x00004000);
-  OUT_BATCH(0x00004400);
-
-  OUT_BATCH(CMD_MEDIA_INTERFACE_DESCRIPTOR_LOAD | (4 - 2));
-  OUT_BATCH(0x00000000);
-  OUT_BATCH(0x00000020);
-  OUT_BATCH(0x00008400);
-
-  OUT_BATCH(CMD_GPGPU_WALKER | 13);
-  OUT_BATCH(0x00000000);
-  OUT_BATCH(0x00000000);
-  OUT_BATCH(0x00000000);
-  OUT_BATCH(0x40000003);
-  OUT_BATCH(0x00000000);
-  OUT_BATCH(0x00000000);
-  OUT_BATCH(0x00000001);
-  OUT_BATCH(0x00000000);
-  OUT_BATCH(0x00000000);
-  OUT_BATCH(0x00000001);
-  OUT_BATCH(0x00000000);
-  OUT_BATCH(0x00000001);
-  OUT_BATCH(0x0000ffff);
-  OUT_BATCH(0xffffffff);
-
-  OUT_BATCH(CMD_MEDIA_STATE_FLUSH | 0);
-  OUT_BATCH(0);
-
-  OUT_BATCH(CMD_PIPE_CONTROL | 4);
-  OUT_BATCH(0x00000000);
-  OUT_BATCH(0x00101420);
-  OUT_BATCH(0x00000000);
-  OUT_BATCH(0x00000000);
-  OUT_BATCH(0x00000000);
-  OUT_BATCH(0x00000000);
+  // surface, dynamic and instruction addresses are relocated by
+  // emit_prologue_relocs0
+  OUT_PACKET(gen8_state_base_address_t, CMD_STATE_BASE_ADDRESS,
+             .general_state = BASE_ADDRESS,
+             .stateless_data_port.mocs = STATE_MOCS,
+             .surface_state = BASE_ADDRESS, .dynamic_state = BASE_ADDRESS,
+             .indirect_object = BASE_ADDRESS, .instruction = BASE_ADDRESS,
+             .general_state_size = BUFFER_SIZE_MAX,
+             .dynamic_state_size = BUFFER_SIZE_MAX,
+             .indirect_object_size = BUFFER_SIZE_MAX,
+             .instruction_size = BUFFER_SIZE_MAX);
+
+  OUT_PACKET(gen8_media_vfe_state_t, CMD_MEDIA_VFE_STATE,
+             .dw3 = {.bypass_gateway_control = 1,
+                     .reset_gateway_timer = 1,
+                     .number_of_urb_entries = 2,
+                     .maximum_number_of_threads = 335},
+             .dw5 = {.curbe_allocation_size = 512,
+                     .urb_entry_allocation_size = 2});
+
+  return i;
+}
+
+// Commands of a single dispatch, starting at dword i.
+static int emit_walker0(uint32_t *batch, int i, const dispatch_t *d) {
+  OUT_PACKET(gen8_media_load_t, CMD_MEDIA_CURBE_LOAD, .length = 0x4000,
+             .address = CURB_OFFSET);
+
+  OUT_PACKET(gen8_media_load_t, CMD_MEDIA_INTERFACE_DESCRIPTOR_LOAD,
+             .length = sizeof(gen8_interface_descriptor_t),
+             .address = IDRT_OFFSET);
+
+  if (d->indirect) {
+    // addresses are relocated by emit_indirect_relocs0
+    OUT_PACKET(gen8_load_register_mem_t, CMD_LOAD_REGISTER_MEM,
+               .register_address = GPGPU_DISPATCHDIMX,
+               .memory_address_lo = 0);
+    OUT_PACKET(gen8_load_register_mem_t, CMD_LOAD_REGISTER_MEM,
+               .register_address = GPGPU_DISPATCHDIMY,
+               .memory_address_lo = 4);
+    OUT_PACKET(gen8_load_register_mem_t, CMD_LOAD_REGISTER_MEM,
+               .register_address = GPGPU_DISPATCHDIMZ,
+               .memory_address_lo = 8);
+  }
+
+  if (d->query) {
+    // addresses are relocated by emit_query_relocs0
+    OUT_PACKET(gen8_report_perf_count_t, CMD_REPORT_PERF_COUNT,
+               .address_lo = 0, .report_id = OA_REPORT_BEGIN);
+  }
+
+  OUT_PACKET(gen8_gpgpu_walker_t,
+             CMD_GPGPU_WALKER | (d->indirect ? GPGPU_WALKER_INDIRECT : 0),
+             .threads = {.thread_width_max = d->group_threads - 1,
+                         .simd_size = 1},
+             .groups_x = d->groups, .groups_y = 1, .groups_z = 1,
+             .right_mask = 0x0000ffff, .bottom_mask = 0xffffffff);
+
+  OUT_PACKET(gen8_media_state_flush_t, CMD_MEDIA_STATE_FLUSH);
+
+  OUT_PACKET(gen8_pipe_control_t, CMD_PIPE_CONTROL, .flags = FLUSH_FLAGS);
+  if (d->query) {
+    OUT_PACKET(gen8_report_perf_count_t, CMD_REPORT_PERF_COUNT,
+               .address_lo = OA_REPORT_SIZE, .report_id = OA_REPORT_END);
+  }
+  OUT_BATCH(CMD_NOOP);
+  return i;
+}
+
+static int setup_batch0(uint8_t *data, const dispatch_t *d) {
+  uint32_t *batch = (uint32_t *)data;
+  int i = emit_prologue0(batch, d);
 
+  i = emit_walker0(batch, i, d);
   OUT_BATCH(CMD_BATCH_BUFFER_END);
+  return i * sizeof(uint32_t);
 }
 
-int main(int argc, char *argv[]) {
-  uint8_t kernel_data[4096] = {0};
-  uint8_t state_data[40960] = {0};
-  uint8_t batch_data[4096] = {0};
-  uint8_t input_data[256] = {0};
+// The prologue on its own, called as a second-level batch.
+static int setup_prologue0(uint8_t *data, const dispatch_t *d) {
+  uint32_t *batch = (uint32_t *)data;
+  int i = emit_prologue0(batch, d);
 
-  int i;
+  OUT_BATCH(CMD_BATCH_BUFFER_END);
+  return i * sizeof(uint32_t);
+}
+
+// Calls a recorded prologue, whose MI_BATCH_BUFFER_END returns here, and then
+// runs the dispatch. The prologue address is relocated by emit_call_relocs0.
+static int setup_call_batch0(uint8_t *data, const dispatch_t *d) {
+  uint32_t *batch = (uint32_t *)data;
+  int i = 0;
+
+  OUT_PACKET(gen8_batch_buffer_start_t,
+             CMD_BATCH_BUFFER_START | BATCH_BUFFER_SECOND_LEVEL |
+                 BATCH_BUFFER_PPGTT);
+  i = emit_walker0(batch, i, d);
+  OUT_BATCH(CMD_BATCH_BUFFER_END);
+  // batch length has to be a multiple of 8 bytes
+  if (i & 1)
+    OUT_BATCH(0);
+  return i * sizeof(uint32_t);
+}
+
+// Execbuffer built by hand instead of through libdrm_intel. Objects are named
+// by their index in the list and relocations carry the offsets the buffers had
+// at the last submission, so the kernel skips relocation processing as long as
+// nothing moved.
+typedef struct exec_list {
+  int fd;
+  uint32_t ctx_id;
+  uint32_t count;
+  int pinned; // fixed addresses, no relocation reaches the kernel
+  int err;    // first buffer or relocation that did not fit, for exec_submit
+  drm_intel_bo *bos[EXEC_MAX_OBJECTS];
+  struct drm_i915_gem_exec_object2 objects[EXEC_MAX_OBJECTS];
+  struct drm_i915_gem_relocation_entry relocs[EXEC_MAX_OBJECTS]
+                                             [EXEC_MAX_RELOCS];
+} exec_list_t;
+
+// Issues the ioctls of the direct path, can be replaced by a stand-in that
+// records and checks the payload.
+static int (*exec_ioctl)(int fd, unsigned long request, void *arg) = drmIoctl;
+
+// Addresses of softpinned buffers, shared by all lists of the process. Ranges
+// of released buffers are reused first fit, the area only grows past them up
+// to the end of the context's address space.
+static uint64_t softpin_next = SOFTPIN_BASE;
+static uint64_t softpin_end = SOFTPIN_BASE;
+static struct {
+  uint64_t start, size;
+} softpin_free[SOFTPIN_MAX_FREE];
+static uint32_t softpin_free_count;
+
+// Address of size bytes in the softpin area, 0 once it is exhausted.
+static uint64_t softpin_alloc(uint64_t size) {
+  uint64_t address;
+  uint32_t i;
+
+  size = (size + 4095) & ~4095ull;
+  for (i = 0; i < softpin_free_count; i++) {
+    if (softpin_free[i].size >= size) {
+      address = softpin_free[i].start;
+      softpin_free[i].start += size;
+      softpin_free[i].size -= size;
+      if (!softpin_free[i].size)
+        softpin_free[i] = softpin_free[--softpin_free_count];
+      return address;
+    }
+  }
+  if (softpin_end - softpin_next < size)
+    return 0;
+  address = softpin_next;
+  softpin_next += size;
+  return address;
+}
+
+// Gives the address of bo back to the softpin area before bo is unreferenced,
+// the kernel moves the buffer out of the way if another one is pinned there.
+static void softpin_release(drm_intel_bo *bo) {
+  uint64_t start = bo->offset64;
+  uint64_t size = (bo->size + 4095) & ~4095ull;
+  uint32_t i;
+
+  if (start < SOFTPIN_BASE)
+    return;
+  bo->offset64 = 0;
+  bo->offset = 0;
+  if (start + size != softpin_next) {
+    // a full list loses the range until the process exits
+    if (softpin_free_count < SOFTPIN_MAX_FREE) {
+      softpin_free[softpin_free_count].start = start;
+      softpin_free[softpin_free_count++].size = size;
+    }
+    return;
+  }
+  // the top of the area shrinks over the free ranges below it
+  softpin_next = start;
+  for (i = 0; i < softpin_free_count;) {
+    if (softpin_free[i].start + softpin_free[i].size == softpin_next) {
+      softpin_next = softpin_free[i].start;
+      softpin_free[i] = softpin_free[--softpin_free_count];
+      i = 0;
+    } else {
+      i++;
+    }
+  }
+}
+
+static int exec_init(exec_list_t *l, int fd, drm_intel_context *ctx,
+                     int pinned) {
+  int no_reloc = 0, handle_lut = 0, softpin = 0;
+  struct drm_i915_gem_context_param cp;
+  drm_i915_getparam_t gp;
   int err;
 
-  int fd = open("/dev/dri/card0", O_RDWR);
-  drm_intel_bufmgr *bufmgr = drm_intel_bufmgr_gem_init(fd, 16384);
-  drm_intel_context *ctx = drm_intel_gem_context_create(bufmgr);
+  memset(l, 0, sizeof(*l));
+  l->fd = fd;
+  l->pinned = pinned;
+  err = drm_intel_gem_context_get_id(ctx, &l->ctx_id);
 
-  drm_intel_bo *kernel_buffer =
-      drm_intel_bo_alloc(bufmgr, "kernel buffer", 464, 64);
-  setup_kernel0(kernel_data);
-  err = drm_intel_bo_subdata(kernel_buffer, 0, 464, kernel_data);
+  gp.param = I915_PARAM_HAS_EXEC_NO_RELOC;
+  gp.value = &no_reloc;
+  err = exec_ioctl(fd, DRM_IOCTL_I915_GETPARAM, &gp);
+  gp.param = I915_PARAM_HAS_EXEC_HANDLE_LUT;
+  gp.value = &handle_lut;
+  err = exec_ioctl(fd, DRM_IOCTL_I915_GETPARAM, &gp);
+  gp.param = I915_PARAM_HAS_EXEC_SOFTPIN;
+  gp.value = &softpin;
+  err = exec_ioctl(fd, DRM_IOCTL_I915_GETPARAM, &gp);
+  if (!no_reloc || !handle_lut || (pinned && !softpin))
+    return -ENODEV;
 
-  drm_intel_bo *input_buffer =
-      drm_intel_bo_alloc(bufmgr, "input buffer", 256, 64);
+  if (pinned) {
+    // a 32-bit PPGTT has no room above SOFTPIN_BASE
+    memset(&cp, 0, sizeof(cp));
+    cp.ctx_id = l->ctx_id;
+    cp.param = I915_CONTEXT_PARAM_GTT_SIZE;
+    err = exec_ioctl(fd, DRM_IOCTL_I915_GEM_CONTEXT_GETPARAM, &cp);
+    if (err || cp.value <= SOFTPIN_BASE)
+      return -ENODEV;
+    softpin_end = cp.value;
+  }
+  return 0;
+}
 
-  setup_input(input_data);
-  err = drm_intel_bo_subdata(input_buffer, 0, 256, input_data);
+// Index of bo in the list, added at the offset libdrm_intel last saw it at or,
+// for pinned lists, at its fixed address.
+static int exec_add(exec_list_t *l, drm_intel_bo *bo) {
+  uint32_t i;
+  for (i = 0; i < l->count; i++) {
+    if (l->bos[i] == bo)
+      return i;
+  }
 
-  drm_intel_bo *output_buffer =
-      drm_intel_bo_alloc(bufmgr, "output buffer", 256, 64);
+  memset(&l->objects[i], 0, sizeof(l->objects[i]));
+  l->objects[i].handle = bo->handle;
+  l->objects[i].relocs_ptr = (uintptr_t)l->relocs[i];
+  l->objects[i].offset = bo->offset64;
+  if (l->pinned) {
+    // buffers pinned before keep their address
+    if (bo->offset64 < SOFTPIN_BASE) {
+      l->objects[i].offset = softpin_alloc(bo->size);
+      if (!l->objects[i].offset && !l->err)
+        l->err = -ENOSPC;
+    }
+    l->objects[i].flags = EXEC_OBJECT_PINNED | EXEC_OBJECT_SUPPORTS_48B_ADDRESS;
+    bo->offset64 = l->objects[i].offset;
+  }
+  l->bos[i] = bo;
+  l->count++;
+  return i;
+}
 
-  drm_intel_bo *state_buffer =
-      drm_intel_bo_alloc(bufmgr, "state buffer", 36864, 4096);
+static int exec_reloc(exec_list_t *l, drm_intel_bo *bo, uint32_t offset,
+                      drm_intel_bo *target, uint32_t delta, uint32_t read,
+                      uint32_t write) {
+  int i = exec_add(l, bo);
+  int t = exec_add(l, target);
+  struct drm_i915_gem_relocation_entry *r;
 
-  setup_heap0(state_data);
-  setup_curb0(state_data + CURB_OFFSET);
-  setup_idrt0(state_data + IDRT_OFFSET);
-  err = drm_intel_bo_subdata(state_buffer, 0, 36864, state_data);
+  if (l->objects[i].relocation_count == EXEC_MAX_RELOCS) {
+    if (!l->err)
+      l->err = -E2BIG;
+    return -E2BIG;
+  }
+  r = &l->relocs[i][l->objects[i].relocation_count++];
 
-  // surface relocations
-  err = drm_intel_bo_emit_reloc(state_buffer, SRFC_OFFSET + 160, input_buffer,
-                                0, 2, 2);
-  err = drm_intel_bo_emit_reloc(state_buffer, SRFC_OFFSET + 160 + 64,
-                                output_buffer, 0, 2, 2);
+  r->target_handle = t;
+  r->delta = delta;
+  r->offset = offset;
+  r->presumed_offset = l->objects[t].offset;
+  r->read_domains = read;
+  r->write_domain = write;
+  if (write)
+    l->objects[t].flags |= EXEC_OBJECT_WRITE;
+  return 0;
+}
 
-  // curb relocations
-  for (i = 0; i < 4; i++) {
-    int input_offset = CURB_OFFSET + i * 256 + sizeof(uint32_t) * 58;
-    int output_offset = CURB_OFFSET + i * 256 + sizeof(uint32_t) * 58 + 8;
-    err = drm_intel_bo_emit_reloc(state_buffer, input_offset, input_buffer, 0,
-                                  2, 2);
-    err = drm_intel_bo_emit_reloc(state_buffer, output_offset, output_buffer, 0,
-                                  2, 2);
+// Writes the presumed addresses of the relocations recorded for bo into data,
+// the contents of bo before they are uploaded. Addresses in a pinned list are
+// final, so the relocations are dropped once written.
+static void exec_patch0(exec_list_t *l, drm_intel_bo *bo, uint8_t *data) {
+  int i = exec_add(l, bo);
+  uint32_t j;
+  for (j = 0; j < l->objects[i].relocation_count; j++) {
+    struct drm_i915_gem_relocation_entry *r = &l->relocs[i][j];
+    uint64_t address = r->presumed_offset + r->delta;
+    memcpy(data + r->offset, &address, sizeof(address));
   }
+  if (l->pinned)
+    l->objects[i].relocation_count = 0;
+}
 
-  drm_intel_bo *batch_buffer =
-      drm_intel_bo_alloc(bufmgr, "batch buffer", 512, 64);
-  setup_batch0(batch_data);
-  err = drm_intel_bo_subdata(batch_buffer, 0, 512, batch_data);
+// Submits the first used bytes of batch, which has to be the last object added
+// to the list.
+static int exec_submit(exec_list_t *l, drm_intel_bo *batch, int used) {
+  struct drm_i915_gem_execbuffer2 execbuf;
+  uint32_t i;
+  int err;
 
-  // batch buffer relocations
-  err = drm_intel_bo_emit_reloc(batch_buffer, 20 * sizeof(uint32_t),
-                                state_buffer, 1921, 4, 4);
-  err = drm_intel_bo_emit_reloc(batch_buffer, 22 * sizeof(uint32_t),
-                                state_buffer, 1921, 2, 2);
-  err = drm_intel_bo_emit_reloc(batch_buffer, 26 * sizeof(uint32_t),
-                                kernel_buffer, 1921, 16, 16);
+  exec_add(l, batch);
+  if (l->err)
+    return l->err;
+  memset(&execbuf, 0, sizeof(execbuf));
+  execbuf.buffers_ptr = (uintptr_t)l->objects;
+  execbuf.buffer_count = l->count;
+  execbuf.batch_len = used;
+  execbuf.flags = I915_EXEC_RENDER | I915_EXEC_NO_RELOC | I915_EXEC_HANDLE_LUT;
+  i915_execbuffer2_set_context_id(execbuf, l->ctx_id);
+  err = exec_ioctl(l->fd, DRM_IOCTL_I915_GEM_EXECBUFFER2, &execbuf);
+  if (err)
+    err = -errno;
 
-  err = drm_intel_gem_bo_context_exec(batch_buffer, ctx, 296, 1);
-  err = drm_intel_bo_busy(batch_buffer);
-  drm_intel_bo_wait_rendering(batch_buffer);
-  drm_intel_gem_bo_start_gtt_access(batch_buffer, 1);
+  // the kernel reports where the buffers ended up, keep libdrm_intel in sync
+  for (i = 0; i < l->count; i++) {
+    l->bos[i]->offset64 = l->objects[i].offset;
+    l->bos[i]->offset = l->objects[i].offset;
+  }
+  return err;
+}
 
-  void *output_data = malloc(256);
-  err = drm_intel_bo_get_subdata(output_buffer, 0, 256, output_data);
+// What exec_check_ioctl0 saw of the execbuffers it passed on.
+typedef struct exec_record {
+  uint32_t execs;
+  uint32_t relocs;
+  uint32_t errors;
+} exec_record_t;
 
-  drm_intel_bo_unreference(kernel_buffer);
-  drm_intel_bo_unreference(input_buffer);
-  drm_intel_bo_unreference(output_buffer);
-  drm_intel_bo_unreference(state_buffer);
-  drm_intel_bo_unreference(batch_buffer);
+static exec_record_t exec_record;
+
+static void exec_expect(int ok, const char *what) {
+  if (ok)
+    return;
+  fprintf(stderr, "Execbuffer %u: %s\n", exec_record.execs, what);
+  exec_record.errors++;
+}
+
+static int exec_pread(int fd, uint32_t handle, uint64_t offset, void *data,
+                      uint64_t size) {
+  struct drm_i915_gem_pread pread = {handle, 0, offset, size,
+                                     (uintptr_t)data};
+  return drmIoctl(fd, DRM_IOCTL_I915_GEM_PREAD, &pread);
+}
+
+// Stand-in for exec_ioctl that records every execbuffer and checks what the
+// kernel takes on trust with NO_RELOC and HANDLE_LUT before passing it on:
+// relocation targets are indices into the list, presumed offsets are the
+// offsets listed for the targets and already written where the relocations
+// point, and the batch is the last object, ending at batch_len.
+static int exec_check_ioctl0(int fd, unsigned long request, void *arg) {
+  struct drm_i915_gem_execbuffer2 *e = arg;
+  struct drm_i915_gem_exec_object2 *objects;
+  uint32_t flags = I915_EXEC_NO_RELOC | I915_EXEC_HANDLE_LUT;
+  uint32_t i, j, end[2];
+  uint64_t address;
+  int err;
+
+  if (request != DRM_IOCTL_I915_GEM_EXECBUFFER2)
+    return drmIoctl(fd, request, arg);
+
+  objects = (struct drm_i915_gem_exec_object2 *)(uintptr_t)e->buffers_ptr;
+  exec_expect((e->flags & flags) == flags, "NO_RELOC or HANDLE_LUT not set");
+  for (i = 0; i < e->buffer_count; i++) {
+    uint64_t relocs = objects[i].relocs_ptr;
+    struct drm_i915_gem_relocation_entry *r = (void *)(uintptr_t)relocs;
+    exec_expect(!(objects[i].flags & EXEC_OBJECT_PINNED) ||
+                    !objects[i].relocation_count,
+                "pinned object with relocations");
+    for (j = 0; j < objects[i].relocation_count; j++, r++) {
+      exec_record.relocs++;
+      if (r->target_handle >= e->buffer_count) {
+        exec_expect(0, "relocation target is not an index into the list");
+        continue;
+      }
+      exec_expect(r->presumed_offset == objects[r->target_handle].offset,
+                  "presumed offset is not the target's offset");
+      err = exec_pread(fd, objects[i].handle, r->offset, &address,
+                       sizeof(address));
+      exec_expect(!err && address == r->presumed_offset + r->delta,
+                  "presumed address is not written at the relocation");
+    }
+  }
+
+  // MI_BATCH_BUFFER_END, maybe followed by a padding dword
+  err = e->batch_len < sizeof(end) ||
+        exec_pread(fd, objects[e->buffer_count - 1].handle,
+                   e->batch_len - sizeof(end), end, sizeof(end));
+  exec_expect(!err && (end[1] == CMD_BATCH_BUFFER_END ||
+                       (end[0] == CMD_BATCH_BUFFER_END && !end[1])),
+              "the last object does not end at batch_len");
+  exec_record.execs++;
+  return drmIoctl(fd, request, arg);
+}
+
+// Records a relocation with libdrm_intel or, if direct is set, in the list.
+static int emit_reloc(exec_list_t *direct, drm_intel_bo *bo, uint32_t offset,
+                      drm_intel_bo *target, uint32_t delta, uint32_t read,
+                      uint32_t write) {
+  if (direct)
+    return exec_reloc(direct, bo, offset, target, delta, read, write);
+  return drm_intel_bo_emit_reloc(bo, offset, target, delta, read, write);
+}
+
+// Relocates the surface state, unless surface_buffer is NULL, and the CURBE
+// address dwords of every buffer argument in each thread slice of d.
+static void emit_arg_relocs0(exec_list_t *direct, drm_intel_bo *surface_buffer,
+                             drm_intel_bo *state_buffer,
+                             const kernel_args_t *a, const dispatch_t *d) {
+  int i, t;
+  int err;
+
+  for (i = 0; i < a->count; i++) {
+    const kernel_arg_t *arg = &a->arg[i];
+    drm_intel_bo *bo = a->value[i].bo;
+    uint32_t surface = SRFC_OFFSET + arg->bti * sizeof(gen8_surface_state_t) +
+                       offsetof(gen8_surface_state_t, ss8);
+    uint32_t curb = CURB_OFFSET + sizeof(uint32_t) * arg->curb_dword;
+    if (!(a->set & 1u << i) || arg->kind != ARG_BUFFER || !bo)
+      continue;
+    if (surface_buffer)
+      err = emit_reloc(direct, surface_buffer, surface, bo, 0, 2, 2);
+    for (t = 0; t < d->group_threads; t++)
+      err = emit_reloc(direct, state_buffer, curb + t * 256, bo, 0, 2, 2);
+  }
+}
+
+static void emit_state_relocs0(exec_list_t *direct, drm_intel_bo *state_buffer,
+                               drm_intel_bo *input_buffer,
+                               drm_intel_bo *output_buffer,
+                               const dispatch_t *d) {
+  kernel_args_t a;
+
+  kernel_args_init(&a, io_args, 2);
+  kernel_set_buffer(&a, 0, input_buffer, 0, 0);
+  kernel_set_buffer(&a, 1, output_buffer, 0, 0);
+  emit_arg_relocs0(direct, state_buffer, state_buffer, &a, d);
+}
+
+// Base address relocations, at the same offsets in a flat batch and in a
+// recorded prologue. Binding tables and surface states are found from the
+// surface base, CURBE and descriptors from the dynamic base.
+static void emit_base_relocs0(exec_list_t *direct, drm_intel_bo *batch_buffer,
+                              drm_intel_bo *surface_buffer,
+                              drm_intel_bo *state_buffer,
+                              drm_intel_bo *kernel_buffer) {
+  int err;
+  err = emit_reloc(direct, batch_buffer, 20 * sizeof(uint32_t), surface_buffer,
+                   1921, 4, 4);
+  err = emit_reloc(direct, batch_buffer, 22 * sizeof(uint32_t), state_buffer,
+                   1921, 2, 2);
+  err = emit_reloc(direct, batch_buffer, 26 * sizeof(uint32_t), kernel_buffer,
+                   1921, 16, 16);
+}
+
+static void emit_prologue_relocs0(exec_list_t *direct,
+                                  drm_intel_bo *batch_buffer,
+                                  drm_intel_bo *state_buffer,
+                                  drm_intel_bo *kernel_buffer) {
+  emit_base_relocs0(direct, batch_buffer, state_buffer, state_buffer,
+                    kernel_buffer);
+}
+
+static void emit_relocs0(drm_intel_bo *batch_buffer, drm_intel_bo *state_buffer,
+                         drm_intel_bo *kernel_buffer,
+                         drm_intel_bo *input_buffer,
+                         drm_intel_bo *output_buffer, const dispatch_t *d) {
+  emit_state_relocs0(NULL, state_buffer, input_buffer, output_buffer, d);
+  emit_prologue_relocs0(NULL, batch_buffer, state_buffer, kernel_buffer);
+}
+
+static void emit_call_relocs0(exec_list_t *direct, drm_intel_bo *batch_buffer,
+                              drm_intel_bo *prologue_buffer) {
+  int err;
+  err = emit_reloc(direct, batch_buffer, 1 * sizeof(uint32_t), prologue_buffer,
+                   0, 8, 0);
+}
+
+static uint32_t fnv1a(const uint8_t *data, uint32_t size) {
+  uint32_t hash = 2166136261u;
+  uint32_t i;
+  for (i = 0; i < size; i++)
+    hash = (hash ^ data[i]) * 16777619u;
+  return hash;
+}
+
+// Binding tables and surface states of all dispatches, in a buffer of its own
+// that is the surface state base. A surface state is found again by the hash
+// of its contents and bound as long as it is unchanged, and a binding table is
+// handed out again, with its hold on the surface states, once the batch that
+// read it retired. The buffer stays mapped and slots are written in place, a
+// pwrite would wait for the batches still reading the rest of it.
+typedef struct state_table {
+  uint64_t seqno;                      // batch reading it, 0 if free
+  int16_t surface[HEAP_TABLE_ENTRIES]; // -1 where no surface is bound
+} state_table_t;
+
+typedef struct state_heap {
+  drm_intel_bo *bo;
+  surface_heap_t shadow; // contents of bo, read back by lookups
+  drm_intel_bo *target[HEAP_SURFACES];
+  uint32_t hash[HEAP_SURFACES];
+  uint32_t refs[HEAP_SURFACES]; // tables in flight binding the surface
+  uint32_t used;                // surfaces written at least once
+  uint32_t clock;               // next surface to consider for reuse
+  state_table_t table[HEAP_TABLES];
+  uint32_t written, reused, recycled;
+} state_heap_t;
+
+static int state_heap_init(state_heap_t *h, drm_intel_bufmgr *bufmgr) {
+  memset(h, 0, sizeof(*h));
+  h->bo = drm_intel_bo_alloc(bufmgr, "surface state heap", sizeof(h->shadow),
+                             4096);
+  return drm_intel_gem_bo_map_unsynchronized(h->bo);
+}
+
+static void state_heap_fini(state_heap_t *h) {
+  drm_intel_gem_bo_unmap_gtt(h->bo);
+  drm_intel_bo_unreference(h->bo);
+}
+
+static void state_table_release(state_heap_t *h, state_table_t *table) {
+  int e;
+  for (e = 0; e < HEAP_TABLE_ENTRIES; e++) {
+    if (table->surface[e] >= 0)
+      h->refs[table->surface[e]]--;
+  }
+  table->seqno = 0;
+}
+
+// Frees the tables read by batches up to seqno, which retired. Their surface
+// states stay in place for later lookups until the slot is needed.
+static void state_heap_retire(state_heap_t *h, uint64_t seqno) {
+  int j;
+  for (j = 0; j < HEAP_TABLES; j++) {
+    if (h->table[j].seqno && h->table[j].seqno <= seqno) {
+      state_table_release(h, &h->table[j]);
+      h->recycled++;
+    }
+  }
+}
+
+// Slot of a surface state equal to s for target, written into a free slot if
+// there is none yet. -ENOSPC while every slot is bound by a batch in flight.
+static int state_heap_surface0(state_heap_t *h, drm_intel_bo *target,
+                               const gen8_surface_state_t *s) {
+  uint32_t hash = fnv1a((const uint8_t *)s, sizeof(*s));
+  uint32_t i, n;
+
+  for (i = 0; i < h->used; i++) {
+    if (h->hash[i] == hash && h->target[i] == target &&
+        !memcmp(&h->shadow.surface[i], s, sizeof(*s))) {
+      h->reused++;
+      return i;
+    }
+  }
+
+  if (h->used < HEAP_SURFACES) {
+    i = h->used++;
+  } else {
+    for (n = 0; n < HEAP_SURFACES && h->refs[h->clock]; n++)
+      h->clock = (h->clock + 1) % HEAP_SURFACES;
+    if (n == HEAP_SURFACES)
+      return -ENOSPC;
+    i = h->clock;
+    h->clock = (i + 1) % HEAP_SURFACES;
+  }
+  h->target[i] = target;
+  h->hash[i] = hash;
+  h->shadow.surface[i] = *s;
+  memcpy((uint8_t *)h->bo->virtual + SRFC_OFFSET + i * sizeof(*s), s,
+         sizeof(*s));
+  h->written++;
+  return i;
+}
+
+// Binds the buffers of a in a free binding table and returns the offset of the
+// table from the surface state base, -ENOSPC until a batch retires. Buffer
+// addresses are the ones they have in direct, final if it is pinned and
+// relocated in the heap otherwise. The table belongs to the batch submitted
+// next, see state_heap_fence0.
+static int state_heap_bind0(state_heap_t *h, exec_list_t *direct,
+                            const kernel_args_t *a) {
+  uint32_t *entries;
+  state_table_t *table;
+  int i, j, k, t;
+  int err = 0;
+
+  for (j = 0; j < HEAP_TABLES && h->table[j].seqno; j++)
+    ;
+  if (j == HEAP_TABLES)
+    return -ENOSPC;
+  exec_add(direct, h->bo);
+  table = &h->table[j];
+  table->seqno = UINT64_MAX;
+  memset(table->surface, -1, sizeof(table->surface));
+  entries = &h->shadow.binding_table[j * HEAP_TABLE_ENTRIES];
+  memset(entries, 0, HEAP_TABLE_ENTRIES * sizeof(uint32_t));
+
+  for (i = 0; i < a->count && !err; i++) {
+    const kernel_arg_t *arg = &a->arg[i];
+    drm_intel_bo *bo = a->value[i].bo;
+    gen8_surface_state_t s;
+    if (!(a->set & 1u << i) || arg->kind != ARG_BUFFER || !bo)
+      continue;
+    if (arg->bti >= HEAP_TABLE_ENTRIES) {
+      err = -EINVAL;
+      break;
+    }
+
+    t = exec_add(direct, bo);
+    memset(&s, 0, sizeof(s));
+    setup_buffer_surface(&s, a->value[i].size, a->value[i].cache);
+    memcpy(&s.ss8, &direct->objects[t].offset, sizeof(uint64_t));
+    k = state_heap_surface0(h, bo, &s);
+    if (k < 0) {
+      err = k;
+      break;
+    }
+    h->refs[k]++;
+    table->surface[arg->bti] = k;
+    entries[arg->bti] = SRFC_OFFSET + k * sizeof(s);
+
+    if (direct->pinned)
+      direct->objects[t].flags |= EXEC_OBJECT_WRITE;
+    else
+      err = exec_reloc(direct, h->bo,
+                       entries[arg->bti] + offsetof(gen8_surface_state_t, ss8),
+                       bo, 0, 2, 2);
+  }
+  if (err) {
+    state_table_release(h, table);
+    return err;
+  }
+  memcpy((uint8_t *)h->bo->virtual + j * HEAP_TABLE_ENTRIES * sizeof(uint32_t),
+         entries, HEAP_TABLE_ENTRIES * sizeof(uint32_t));
+  return j * HEAP_TABLE_ENTRIES * sizeof(uint32_t);
+}
+
+// Hands the tables bound since the last call to the batch seqno, just
+// submitted. The kernel relocated the surface states of buffers that moved,
+// the shadow follows so that lookups keep matching what the GPU reads.
+static void state_heap_fence0(state_heap_t *h, uint64_t seqno) {
+  int j, e;
+
+  for (j = 0; j < HEAP_TABLES; j++) {
+    state_table_t *table = &h->table[j];
+    if (table->seqno != UINT64_MAX)
+      continue;
+    table->seqno = seqno;
+    for (e = 0; e < HEAP_TABLE_ENTRIES; e++) {
+      int k = table->surface[e];
+      if (k < 0)
+        continue;
+      memcpy(&h->shadow.surface[k].ss8, &h->target[k]->offset64,
+             sizeof(uint64_t));
+      h->hash[k] = fnv1a((const uint8_t *)&h->shadow.surface[k],
+                         sizeof(gen8_surface_state_t));
+    }
+  }
+}
+
+// The walker is preceded by a MI_LOAD_REGISTER_MEM per dimension, after the
+// CURBE and descriptor loads of the dispatch starting at dword base.
+static void emit_indirect_relocs0(drm_intel_bo *batch_buffer,
+                                  drm_intel_bo *indirect_buffer, int base) {
+  int i, err;
+  for (i = 0; i < 3; i++) {
+    int offset = sizeof(uint32_t) * (base + 8 + 4 * i + 2);
+    err = drm_intel_bo_emit_reloc(batch_buffer, offset, indirect_buffer,
+                                  i * sizeof(uint32_t), 16, 0);
+  }
+}
+
+// The begin report follows the CURBE and descriptor loads and any
+// LOAD_REGISTER_MEMs, the end report the walker, flush and PIPE_CONTROL.
+static void emit_query_relocs0(drm_intel_bo *batch_buffer, const dispatch_t *d,
+                               int base) {
+  int begin = base + (2 * sizeof(gen8_media_load_t) +
+                      (d->indirect ? 3 * sizeof(gen8_load_register_mem_t)
+                                   : 0)) /
+                         sizeof(uint32_t);
+  int end = begin + (sizeof(gen8_report_perf_count_t) +
+                     sizeof(gen8_gpgpu_walker_t) +
+                     sizeof(gen8_media_state_flush_t) +
+                     sizeof(gen8_pipe_control_t)) /
+                        sizeof(uint32_t);
+  int err;
+
+  err = drm_intel_bo_emit_reloc(batch_buffer, sizeof(uint32_t) * (begin + 1),
+                                d->query, 0, 16, 16);
+  err = drm_intel_bo_emit_reloc(batch_buffer, sizeof(uint32_t) * (end + 1),
+                                d->query, OA_REPORT_SIZE, 16, 16);
+}
+
+// Builds the state and batch buffers for a dispatch over bytes of the given
+// buffers. The batch keeps the state alive through its relocations, *used is
+// set to its length in bytes.
+static drm_intel_bo *setup_dispatch0(drm_intel_bufmgr *bufmgr,
+                                     drm_intel_bo *kernel_buffer,
+                                     const dispatch_t *d,
+                                     drm_intel_bo *input_buffer,
+                                     drm_intel_bo *output_buffer,
+                                     uint32_t bytes, int *used) {
+  uint8_t state_data[40960] = {0};
+  uint8_t batch_data[4096] = {0};
+  dispatch_t bound = *d;
+  int err;
+
+  // the descriptor and the L3 partition take the SLM the arguments ask for
+  drm_intel_bo *state_buffer =
+      drm_intel_bo_alloc(bufmgr, "state buffer", 36864, 4096);
+  bound.slm_size = setup_heap0(state_data, bytes, d);
+  setup_curb0(state_data + CURB_OFFSET, &bound);
+  setup_idrt0(state_data + IDRT_OFFSET, &bound);
+  err = drm_intel_bo_subdata(state_buffer, 0, 36864, state_data);
+
+  drm_intel_bo *batch_buffer =
+      drm_intel_bo_alloc(bufmgr, "batch buffer", 512, 64);
+  *used = setup_batch0(batch_data, &bound);
+  err = drm_intel_bo_subdata(batch_buffer, 0, 512, batch_data);
+
+  emit_relocs0(batch_buffer, state_buffer, kernel_buffer, input_buffer,
+               output_buffer, d);
+  if (d->indirect)
+    emit_indirect_relocs0(batch_buffer, d->indirect, PROLOGUE_DWORDS);
+  if (d->query)
+    emit_query_relocs0(batch_buffer, d, PROLOGUE_DWORDS);
+
+  drm_intel_bo_unreference(state_buffer);
+  return batch_buffer;
+}
+
+// Completion of a submitted batch. With out-fences the kernel hands back a
+// sync_file that polls readable once the batch retired, so it can sit in an
+// epoll set next to sockets. Without them fd is -1 and waits fall back to
+// GEM_WAIT on the batch buffer; batches of a context retire in submission
+// order, so the oldest pending one is the next to complete.
+typedef struct completion {
+  drm_intel_bo *batch_buffer;
+  int fd;
+  uint64_t seqno; // submission order
+  int done;
+} completion_t;
+
+static uint64_t completion_seqno;
+
+static int64_t completion_clock(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ll + ts.tv_nsec;
+}
+
+// Tracks the completion of batch_buffer, submitted without an out-fence,
+// holding a reference on the batch until completion_release.
+static void completion_track(completion_t *c, drm_intel_bo *batch_buffer) {
+  c->batch_buffer = batch_buffer;
+  c->fd = -1;
+  c->seqno = __atomic_add_fetch(&completion_seqno, 1, __ATOMIC_RELAXED);
+  c->done = 0;
+  drm_intel_bo_reference(batch_buffer);
+}
+
+// Submits batch_buffer on ctx and tracks its completion.
+static int completion_exec(completion_t *c, drm_intel_bo *batch_buffer,
+                           drm_intel_context *ctx, int used) {
+  int err;
+
+  completion_track(c, batch_buffer);
+  err = drm_intel_gem_bo_fence_exec(batch_buffer, ctx, used, -1, &c->fd, 1);
+  if (err) {
+    // kernels without out-fences reject the flag before submitting anything
+    c->fd = -1;
+    err = drm_intel_gem_bo_context_exec(batch_buffer, ctx, used, 1);
+  }
+  return err;
+}
+
+// Never blocks, 1 once the batch retired. A GEM_WAIT without timeout rather
+// than drm_intel_bo_busy, which remembers a buffer as idle and misses batches
+// submitted by exec_submit.
+static int completion_poll(completion_t *c) {
+  struct pollfd p = {c->fd, POLLIN, 0};
+
+  if (!c->done && c->fd >= 0)
+    c->done = poll(&p, 1, 0) == 1;
+  else if (!c->done)
+    c->done = !drm_intel_gem_bo_wait(c->batch_buffer, 0);
+  return c->done;
+}
+
+// Waits up to timeout_ns, forever if negative, for any (all = 0) or all of
+// the n completions. Returns the index of a retired one, n once all of them
+// retired, or -ETIME. Past COMPLETION_MAX_WAIT sync_files, they are polled in
+// rounds of COMPLETION_TICK_NS.
+static int completion_wait_many(completion_t *c, int n, int all,
+                                int64_t timeout_ns) {
+  struct pollfd fds[COMPLETION_MAX_WAIT];
+  int64_t deadline = completion_clock() + timeout_ns;
+  int64_t left = timeout_ns;
+  int i;
+
+  for (;;) {
+    completion_t *oldest = NULL;
+    int count = 0, more = 0;
+
+    for (i = 0; i < n; i++) {
+      if (completion_poll(&c[i]) && !all)
+        return i;
+      if (c[i].done)
+        continue;
+      if (c[i].fd >= 0 && count == COMPLETION_MAX_WAIT)
+        more = 1;
+      else if (c[i].fd >= 0)
+        fds[count++] = (struct pollfd){c[i].fd, POLLIN, 0};
+      if (c[i].fd < 0 && (!oldest || c[i].seqno < oldest->seqno))
+        oldest = &c[i];
+    }
+    if (!count && !oldest)
+      return n;
+    if (timeout_ns >= 0 && (left = deadline - completion_clock()) <= 0)
+      return -ETIME;
+
+    if (oldest) {
+      if (!drm_intel_gem_bo_wait(oldest->batch_buffer, left))
+        oldest->done = 1;
+    } else {
+      // the sync_files left out are seen by completion_poll next round
+      if (more && (timeout_ns < 0 || left > COMPLETION_TICK_NS))
+        left = COMPLETION_TICK_NS;
+      poll(fds, count,
+           timeout_ns < 0 && !more ? -1 : (left + 999999) / 1000000);
+    }
+  }
+}
+
+// Waits up to timeout_ns, forever if negative. Returns 0 once the batch
+// retired, -ETIME if it still runs.
+static int completion_wait(completion_t *c, int64_t timeout_ns) {
+  return completion_wait_many(c, 1, 1, timeout_ns) < 0 ? -ETIME : 0;
+}
+
+static void completion_release(completion_t *c) {
+  if (c->fd >= 0)
+    close(c->fd);
+  drm_intel_bo_unreference(c->batch_buffer);
+}
+
+// Completion reactor. One thread waits on all batches in flight and resumes
+// the continuation of each one as it retires, instead of a blocked thread per
+// dispatch. Continuations run on the reactor thread and may submit again;
+// batches without a sync_file are waited on in submission order.
+typedef void (*reactor_fn)(void *arg);
+
+typedef struct reactor_entry {
+  completion_t completion;
+  reactor_fn fn;
+  void *arg;
+  struct reactor_entry *next;
+} reactor_entry_t;
+
+typedef struct reactor {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  int epoll;
+  int wake;                 // eventfd, for entries without fds and stopping
+  reactor_entry_t *pending; // entries without fds, oldest first
+  reactor_entry_t **tail;
+  uint32_t in_flight; // submitted, continuation not yet returned
+  int stop;
+} reactor_t;
+
+static void reactor_resume(reactor_t *r, reactor_entry_t *e) {
+  completion_release(&e->completion);
+  e->fn(e->arg);
+  free(e);
+  pthread_mutex_lock(&r->lock);
+  r->in_flight--;
+  pthread_mutex_unlock(&r->lock);
+}
+
+static void *reactor_run(void *arg) {
+  reactor_t *r = arg;
+  struct epoll_event events[REACTOR_MAX_EVENTS];
+  uint64_t count;
+  int i, ready;
+
+  for (;;) {
+    pthread_mutex_lock(&r->lock);
+    reactor_entry_t *oldest = r->pending;
+    int done = r->stop && !r->in_flight;
+    pthread_mutex_unlock(&r->lock);
+    if (done)
+      return NULL;
+
+    // a pending entry keeps the reactor waiting on it in ticks, so new
+    // submissions and stop requests are seen in time
+    if (oldest && !completion_wait(&oldest->completion, COMPLETION_TICK_NS)) {
+      pthread_mutex_lock(&r->lock);
+      r->pending = oldest->next;
+      if (!r->pending)
+        r->tail = &r->pending;
+      pthread_mutex_unlock(&r->lock);
+      reactor_resume(r, oldest);
+    }
+
+    ready = epoll_wait(r->epoll, events, REACTOR_MAX_EVENTS, oldest ? 0 : -1);
+    for (i = 0; i < ready; i++) {
+      reactor_entry_t *e = events[i].data.ptr;
+      if (!e) {
+        if (read(r->wake, &count, sizeof count) < 0)
+          perror("reactor wake");
+        continue;
+      }
+      epoll_ctl(r->epoll, EPOLL_CTL_DEL, e->completion.fd, NULL);
+      reactor_resume(r, e);
+    }
+  }
+}
+
+static void reactor_wake(reactor_t *r) {
+  uint64_t one = 1;
+  if (write(r->wake, &one, sizeof one) < 0)
+    perror("reactor wake");
+}
+
+static int reactor_start(reactor_t *r) {
+  struct epoll_event e = {EPOLLIN, {.ptr = NULL}};
+
+  pthread_mutex_init(&r->lock, NULL);
+  r->epoll = epoll_create1(EPOLL_CLOEXEC);
+  r->wake = eventfd(0, EFD_CLOEXEC);
+  r->pending = NULL;
+  r->tail = &r->pending;
+  r->in_flight = 0;
+  r->stop = 0;
+  if (r->epoll < 0 || r->wake < 0 ||
+      epoll_ctl(r->epoll, EPOLL_CTL_ADD, r->wake, &e) ||
+      pthread_create(&r->thread, NULL, reactor_run, r)) {
+    perror("reactor");
+    return 1;
+  }
+  return 0;
+}
+
+// Submits batch_buffer on ctx, fn(arg) runs on the reactor thread once it
+// retired. fn never runs if the submission fails.
+static int reactor_submit(reactor_t *r, drm_intel_bo *batch_buffer,
+                          drm_intel_context *ctx, int used, reactor_fn fn,
+                          void *arg) {
+  reactor_entry_t *e = malloc(sizeof *e);
+  struct epoll_event event = {EPOLLIN, {.ptr = e}};
+  int err;
+
+  if (!e)
+    return -ENOMEM;
+  e->fn = fn;
+  e->arg = arg;
+  e->next = NULL;
+  pthread_mutex_lock(&r->lock);
+  r->in_flight++;
+  pthread_mutex_unlock(&r->lock);
+
+  err = completion_exec(&e->completion, batch_buffer, ctx, used);
+  if (err) {
+    completion_release(&e->completion);
+    free(e);
+    pthread_mutex_lock(&r->lock);
+    r->in_flight--;
+    pthread_mutex_unlock(&r->lock);
+    // a stopping reactor may be waiting for this entry alone
+    reactor_wake(r);
+    return err;
+  }
+  if (e->completion.fd >= 0 &&
+      !epoll_ctl(r->epoll, EPOLL_CTL_ADD, e->completion.fd, &event))
+    return err;
+
+  pthread_mutex_lock(&r->lock);
+  *r->tail = e;
+  r->tail = &e->next;
+  pthread_mutex_unlock(&r->lock);
+  reactor_wake(r);
+  return err;
+}
+
+// Returns once every continuation, including the ones submitted by other
+// continuations, has run.
+static void reactor_stop(reactor_t *r) {
+  pthread_mutex_lock(&r->lock);
+  r->stop = 1;
+  pthread_mutex_unlock(&r->lock);
+  reactor_wake(r);
+  pthread_join(r->thread, NULL);
+  close(r->epoll);
+  close(r->wake);
+  pthread_mutex_destroy(&r->lock);
+}
+
+// Runs the kernel once over size bytes of input and reads the output back.
+static int run_dispatch0(drm_intel_bufmgr *bufmgr, drm_intel_context *ctx,
+                         drm_intel_bo *kernel_buffer, const dispatch_t *d,
+                         const void *input_data, void *output_data,
+                         uint32_t size) {
+  completion_t done;
+  int used, err;
+
+  drm_intel_bo *input_buffer =
+      drm_intel_bo_alloc(bufmgr, "input buffer", size, 64);
+  err = drm_intel_bo_subdata(input_buffer, 0, size, input_data);
+
+  drm_intel_bo *output_buffer =
+      drm_intel_bo_alloc(bufmgr, "output buffer", size, 64);
+
+  drm_intel_bo *batch_buffer = setup_dispatch0(
+      bufmgr, kernel_buffer, d, input_buffer, output_buffer, size, &used);
+
+  err = completion_exec(&done, batch_buffer, ctx, used);
+  if (!completion_wait(&done, COMPLETION_TIMEOUT_NS)) {
+    drm_intel_gem_bo_start_gtt_access(batch_buffer, 1);
+    err = drm_intel_bo_get_subdata(output_buffer, 0, size, output_data);
+  } else {
+    fprintf(stderr, "Dispatch did not retire within %lld ms\n",
+            COMPLETION_TIMEOUT_NS / 1000000);
+    err = -ETIME;
+  }
+  completion_release(&done);
+
+  drm_intel_bo_unreference(input_buffer);
+  drm_intel_bo_unreference(output_buffer);
+  drm_intel_bo_unreference(batch_buffer);
+  return err;
+}
+
+// Submits n single dispatches and retires them from an event loop: an epoll
+// set of their sync_files, or batched waits without out-fences. The loop
+// never blocks longer than COMPLETION_TICK_NS, as if it served other work.
+static int run_completions0(drm_intel_bufmgr *bufmgr, drm_intel_context *ctx,
+                            drm_intel_bo *kernel_buffer, uint32_t n) {
+  uint8_t input_data[256] = {0};
+  int output[64];
+  dispatch_t d = {1, GROUP_THREADS, 0, 0};
+  completion_t *c = calloc(n, sizeof *c);
+  drm_intel_bo **output_buffers = calloc(n, sizeof *output_buffers);
+  struct epoll_event events[16];
+  uint32_t i, j, retired = 0, idle = 0, correct = 0;
+  int k, ready, used, fds = 0;
+  int err = 0;
+
+  int epoll = epoll_create1(EPOLL_CLOEXEC);
+  setup_input(input_data);
+  drm_intel_bo *input_buffer =
+      drm_intel_bo_alloc(bufmgr, "input buffer", 256, 64);
+  err = drm_intel_bo_subdata(input_buffer, 0, 256, input_data);
+
+  int64_t start = completion_clock();
+  for (i = 0; i < n; i++) {
+    output_buffers[i] = drm_intel_bo_alloc(bufmgr, "output buffer", 256, 64);
+    drm_intel_bo *batch_buffer = setup_dispatch0(
+        bufmgr, kernel_buffer, &d, input_buffer, output_buffers[i], 256, &used);
+    err = completion_exec(&c[i], batch_buffer, ctx, used);
+    drm_intel_bo_unreference(batch_buffer);
+    if (c[i].fd >= 0) {
+      struct epoll_event e = {EPOLLIN, {.u32 = i}};
+      if (!epoll_ctl(epoll, EPOLL_CTL_ADD, c[i].fd, &e))
+        fds++;
+    }
+  }
+  int64_t submitted = completion_clock();
+
+  while (retired < n) {
+    if (fds) {
+      ready = epoll_wait(epoll, events, 16, COMPLETION_TICK_NS / 1000000);
+      for (k = 0; k < ready; k++) {
+        i = events[k].data.u32;
+        epoll_ctl(epoll, EPOLL_CTL_DEL, c[i].fd, NULL);
+        c[i].done = 1;
+        fds--;
+        retired++;
+      }
+    } else {
+      // also picks up batches whose sync_file did not make it into the set
+      for (i = 0; c[i].done; i++)
+        ;
+      ready = completion_wait_many(c + i, n - i, 0, COMPLETION_TICK_NS) >= 0;
+      for (i = 0, retired = 0; i < n; i++)
+        retired += completion_poll(&c[i]);
+    }
+    idle += ready <= 0;
+  }
+  int64_t elapsed = completion_clock() - start;
+
+  fprintf(stderr,
+          "%u dispatches retired through %s in %.3f ms (%.3f ms to submit), "
+          "%u idle ticks\n",
+          n, c[0].fd >= 0 ? "epoll on sync_files" : "batched GEM_WAITs",
+          elapsed * 1e-6, (submitted - start) * 1e-6, idle);
+  for (i = 0; i < n; i++) {
+    err = drm_intel_bo_get_subdata(output_buffers[i], 0, 256, output);
+    for (j = 0; j < 64; j++)
+      correct += output[j] == ((int *)input_data)[j] * 2;
+    completion_release(&c[i]);
+    drm_intel_bo_unreference(output_buffers[i]);
+  }
+  fprintf(stderr, "Computed '%u/%u' correct values!\n", correct, n * 64);
+
+  close(epoll);
+  free(c);
+  free(output_buffers);
+  drm_intel_bo_unreference(input_buffer);
+  return err;
+}
+
+// A request of the --async demo: input doubled into buffers[1], and doubled
+// again into buffers[2] by the continuation of the first dispatch.
+typedef struct async_request {
+  reactor_t *reactor;
+  drm_intel_bufmgr *bufmgr;
+  drm_intel_context *ctx;
+  drm_intel_bo *kernel_buffer;
+  drm_intel_bo *buffers[3];
+  int input[64];
+  uint32_t *correct;
+} async_request_t;
+
+static void async_done(void *arg) {
+  async_request_t *q = arg;
+  int output[64];
+  uint32_t i, correct = 0;
+  int err;
+
+  err = drm_intel_bo_get_subdata(q->buffers[2], 0, sizeof output, output);
+  for (i = 0; i < 64; i++)
+    correct += output[i] == 4 * q->input[i];
+  __atomic_add_fetch(q->correct, correct, __ATOMIC_RELAXED);
+  for (i = 0; i < 3; i++)
+    drm_intel_bo_unreference(q->buffers[i]);
+}
+
+// Dispatches the kernel from buffers[stage] to buffers[stage + 1], fn(q)
+// continues the request once it retired.
+static int async_dispatch0(async_request_t *q, int stage, reactor_fn fn) {
+  dispatch_t d = {1, GROUP_THREADS, 0, 0};
+  int used, err;
+
+  drm_intel_bo *batch_buffer =
+      setup_dispatch0(q->bufmgr, q->kernel_buffer, &d, q->buffers[stage],
+                      q->buffers[stage + 1], sizeof q->input, &used);
+  err = reactor_submit(q->reactor, batch_buffer, q->ctx, used, fn, q);
+  drm_intel_bo_unreference(batch_buffer);
+  return err;
+}
+
+static void async_doubled0(void *arg) { async_dispatch0(arg, 1, async_done); }
+
+// Serves n requests of two chained dispatches each from one reactor thread.
+// The submitting thread never waits on a batch, only for the reactor to
+// drain at the end.
+static int run_async0(drm_intel_bufmgr *bufmgr, drm_intel_context *ctx,
+                      drm_intel_bo *kernel_buffer, uint32_t n) {
+  async_request_t *requests = calloc(n, sizeof *requests);
+  reactor_t reactor;
+  uint32_t i, j, correct = 0;
+  int err = 0;
+
+  if (reactor_start(&reactor)) {
+    free(requests);
+    return 1;
+  }
+  int64_t start = completion_clock();
+  for (i = 0; i < n; i++) {
+    async_request_t *q = &requests[i];
+    q->reactor = &reactor;
+    q->bufmgr = bufmgr;
+    q->ctx = ctx;
+    q->kernel_buffer = kernel_buffer;
+    q->correct = &correct;
+    for (j = 0; j < 64; j++)
+      q->input[j] = i + j;
+    q->buffers[0] =
+        drm_intel_bo_alloc(bufmgr, "input buffer", sizeof q->input, 64);
+    err = drm_intel_bo_subdata(q->buffers[0], 0, sizeof q->input, q->input);
+    q->buffers[1] =
+        drm_intel_bo_alloc(bufmgr, "doubled buffer", sizeof q->input, 64);
+    q->buffers[2] =
+        drm_intel_bo_alloc(bufmgr, "output buffer", sizeof q->input, 64);
+    err = async_dispatch0(q, 0, async_doubled0);
+  }
+  int64_t submitted = completion_clock();
+  reactor_stop(&reactor);
+  int64_t elapsed = completion_clock() - start;
+
+  fprintf(stderr,
+          "%u requests of 2 dispatches served by one reactor thread in "
+          "%.3f ms (%.3f ms to submit)\n",
+          n, elapsed * 1e-6, (submitted - start) * 1e-6);
+  fprintf(stderr, "Computed '%u/%u' correct values!\n", correct, n * 64);
+  free(requests);
+  return err;
+}
+
+// Runs the SLM kernel over four work-groups and checks that each of them came
+// back reversed.
+static int run_slm0(drm_intel_bufmgr *bufmgr, drm_intel_context *ctx) {
+  uint8_t kernel_data[4096] = {0};
+  int input[4 * GROUP_SIZE], output[4 * GROUP_SIZE];
+  dispatch_t d = {4, GROUP_THREADS, GROUP_SIZE * sizeof(int), 1};
+  int i, size, correct = 0;
+  int err;
+
+  size = setup_slm_kernel0(kernel_data, GROUP_SIZE);
+  drm_intel_bo *kernel_buffer =
+      drm_intel_bo_alloc(bufmgr, "slm kernel buffer", size, 64);
+  err = drm_intel_bo_subdata(kernel_buffer, 0, size, kernel_data);
+
+  for (i = 0; i < 4 * GROUP_SIZE; i++)
+    input[i] = i;
+  err = run_dispatch0(bufmgr, ctx, kernel_buffer, &d, input, output,
+                      sizeof input);
+  drm_intel_bo_unreference(kernel_buffer);
+
+  for (i = 0; i < 4 * GROUP_SIZE; i++) {
+    int group = i - i % GROUP_SIZE;
+    int lid = i % GROUP_SIZE;
+    if (output[i] == input[group + GROUP_SIZE - 1 - lid])
+      correct++;
+  }
+  fprintf(stderr, "Computed '%d/%d' correct values!\n", correct,
+          4 * GROUP_SIZE);
+  return err;
+}
+
+typedef struct stream_slot {
+  drm_intel_bo *input_buffer;
+  drm_intel_bo *output_buffer;
+  drm_intel_bo *state_buffer;
+  drm_intel_bo *batch_buffer;
+  int used;      // batch length in bytes, as setup_batch returned it
+  size_t bytes;  // valid bytes in flight, 0 if idle
+  size_t offset; // file offset of the chunk, mmap mode only
+  int bounce;    // data is copied through ordinary BOs, mmap mode only
+} stream_slot_t;
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Pick the chunk size so that all slots together take only a small share of
+// the aperture, and a single upload takes a couple of milliseconds at the
+// measured host to GPU bandwidth, which keeps per-exec overhead amortized
+// without making the pipeline slow to fill.
+static size_t stream_chunk_size(int fd, drm_intel_bufmgr *bufmgr) {
+  size_t mappable = 0, total = 0;
+  size_t probe_size = 1 << 20;
+  size_t by_aperture, by_bandwidth, chunk;
+  double start, elapsed;
+  int i;
+
+  drm_intel_get_aperture_sizes(fd, &mappable, &total);
+  by_aperture = total / (STREAM_SLOTS * 2 * 8);
+
+  void *probe_data = calloc(1, probe_size);
+  drm_intel_bo *probe =
+      drm_intel_bo_alloc(bufmgr, "probe buffer", probe_size, 4096);
+  drm_intel_bo_subdata(probe, 0, probe_size, probe_data);
+  start = now();
+  for (i = 0; i < 8; i++)
+    drm_intel_bo_subdata(probe, 0, probe_size, probe_data);
+  elapsed = now() - start;
+  drm_intel_bo_unreference(probe);
+  free(probe_data);
+
+  by_bandwidth = elapsed > 0 ? (size_t)(8 * probe_size / elapsed * 0.002)
+                             : STREAM_MAX_CHUNK;
+
+  chunk = by_bandwidth;
+  if (by_aperture && chunk > by_aperture)
+    chunk = by_aperture;
+  if (chunk > STREAM_MAX_CHUNK)
+    chunk = STREAM_MAX_CHUNK;
+  chunk &= ~(size_t)(GROUP_SIZE * sizeof(int) - 1);
+  if (chunk < GROUP_SIZE * sizeof(int))
+    chunk = GROUP_SIZE * sizeof(int);
+  return chunk;
+}
+
+static size_t read_full(int fd, uint8_t *data, size_t size) {
+  size_t done = 0;
+  while (done < size) {
+    ssize_t n = read(fd, data + done, size - done);
+    if (n <= 0)
+      break;
+    done += n;
+  }
+  return done;
+}
+
+static void stream_retire(stream_slot_t *slot, int out, size_t *correct) {
+  int *input, *output;
+  size_t i;
+
+  drm_intel_bo_map(slot->output_buffer, 0);
+  drm_intel_bo_map(slot->input_buffer, 0);
+  input = slot->input_buffer->virtual;
+  output = slot->output_buffer->virtual;
+  for (i = 0; i < slot->bytes / sizeof(int); i++) {
+    if (output[i] == input[i] + input[i])
+      (*correct)++;
+  }
+  if (write(out, output, slot->bytes) != (ssize_t)slot->bytes)
+    perror("write");
+  drm_intel_bo_unmap(slot->input_buffer);
+  drm_intel_bo_unmap(slot->output_buffer);
+  slot->bytes = 0;
+}
+
+// Walks an arbitrarily large input through a ring of fixed-size BOs. While
+// the GPU works on chunk n, the CPU retires chunk n - STREAM_SLOTS + 1 and
+// uploads chunk n + 1, so host memory stays at STREAM_SLOTS chunk pairs.
+static int run_stream(int fd, drm_intel_bufmgr *bufmgr, drm_intel_context *ctx,
+                      drm_intel_bo *kernel_buffer, const char *in_path,
+                      const char *out_path) {
+  uint8_t state_data[40960];
+  uint8_t batch_data[4096];
+  stream_slot_t slots[STREAM_SLOTS];
+  size_t chunk, total = 0, correct = 0;
+  double start;
+  int i, n;
+  int err;
+
+  int in = open(in_path, O_RDONLY);
+  if (in < 0) {
+    perror(in_path);
+    return 1;
+  }
+  int out = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (out < 0) {
+    perror(out_path);
+    close(in);
+    return 1;
+  }
+
+  chunk = stream_chunk_size(fd, bufmgr);
+  fprintf(stderr, "Streaming with %d x %zu byte chunks\n", STREAM_SLOTS,
+          chunk);
+  dispatch_t d = {chunk / (GROUP_SIZE * sizeof(int)), GROUP_THREADS, 0, 0};
+  d.input_cache = CACHE_STREAMING;
+  d.output_cache = CACHE_STREAMING;
+
+  for (i = 0; i < STREAM_SLOTS; i++) {
+    stream_slot_t *slot = &slots[i];
+    slot->input_buffer =
+        drm_intel_bo_alloc(bufmgr, "input buffer", chunk, 4096);
+    slot->output_buffer =
+        drm_intel_bo_alloc(bufmgr, "output buffer", chunk, 4096);
+    slot->state_buffer =
+        drm_intel_bo_alloc(bufmgr, "state buffer", 36864, 4096);
+    slot->batch_buffer = drm_intel_bo_alloc(bufmgr, "batch buffer", 512, 64);
+    slot->bytes = 0;
+
+    memset(state_data, 0, sizeof state_data);
+    setup_heap0(state_data, chunk, &d);
+    setup_curb0(state_data + CURB_OFFSET, &d);
+    setup_idrt0(state_data + IDRT_OFFSET, &d);
+    err = drm_intel_bo_subdata(slot->state_buffer, 0, 36864, state_data);
+
+    memset(batch_data, 0, sizeof batch_data);
+    slot->used = setup_batch0(batch_data, &d);
+    err = drm_intel_bo_subdata(slot->batch_buffer, 0, 512, batch_data);
+
+    emit_relocs0(slot->batch_buffer, slot->state_buffer, kernel_buffer,
+                 slot->input_buffer, slot->output_buffer, &d);
+  }
+
+  start = now();
+  for (n = 0;; n++) {
+    stream_slot_t *slot = &slots[n % STREAM_SLOTS];
+    size_t bytes;
+
+    if (slot->bytes)
+      stream_retire(slot, out, &correct);
+
+    drm_intel_bo_map(slot->input_buffer, 1);
+    bytes = read_full(in, slot->input_buffer->virtual, chunk);
+    memset((uint8_t *)slot->input_buffer->virtual + bytes, 0, chunk - bytes);
+    drm_intel_bo_unmap(slot->input_buffer);
+    if (bytes == 0)
+      break;
+
+    slot->bytes = bytes;
+    total += bytes;
+    err = drm_intel_gem_bo_context_exec(slot->batch_buffer, ctx, slot->used,
+                                        1);
+  }
+
+  for (i = 1; i <= STREAM_SLOTS; i++) {
+    stream_slot_t *slot = &slots[(n + i) % STREAM_SLOTS];
+    if (slot->bytes)
+      stream_retire(slot, out, &correct);
+  }
+
+  fprintf(stderr, "Streamed %zu bytes in %.3f s\n", total, now() - start);
+  fprintf(stderr, "Computed '%zu/%zu' correct values!\n", correct,
+          total / sizeof(int));
+
+  for (i = 0; i < STREAM_SLOTS; i++) {
+    drm_intel_bo_unreference(slots[i].input_buffer);
+    drm_intel_bo_unreference(slots[i].output_buffer);
+    drm_intel_bo_unreference(slots[i].state_buffer);
+    drm_intel_bo_unreference(slots[i].batch_buffer);
+  }
+  close(in);
+  close(out);
+  return 0;
+}
+
+typedef struct file_buffer {
+  int fd;
+  int output;
+  uint8_t *map;
+  size_t size;     // file size in bytes
+  size_t map_size; // size rounded up to whole pages
+} file_buffer_t;
+
+// Maps a file so the GPU can use it in place. Outputs are created or truncated
+// to size and mapped writable. Inputs keep their size and are mapped read-only,
+// a private writable mapping would copy every page userptr pins.
+static int file_buffer_open(file_buffer_t *fb, const char *path, size_t size,
+                            int output) {
+  size_t page = sysconf(_SC_PAGESIZE);
+  struct stat st;
+  int prot;
+
+  fb->map = NULL;
+  fb->output = output;
+  fb->fd = open(path, output ? O_RDWR | O_CREAT | O_TRUNC : O_RDONLY, 0644);
+  if (fb->fd < 0) {
+    perror(path);
+    return 1;
+  }
+  if (output && ftruncate(fb->fd, size) < 0) {
+    perror(path);
+    close(fb->fd);
+    return 1;
+  }
+  if (!output) {
+    fstat(fb->fd, &st);
+    size = st.st_size;
+  }
+
+  fb->size = size;
+  fb->map_size = (size + page - 1) & ~(page - 1);
+  if (!size)
+    return 0;
+
+  prot = output ? PROT_READ | PROT_WRITE : PROT_READ;
+  fb->map = mmap(NULL, fb->map_size, prot, MAP_SHARED, fb->fd, 0);
+  if (fb->map == MAP_FAILED) {
+    perror(path);
+    close(fb->fd);
+    return 1;
+  }
+  return 0;
+}
+
+static void file_buffer_close(file_buffer_t *fb) {
+  if (fb->map)
+    munmap(fb->map, fb->map_size);
+  close(fb->fd);
+}
+
+// Registers a page aligned window of the mapping with the GPU, inputs as
+// read-only. Returns NULL if the kernel does not support userptr for this
+// mapping, or read-only userptr for an input.
+static drm_intel_bo *file_buffer_window(drm_intel_bufmgr *bufmgr,
+                                        file_buffer_t *fb, const char *name,
+                                        size_t offset, size_t size) {
+  unsigned long flags = fb->output ? 0 : I915_USERPTR_READ_ONLY;
+  return drm_intel_bo_alloc_userptr(bufmgr, name, fb->map + offset, 0, 0, size,
+                                    flags);
+}
+
+static void mmap_retire(stream_slot_t *slot, file_buffer_t *in,
+                        file_buffer_t *out, size_t *correct) {
+  int *input = (int *)(in->map + slot->offset);
+  int *output = (int *)(out->map + slot->offset);
+  size_t i;
+
+  drm_intel_bo_wait_rendering(slot->batch_buffer);
+  if (slot->bounce)
+    drm_intel_bo_get_subdata(slot->output_buffer, 0, slot->bytes, output);
+
+  for (i = 0; i < slot->bytes / sizeof(int); i++) {
+    if (output[i] == input[i] + input[i])
+      (*correct)++;
+  }
+
+  drm_intel_bo_unreference(slot->input_buffer);
+  drm_intel_bo_unreference(slot->output_buffer);
+  slot->bytes = 0;
+}
+
+// Runs the kernel directly over an mmap'd input file into an mmap'd output
+// file. Each window of the mappings is wrapped in userptr BOs, so there is no
+// read() and no staging copy. Without userptr support every window falls back
+// to a single copy through ordinary BOs.
+static int run_mmap(int fd, drm_intel_bufmgr *bufmgr, drm_intel_context *ctx,
+                    drm_intel_bo *kernel_buffer, const char *in_path,
+                    const char *out_path) {
+  uint8_t state_data[40960];
+  uint8_t batch_data[4096];
+  stream_slot_t slots[STREAM_SLOTS];
+  file_buffer_t in, out;
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t window, offset, correct = 0;
+  double start;
+  int i, n;
+  int err;
+
+  if (file_buffer_open(&in, in_path, 0, 0))
+    return 1;
+  if (file_buffer_open(&out, out_path, in.size, 1)) {
+    file_buffer_close(&in);
+    return 1;
+  }
+
+  window = (stream_chunk_size(fd, bufmgr) + page - 1) & ~(page - 1);
+  fprintf(stderr, "Mapping %zu bytes in %zu byte windows\n", in.size, window);
+
+  for (i = 0; i < STREAM_SLOTS; i++) {
+    slots[i].state_buffer =
+        drm_intel_bo_alloc(bufmgr, "state buffer", 36864, 4096);
+    slots[i].batch_buffer = drm_intel_bo_alloc(bufmgr, "batch buffer", 512, 64);
+    slots[i].bytes = 0;
+  }
+
+  start = now();
+  for (offset = 0, n = 0; offset < in.size; offset += window, n++) {
+    stream_slot_t *slot = &slots[n % STREAM_SLOTS];
+    size_t bytes = in.size - offset < window ? in.size - offset : window;
+    size_t size = (bytes + page - 1) & ~(page - 1);
+    size_t groups = (bytes + GROUP_SIZE * sizeof(int) - 1) /
+                    (GROUP_SIZE * sizeof(int));
+
+    if (slot->bytes)
+      mmap_retire(slot, &in, &out, &correct);
+
+    slot->input_buffer =
+        file_buffer_window(bufmgr, &in, "input window", offset, size);
+    slot->output_buffer =
+        file_buffer_window(bufmgr, &out, "output window", offset, size);
+    slot->bounce = !slot->input_buffer || !slot->output_buffer;
+    if (slot->bounce) {
+      if (slot->input_buffer)
+        drm_intel_bo_unreference(slot->input_buffer);
+      if (slot->output_buffer)
+        drm_intel_bo_unreference(slot->output_buffer);
+      slot->input_buffer =
+          drm_intel_bo_alloc(bufmgr, "input buffer", size, 4096);
+      slot->output_buffer =
+          drm_intel_bo_alloc(bufmgr, "output buffer", size, 4096);
+      err = drm_intel_bo_subdata(slot->input_buffer, 0, bytes,
+                                 in.map + offset);
+    }
+
+    dispatch_t d = {groups, GROUP_THREADS, 0, 0};
+    d.input_cache = CACHE_STREAMING;
+    d.output_cache = CACHE_STREAMING;
+
+    memset(state_data, 0, sizeof state_data);
+    setup_heap0(state_data, groups * GROUP_SIZE * sizeof(int), &d);
+    setup_curb0(state_data + CURB_OFFSET, &d);
+    setup_idrt0(state_data + IDRT_OFFSET, &d);
+    err = drm_intel_bo_subdata(slot->state_buffer, 0, 36864, state_data);
+
+    memset(batch_data, 0, sizeof batch_data);
+    slot->used = setup_batch0(batch_data, &d);
+    err = drm_intel_bo_subdata(slot->batch_buffer, 0, 512, batch_data);
+
+    // the previous window's relocations point at BOs that are gone by now
+    drm_intel_gem_bo_clear_relocs(slot->state_buffer, 0);
+    drm_intel_gem_bo_clear_relocs(slot->batch_buffer, 0);
+    emit_relocs0(slot->batch_buffer, slot->state_buffer, kernel_buffer,
+                 slot->input_buffer, slot->output_buffer, &d);
+
+    slot->offset = offset;
+    slot->bytes = bytes;
+    err = drm_intel_gem_bo_context_exec(slot->batch_buffer, ctx, slot->used,
+                                        1);
+  }
+
+  for (i = 0; i < STREAM_SLOTS; i++) {
+    stream_slot_t *slot = &slots[(n + i) % STREAM_SLOTS];
+    if (slot->bytes)
+      mmap_retire(slot, &in, &out, &correct);
+  }
+
+  fprintf(stderr, "Mapped %zu bytes in %.3f s\n", in.size, now() - start);
+  fprintf(stderr, "Computed '%zu/%zu' correct values!\n", correct,
+          in.size / sizeof(int));
+
+  for (i = 0; i < STREAM_SLOTS; i++) {
+    drm_intel_bo_unreference(slots[i].state_buffer);
+    drm_intel_bo_unreference(slots[i].batch_buffer);
+  }
+  file_buffer_close(&in);
+  file_buffer_close(&out);
+  return 0;
+}
+
+// CPU backend of the default kernel, output = input + input. A dispatch runs
+// over the same work-groups as on the GPU, split into one contiguous range per
+// host core.
+typedef struct cpu_range {
+  const int *input;
+  int *output;
+  size_t begin, end; // in ints
+} cpu_range_t;
+
+static void *cpu_worker(void *arg) {
+  const cpu_range_t *r = arg;
+  size_t i = r->begin;
+
+  for (; i + 4 <= r->end; i += 4) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(r->input + i));
+    _mm_storeu_si128((__m128i *)(r->output + i), _mm_add_epi32(v, v));
+  }
+  for (; i < r->end; i++)
+    r->output[i] = r->input[i] + r->input[i];
+  return NULL;
+}
+
+static int cpu_threads(void) {
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n < 1 ? 1 : n > CPU_MAX_THREADS ? CPU_MAX_THREADS : n;
+}
+
+// Runs d over the first size bytes of the buffers, like run_dispatch does.
+static void cpu_dispatch(const dispatch_t *d, const void *input_data,
+                         void *output_data, uint32_t size) {
+  pthread_t threads[CPU_MAX_THREADS];
+  cpu_range_t ranges[CPU_MAX_THREADS];
+  int started[CPU_MAX_THREADS] = {0};
+  size_t group_ints = d->group_threads * SIMD_WIDTH;
+  size_t end = size / sizeof(int);
+  int i, n = cpu_threads();
+
+  for (i = 0; i < n; i++) {
+    cpu_range_t *r = &ranges[i];
+    r->input = input_data;
+    r->output = output_data;
+    r->begin = d->offset + (size_t)d->groups * i / n * group_ints;
+    r->end = d->offset + (size_t)d->groups * (i + 1) / n * group_ints;
+    r->begin = r->begin < end ? r->begin : end;
+    r->end = r->end < end ? r->end : end;
+  }
+  for (i = 1; i < n; i++)
+    started[i] = !pthread_create(&threads[i], NULL, cpu_worker, &ranges[i]);
+  cpu_worker(&ranges[0]);
+  for (i = 1; i < n; i++) {
+    if (started[i])
+      pthread_join(threads[i], NULL);
+    else
+      cpu_worker(&ranges[i]);
+  }
+}
+
+// One pass of a job split at gpu_bytes. The GPU share is uploaded and
+// submitted first, the host cores compute the rest while it runs. Returns the
+// wall time of the pass.
+static double split_pass0(drm_intel_bufmgr *bufmgr, drm_intel_context *ctx,
+                          drm_intel_bo *kernel_buffer, const int *input,
+                          int *output, uint32_t bytes, uint32_t gpu_bytes) {
+  uint32_t group_bytes = GROUP_SIZE * sizeof(int);
+  dispatch_t gpu = {gpu_bytes / group_bytes, GROUP_THREADS, 0, 0};
+  dispatch_t cpu = {(bytes - gpu_bytes + group_bytes - 1) / group_bytes,
+                    GROUP_THREADS, 0, 0};
+  drm_intel_bo *input_buffer = NULL, *output_buffer = NULL;
+  drm_intel_bo *batch_buffer = NULL;
+  double start = now();
+  int used, err;
+
+  cpu.offset = gpu_bytes / sizeof(int);
+  if (gpu_bytes) {
+    input_buffer = drm_intel_bo_alloc(bufmgr, "input buffer", gpu_bytes, 4096);
+    output_buffer =
+        drm_intel_bo_alloc(bufmgr, "output buffer", gpu_bytes, 4096);
+    err = drm_intel_bo_subdata(input_buffer, 0, gpu_bytes, input);
+    batch_buffer = setup_dispatch0(bufmgr, kernel_buffer, &gpu, input_buffer,
+                                   output_buffer, gpu_bytes, &used);
+    err = drm_intel_gem_bo_context_exec(batch_buffer, ctx, used, 1);
+  }
+  cpu_dispatch(&cpu, input, output, bytes);
+  if (gpu_bytes) {
+    drm_intel_bo_wait_rendering(batch_buffer);
+    err = drm_intel_bo_get_subdata(output_buffer, 0, gpu_bytes, output);
+    drm_intel_bo_unreference(input_buffer);
+    drm_intel_bo_unreference(output_buffer);
+    drm_intel_bo_unreference(batch_buffer);
+  }
+  return now() - start;
+}
+
+// Divides one job between the GPU and the host cores in proportion to the
+// throughput each reaches on a probe of the same kernel, including the copies
+// to and from the GPU. Without a bufmgr everything runs on the CPU.
+static int run_split0(drm_intel_bufmgr *bufmgr, drm_intel_context *ctx,
+                      drm_intel_bo *kernel_buffer, uint32_t bytes) {
+  uint32_t group_bytes = GROUP_SIZE * sizeof(int);
+  uint32_t probe, gpu_bytes;
+  double gpu_rate = 0, cpu_rate = 0, elapsed;
+  size_t i, correct = 0;
+  int k;
+
+  if (bytes < group_bytes)
+    bytes = group_bytes;
+  bytes = (bytes + group_bytes - 1) / group_bytes * group_bytes;
+  probe = bytes < SPLIT_PROBE ? bytes : SPLIT_PROBE;
+  int *input = malloc(bytes);
+  int *output = malloc(bytes);
+  for (i = 0; i < bytes / sizeof(int); i++)
+    input[i] = i;
+
+  // the first run of each also pays for page faults and BO allocation
+  for (k = 0; k < SPLIT_PROBE_RUNS; k++) {
+    if (bufmgr)
+      gpu_rate = probe / split_pass0(bufmgr, ctx, kernel_buffer, input,
+                                     output, probe, probe);
+    cpu_rate = probe / split_pass0(bufmgr, ctx, kernel_buffer, input, output,
+                                   probe, 0);
+  }
+  gpu_bytes = (uint32_t)(bytes * (gpu_rate / (gpu_rate + cpu_rate))) /
+              group_bytes * group_bytes;
+  if (bufmgr)
+    fprintf(stderr, "GPU %.1f MB/s, ", gpu_rate / 1e6);
+  fprintf(stderr, "CPU %.1f MB/s on %d threads\n", cpu_rate / 1e6,
+          cpu_threads());
+
+  memset(output, 0, bytes);
+  elapsed = split_pass0(bufmgr, ctx, kernel_buffer, input, output, bytes,
+                        gpu_bytes);
+  for (i = 0; i < bytes / sizeof(int); i++) {
+    if (output[i] == input[i] + input[i])
+      correct++;
+  }
+  fprintf(stderr, "Split %u bytes %u GPU / %u CPU in %.3f s", bytes, gpu_bytes,
+          bytes - gpu_bytes, elapsed);
+  if (gpu_rate > 0)
+    fprintf(stderr, " (GPU alone %.3f s, CPU alone %.3f s)", bytes / gpu_rate,
+            bytes / cpu_rate);
+  fprintf(stderr, "\n");
+  fprintf(stderr, "Computed '%zu/%zu' correct values!\n", correct,
+          bytes / sizeof(int));
+
+  free(input);
+  free(output);
+  return correct != bytes / sizeof(int);
+}
+
+static const char *reduce_names[] = {"sum", "min", "max", "argmax"};
+
+// Neutral element of op, inputs are padded with it to whole work-groups.
+static uint32_t reduce_identity(int op, int type) {
+  if (op == REDUCE_SUM)
+    return 0;
+  if (op == REDUCE_MIN)
+    return type == GEN_TYPE_F ? 0x7f800000 : INT32_MAX; // +inf
+  return type == GEN_TYPE_F ? 0xff800000 : (uint32_t)INT32_MIN; // -inf
+}
+
+// Reduces n values on the GPU. Every level leaves one partial per work-group,
+// which becomes the input of the next dispatch until a single value is left.
+// For ARGMAX the indices of each level are mapped back to the input.
+static int gpu_reduce0(drm_intel_bufmgr *bufmgr, drm_intel_context *ctx,
+                       int op, int type, const uint32_t *values, uint32_t n,
+                       uint32_t *result, uint32_t *index) {
+  uint8_t kernel_data[4096] = {0};
+  dispatch_t d = {0, GROUP_THREADS, 2 * REDUCE_SLM_INDEX, 1};
+  uint32_t identity = reduce_identity(op, type);
+  const uint32_t *level = values;
+  uint32_t *partials = NULL, *map = NULL;
+  uint32_t i;
+  int size, err = 0;
+
+  size = setup_reduce_kernel0(kernel_data, op, type, GROUP_THREADS, identity);
+  drm_intel_bo *kernel_buffer =
+      drm_intel_bo_alloc(bufmgr, "reduce kernel buffer", size, 64);
+  err = drm_intel_bo_subdata(kernel_buffer, 0, size, kernel_data);
+
+  do {
+    d.groups = (n + GROUP_SIZE - 1) / GROUP_SIZE;
+    uint32_t bytes = d.groups * GROUP_SIZE * sizeof(uint32_t);
+    uint32_t *output = malloc(bytes);
+    uint32_t *padded = NULL;
+    const uint32_t *input = level;
+
+    if (n % GROUP_SIZE) {
+      padded = malloc(bytes);
+      memcpy(padded, level, n * sizeof(uint32_t));
+      for (i = n; i < d.groups * GROUP_SIZE; i++)
+        padded[i] = identity;
+      input = padded;
+    }
+    err = run_dispatch0(bufmgr, ctx, kernel_buffer, &d, input, output, bytes);
+    free(padded);
+
+    if (op == REDUCE_ARGMAX) {
+      for (i = 0; i < d.groups; i++) {
+        uint32_t pos = output[2 * i + 1];
+        output[i] = output[2 * i];
+        output[2 * d.groups + i] = map ? map[pos] : pos;
+      }
+      map = output + 2 * d.groups;
+    }
+    free(partials);
+    partials = output;
+    level = partials;
+    n = d.groups;
+  } while (n > 1);
+
+  *result = level[0];
+  *index = map ? map[0] : 0;
+  free(partials);
+  drm_intel_bo_unreference(kernel_buffer);
+  return err;
+}
+
+static __m128i cpu_select(__m128i mask, __m128i a, __m128i b) {
+  return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+// Mask of the lanes where b should replace a.
+static __m128i cpu_takes(int op, int type, __m128i a, __m128i b) {
+  if (type == GEN_TYPE_F) {
+    __m128 fa = _mm_castsi128_ps(a), fb = _mm_castsi128_ps(b);
+    return _mm_castps_si128(op == REDUCE_MIN ? _mm_cmplt_ps(fb, fa)
+                                             : _mm_cmpgt_ps(fb, fa));
+  }
+  return op == REDUCE_MIN ? _mm_cmplt_epi32(b, a) : _mm_cmpgt_epi32(b, a);
+}
+
+static int cpu_take(int op, int type, uint32_t a, uint32_t b) {
+  float fa, fb;
+  memcpy(&fa, &a, sizeof fa);
+  memcpy(&fb, &b, sizeof fb);
+  if (type == GEN_TYPE_F)
+    return op == REDUCE_MIN ? fb < fa : fb > fa;
+  return op == REDUCE_MIN ? (int32_t)b < (int32_t)a : (int32_t)b > (int32_t)a;
+}
+
+static uint32_t cpu_add(int type, uint32_t a, uint32_t b) {
+  float fa, fb;
+  if (type != GEN_TYPE_F)
+    return a + b;
+  memcpy(&fa, &a, sizeof fa);
+  memcpy(&fb, &b, sizeof fb);
+  fa += fb;
+  memcpy(&a, &fa, sizeof a);
+  return a;
+}
+
+// SSE2 baseline for the GPU reductions, four lanes wide with the tail and the
+// final fold of the lanes done in scalar code.
+static uint32_t cpu_reduce(int op, int type, const uint32_t *values,
+                           uint32_t n, uint32_t *index) {
+  uint32_t acc_lanes[4], idx_lanes[4];
+  uint32_t result, i, j;
+  __m128i acc = _mm_set1_epi32(reduce_identity(op, type));
+  __m128i idx = _mm_setzero_si128();
+  __m128i pos = _mm_setr_epi32(0, 1, 2, 3);
+
+  for (i = 0; i + 4 <= n; i += 4) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(values + i));
+    if (op == REDUCE_SUM && type == GEN_TYPE_F) {
+      acc = _mm_castps_si128(
+          _mm_add_ps(_mm_castsi128_ps(acc), _mm_castsi128_ps(v)));
+    } else if (op == REDUCE_SUM) {
+      acc = _mm_add_epi32(acc, v);
+    } else {
+      __m128i take = cpu_takes(op, type, acc, v);
+      acc = cpu_select(take, v, acc);
+      idx = cpu_select(take, pos, idx);
+    }
+    pos = _mm_add_epi32(pos, _mm_set1_epi32(4));
+  }
+  _mm_storeu_si128((__m128i *)acc_lanes, acc);
+  _mm_storeu_si128((__m128i *)idx_lanes, idx);
+
+  result = acc_lanes[0];
+  *index = idx_lanes[0];
+  for (j = 1; j < 4 + n - i; j++) {
+    uint32_t v = j < 4 ? acc_lanes[j] : values[i + j - 4];
+    uint32_t k = j < 4 ? idx_lanes[j] : i + j - 4;
+    if (op == REDUCE_SUM) {
+      result = cpu_add(type, result, v);
+    } else if (cpu_take(op, type, result, v) ||
+               (v == result && k < *index)) {
+      result = v;
+      *index = k;
+    }
+  }
+  return result;
+}
+
+// Benchmarks every reduction over n random ints and floats against the CPU
+// baseline. The floats are integral and small enough for every partial sum to
+// be exact, so any summation order gives the same result.
+static int run_reduce0(drm_intel_bufmgr *bufmgr, drm_intel_context *ctx,
+                       uint32_t n) {
+  uint32_t *values = malloc(n * sizeof(uint32_t));
+  int types[] = {GEN_TYPE_D, GEN_TYPE_F};
+  int t, op, err = 0;
+  uint32_t i;
+
+  for (t = 0; t < 2; t++) {
+    for (i = 0; i < n; i++) {
+      if (types[t] == GEN_TYPE_F) {
+        float f = rand() % 2001 - 1000;
+        memcpy(&values[i], &f, sizeof f);
+      } else {
+        values[i] = rand() - RAND_MAX / 2;
+      }
+    }
+    for (op = REDUCE_SUM; op <= REDUCE_ARGMAX; op++) {
+      uint32_t gpu, cpu, gpu_index, cpu_index;
+      double start = now();
+      err = gpu_reduce0(bufmgr, ctx, op, types[t], values, n, &gpu, &gpu_index);
+      double gpu_time = now() - start;
+      start = now();
+      cpu = cpu_reduce(op, types[t], values, n, &cpu_index);
+      double cpu_time = now() - start;
+
+      int correct =
+          gpu == cpu && (op != REDUCE_ARGMAX || gpu_index == cpu_index);
+      fprintf(stderr, "%s %-6s gpu %8.3f ms, cpu %8.3f ms, %s\n",
+              types[t] == GEN_TYPE_F ? "float" : "int", reduce_names[op],
+              gpu_time * 1e3, cpu_time * 1e3, correct ? "correct" : "WRONG");
+    }
+  }
+  free(values);
+  return err;
+}
+
+typedef struct elem_type {
+  const char *name;
+  int elem;
+  int size;
+} elem_type_t;
+
+static const elem_type_t elem_types[] = {
+    {"int32", ELEM_INT32, 4},     {"float32", ELEM_FLOAT32, 4},
+    {"float16", ELEM_FLOAT16, 2}, {"int16", ELEM_INT16, 2},
+    {"int8", ELEM_INT8, 1},       {"int64", ELEM_INT64, 8},
+};
+
+// Normal numbers and zero only, which is all the test data uses.
+static float half_to_float(uint16_t h) {
+  uint32_t bits = (uint32_t)(h & 0x8000) << 16;
+  float f;
+  if (h & 0x7fff)
+    bits |= ((h & 0x7fff) << 13) + ((127 - 15) << 23);
+  memcpy(&f, &bits, sizeof f);
+  return f;
+}
+
+static uint16_t float_to_half(float f) {
+  uint32_t bits;
+  memcpy(&bits, &f, sizeof bits);
+  if (!(bits & 0x7fffffff))
+    return bits >> 16;
+  return ((bits >> 16) & 0x8000) |
+         (((bits & 0x7fffffff) - ((127 - 15) << 23)) >> 13);
+}
+
+static void elem_fill(int elem, uint8_t *data, size_t bytes) {
+  size_t i;
+  for (i = 0; i < bytes; i += 4) {
+    uint32_t v = rand();
+    float f = rand() % 2001 - 1000;
+    if (elem == ELEM_FLOAT32) {
+      memcpy(&v, &f, sizeof v);
+    } else if (elem == ELEM_FLOAT16) {
+      v = float_to_half(f) |
+          (uint32_t)float_to_half(rand() % 2001 - 1000) << 16;
+    }
+    memcpy(data + i, &v, sizeof v);
+  }
+}
+
+static int elem_check(int elem, const uint8_t *input, const uint8_t *output,
+                      size_t i) {
+  switch (elem) {
+  case ELEM_INT32:
+    return *(uint32_t *)(output + 4 * i) == *(uint32_t *)(input + 4 * i) * 2;
+  case ELEM_FLOAT32:
+    return *(float *)(output + 4 * i) == *(float *)(input + 4 * i) * 2;
+  case ELEM_FLOAT16:
+    return *(uint16_t *)(output + 2 * i) ==
+           float_to_half(half_to_float(*(uint16_t *)(input + 2 * i)) * 2);
+  case ELEM_INT16:
+    return *(uint16_t *)(output + 2 * i) ==
+           (uint16_t)(*(uint16_t *)(input + 2 * i) * 2);
+  case ELEM_INT8:
+    return output[i] == (uint8_t)(input[i] * 2);
+  case ELEM_INT64:
+    return *(uint64_t *)(output + 8 * i) == *(uint64_t *)(input + 8 * i) * 2;
+  }
+  return 0;
+}
+
+// Launch parameters of a kernel picked by the autotuner.
+typedef struct tune {
+  uint32_t group_threads;
+  uint32_t l3;    // index into l3_presets
+  uint32_t chunk; // bytes per dispatch
+} tune_t;
+
+// Winning configurations for this device by kernel hash, loaded at startup.
+static struct {
+  uint32_t devid;
+  uint32_t count;
+  uint32_t hashes[PROFILE_ENTRIES];
+  tune_t tunes[PROFILE_ENTRIES];
+} profile;
+
+static const char *profile_path(void) {
+  const char *path = getenv("GPGPU_PROFILE");
+  return path ? path : PROFILE_PATH;
+}
+
+static void profile_add(uint32_t hash, const tune_t *t) {
+  uint32_t i;
+  for (i = 0; i < profile.count && profile.hashes[i] != hash; i++)
+    ;
+  if (i == PROFILE_ENTRIES)
+    return;
+  profile.hashes[i] = hash;
+  profile.tunes[i] = *t;
+  if (i == profile.count)
+    profile.count++;
+}
+
+static const tune_t *profile_find(uint32_t hash) {
+  uint32_t i;
+  for (i = 0; i < profile.count; i++) {
+    if (profile.hashes[i] == hash)
+      return &profile.tunes[i];
+  }
+  return NULL;
+}
+
+// Profile lines are "devid hash group_threads l3 chunk", the profile is shared
+// by all devices of a fleet and later lines win.
+static void profile_load(uint32_t devid) {
+  char name[32];
+  uint32_t id, hash;
+  tune_t t;
+
+  profile.devid = devid;
+  profile.count = 0;
+  FILE *file = fopen(profile_path(), "r");
+  if (!file)
+    return;
+  while (fscanf(file, "%x %x %u %31s %u", &id, &hash, &t.group_threads, name,
+                &t.chunk) == 5) {
+    for (t.l3 = 0; t.l3 < sizeof l3_presets / sizeof l3_presets[0]; t.l3++) {
+      if (!strcmp(name, l3_presets[t.l3].name))
+        break;
+    }
+    if (id == devid && t.l3 < sizeof l3_presets / sizeof l3_presets[0] &&
+        t.group_threads && t.chunk)
+      profile_add(hash, &t);
+  }
+  fclose(file);
+}
+
+static int profile_save(uint32_t hash, const tune_t *t) {
+  FILE *file = fopen(profile_path(), "a");
+  if (!file) {
+    perror(profile_path());
+    return 1;
+  }
+  fprintf(file, "%04x %08x %u %s %u\n", profile.devid, hash, t->group_threads,
+          l3_presets[t->l3].name, t->chunk);
+  profile_add(hash, t);
+  return fclose(file) != 0;
+}
+
+// Runs a typed kernel over bytes of the given buffers as dispatches of
+// t->chunk bytes and returns the time from the first submission until the
+// last one retired, or a negative value if they could not be set up.
+static double dispatch_chunks0(drm_intel_bufmgr *bufmgr, drm_intel_context *ctx,
+                               drm_intel_bo *kernel_buffer, const tune_t *t,
+                               drm_intel_bo *input_buffer,
+                               drm_intel_bo *output_buffer, uint32_t bytes) {
+  dispatch_t d = {0, t->group_threads, 0, 0, &l3_presets[t->l3]};
+  uint32_t group_bytes = t->group_threads * SIMD_WIDTH * sizeof(uint32_t);
+  uint32_t chunk = (t->chunk + group_bytes - 1) / group_bytes * group_bytes;
+  uint32_t i, count;
+  int err;
+
+  if (!bytes)
+    return 0;
+  // a chunk of 0 runs all bytes in one dispatch
+  chunk = chunk ? chunk : bytes;
+  count = (bytes - 1) / chunk + 1;
+  drm_intel_bo **batches = malloc(count * sizeof(*batches));
+  int *used = malloc(count * sizeof(*used));
+  if (!batches || !used) {
+    free(batches);
+    free(used);
+    return -1;
+  }
+
+  for (i = 0; i < count; i++) {
+    uint32_t size = bytes - i * chunk < chunk ? bytes - i * chunk : chunk;
+    d.groups = (size + group_bytes - 1) / group_bytes;
+    d.offset = i * chunk / sizeof(uint32_t);
+    batches[i] = setup_dispatch0(bufmgr, kernel_buffer, &d, input_buffer,
+                                 output_buffer, bytes, &used[i]);
+  }
+
+  double start = now();
+  for (i = 0; i < count; i++)
+    err = drm_intel_gem_bo_context_exec(batches[i], ctx, used[i], 1);
+  drm_intel_bo_wait_rendering(batches[count - 1]);
+  double elapsed = now() - start;
+
+  for (i = 0; i < count; i++)
+    drm_intel_bo_unreference(batches[i]);
+  free(batches);
+  free(used);
+  return elapsed;
+}
+
+// Times every typed kernel over bytes across group sizes, L3 presets and chunk
+// sizes, and saves the fastest configuration of each to the profile once it is
+// checked to compute correct values. Kernels only exist as SIMD16.
+static int run_autotune0(drm_intel_bufmgr *bufmgr, drm_intel_context *ctx,
+                         uint32_t bytes) {
+  static const uint32_t threads[] = {1, 2, 4, 8, 16};
+  static const uint32_t chunks[] = {1 << 18, 1 << 20, 1 << 22, 1 << 24};
+  uint8_t kernel_data[4096] = {0};
+  uint32_t t, i, j, k, r;
+  size_t e, correct;
+  int size, err = 0;
+
+  // whole groups of the largest size
+  bytes = (bytes + 1023) & ~1023;
+  uint8_t *input = malloc(bytes);
+  uint8_t *output = malloc(bytes);
+
+  for (t = 0; t < sizeof elem_types / sizeof elem_types[0]; t++) {
+    const elem_type_t *et = &elem_types[t];
+    tune_t best = {GROUP_THREADS, L3_PRESET_DEFAULT, bytes};
+    double best_time = 1e30;
+    size_t count = bytes / et->size;
+
+    size = setup_typed_kernel0(kernel_data, et->elem);
+    drm_intel_bo *kernel_buffer =
+        drm_intel_bo_alloc(bufmgr, "typed kernel buffer", size, 64);
+    err = drm_intel_bo_subdata(kernel_buffer, 0, size, kernel_data);
+    elem_fill(et->elem, input, bytes);
+    drm_intel_bo *input_buffer =
+        drm_intel_bo_alloc(bufmgr, "input buffer", bytes, 64);
+    err = drm_intel_bo_subdata(input_buffer, 0, bytes, input);
+    drm_intel_bo *output_buffer =
+        drm_intel_bo_alloc(bufmgr, "output buffer", bytes, 64);
+
+    for (i = 0; i < sizeof threads / sizeof threads[0]; i++) {
+      for (j = 0; j < sizeof l3_presets / sizeof l3_presets[0]; j++) {
+        for (k = 0; k < sizeof chunks / sizeof chunks[0]; k++) {
+          tune_t tune = {threads[i], j, chunks[k] < bytes ? chunks[k] : bytes};
+          if (k && chunks[k - 1] >= bytes)
+            break;
+          for (r = 0; r < AUTOTUNE_RUNS; r++) {
+            double elapsed =
+                dispatch_chunks0(bufmgr, ctx, kernel_buffer, &tune,
+                                 input_buffer, output_buffer, bytes);
+            if (elapsed >= 0 && elapsed < best_time) {
+              best_time = elapsed;
+              best = tune;
+            }
+          }
+        }
+      }
+    }
+
+    memset(output, 0, bytes);
+    err = drm_intel_bo_subdata(output_buffer, 0, bytes, output);
+    dispatch_chunks0(bufmgr, ctx, kernel_buffer, &best, input_buffer,
+                     output_buffer, bytes);
+    err = drm_intel_bo_get_subdata(output_buffer, 0, bytes, output);
+    for (e = 0, correct = 0; e < count; e++)
+      correct += elem_check(et->elem, input, output, e);
+    fprintf(stderr,
+            "%-8s %2u threads, L3 %-9s %6u KB chunks, %8.1f Melem/s, "
+            "%zu/%zu correct\n",
+            et->name, best.group_threads, l3_presets[best.l3].name,
+            best.chunk >> 10, count / best_time * 1e-6, correct, count);
+    if (correct == count)
+      err = profile_save(fnv1a(kernel_data, size), &best);
+
+    drm_intel_bo_unreference(kernel_buffer);
+    drm_intel_bo_unreference(input_buffer);
+    drm_intel_bo_unreference(output_buffer);
+  }
+  free(input);
+  free(output);
+  return err;
+}
+
+// Doubles bytes worth of every element type and checks the results. The
+// buffer size stays the same, so narrower types process more elements for
+// the same memory traffic.
+static int run_types0(drm_intel_bufmgr *bufmgr, drm_intel_context *ctx,
+                      uint32_t bytes) {
+  uint8_t kernel_data[4096] = {0};
+  uint8_t *input, *output;
+  int t, size, err = 0;
+  size_t i, correct;
+
+  bytes = (bytes + GROUP_SIZE * 4 - 1) / (GROUP_SIZE * 4) * (GROUP_SIZE * 4);
+  input = malloc(bytes);
+  output = malloc(bytes);
+
+  for (t = 0; t < sizeof elem_types / sizeof elem_types[0]; t++) {
+    const elem_type_t *et = &elem_types[t];
+    size_t count = bytes / et->size;
+
+    size = setup_typed_kernel0(kernel_data, et->elem);
+    drm_intel_bo *kernel_buffer =
+        drm_intel_bo_alloc(bufmgr, "typed kernel buffer", size, 64);
+    err = drm_intel_bo_subdata(kernel_buffer, 0, size, kernel_data);
+
+    // launch parameters from the profile, if the kernel was tuned
+    tune_t tune = {GROUP_THREADS, L3_PRESET_DEFAULT, bytes};
+    const tune_t *tuned = profile_find(fnv1a(kernel_data, size));
+    if (tuned)
+      tune = *tuned;
+
+    elem_fill(et->elem, input, bytes);
+    drm_intel_bo *input_buffer =
+        drm_intel_bo_alloc(bufmgr, "input buffer", bytes, 64);
+    err = drm_intel_bo_subdata(input_buffer, 0, bytes, input);
+    drm_intel_bo *output_buffer =
+        drm_intel_bo_alloc(bufmgr, "output buffer", bytes, 64);
+    double elapsed = dispatch_chunks0(bufmgr, ctx, kernel_buffer, &tune,
+                                      input_buffer, output_buffer, bytes);
+    err = drm_intel_bo_get_subdata(output_buffer, 0, bytes, output);
+    drm_intel_bo_unreference(kernel_buffer);
+    drm_intel_bo_unreference(input_buffer);
+    drm_intel_bo_unreference(output_buffer);
+
+    for (i = 0, correct = 0; i < count; i++)
+      correct += elem_check(et->elem, input, output, i);
+    fprintf(stderr, "%-8s %8.3f ms, %8.1f Melem/s, %zu/%zu correct%s\n",
+            et->name, elapsed * 1e3, count / elapsed * 1e-6, correct, count,
+            tuned ? " (tuned)" : "");
+  }
+  free(input);
+  free(output);
+  return err;
+}
+
+// Times runs back to back executions of the kernel over bytes of the given
+// buffers. One untimed run first pays for binding the buffers and switching
+// the L3 configuration.
+static double time_dispatch0(drm_intel_bufmgr *bufmgr, drm_intel_context *ctx,
+                             drm_intel_bo *kernel_buffer, const dispatch_t *d,
+                             drm_intel_bo *input_buffer,
+                             drm_intel_bo *output_buffer, uint32_t bytes,
+                             int runs) {
+  int i, used, err;
+
+  drm_intel_bo *batch_buffer = setup_dispatch0(
+      bufmgr, kernel_buffer, d, input_buffer, output_buffer, bytes, &used);
+
+  err = drm_intel_gem_bo_context_exec(batch_buffer, ctx, used, 1);
+  drm_intel_bo_wait_rendering(batch_buffer);
+  double start = now();
+  for (i = 0; i < runs; i++)
+    err = drm_intel_gem_bo_context_exec(batch_buffer, ctx, used, 1);
+  drm_intel_bo_wait_rendering(batch_buffer);
+  double elapsed = now() - start;
+
+  drm_intel_bo_unreference(batch_buffer);
+  return elapsed;
+}
+
+static drm_intel_bo *alloc_int32_input(drm_intel_bufmgr *bufmgr,
+                                       uint32_t bytes) {
+  drm_intel_bo *bo = drm_intel_bo_alloc(bufmgr, "input buffer", bytes, 64);
+  uint8_t *data = malloc(bytes);
+  elem_fill(ELEM_INT32, data, bytes);
+  drm_intel_bo_subdata(bo, 0, bytes, data);
+  free(data);
+  return bo;
+}
+
+// Runs the int32 doubling kernel and the SLM sum reduction under every L3
+// preset that fits them, and reports the throughput.
+static int run_l3_sweep0(drm_intel_bufmgr *bufmgr, drm_intel_context *ctx,
+                         uint32_t bytes) {
+  uint8_t kernel_data[4096] = {0};
+  dispatch_t d = {0, GROUP_THREADS, 0, 0, NULL};
+  int k, t, size, err = 0;
+
+  bytes = (bytes + GROUP_SIZE * 4 - 1) / (GROUP_SIZE * 4) * (GROUP_SIZE * 4);
+  d.groups = bytes / (GROUP_SIZE * 4);
+  drm_intel_bo *input_buffer = alloc_int32_input(bufmgr, bytes);
+  drm_intel_bo *output_buffer =
+      drm_intel_bo_alloc(bufmgr, "output buffer", bytes, 64);
+
+  for (k = 0; k < 2; k++) {
+    int reduce = k == 1;
+    size = reduce ? setup_reduce_kernel0(kernel_data, REDUCE_SUM, GEN_TYPE_D,
+                                         GROUP_THREADS, 0)
+                  : setup_typed_kernel0(kernel_data, ELEM_INT32);
+    drm_intel_bo *kernel_buffer =
+        drm_intel_bo_alloc(bufmgr, "sweep kernel buffer", size, 64);
+    err = drm_intel_bo_subdata(kernel_buffer, 0, size, kernel_data);
+
+    d.slm_size = reduce ? 2 * REDUCE_SLM_INDEX : 0;
+    d.barrier = reduce;
+    for (t = 0; t < sizeof l3_presets / sizeof l3_presets[0]; t++) {
+      if (d.slm_size && !l3_presets[t].slm)
+        continue;
+      d.l3 = &l3_presets[t];
+      double elapsed = time_dispatch0(bufmgr, ctx, kernel_buffer, &d,
+                                      input_buffer, output_buffer, bytes,
+                                      L3_SWEEP_RUNS);
+      fprintf(stderr, "%-6s l3 %-10s %8.2f GB/s\n",
+              reduce ? "reduce" : "double", l3_presets[t].name,
+              (double)bytes * L3_SWEEP_RUNS / elapsed * 1e-9);
+    }
+    drm_intel_bo_unreference(kernel_buffer);
+  }
+
+  drm_intel_bo_unreference(input_buffer);
+  drm_intel_bo_unreference(output_buffer);
+  return err;
+}
+
+// Compares the cache policies for data that is read once, a buffer of bytes
+// larger than LLC, and for data that is reused, a CACHE_REUSE_BYTES buffer
+// processed over and over.
+static int run_cache_sweep0(drm_intel_bufmgr *bufmgr, drm_intel_context *ctx,
+                            uint32_t bytes) {
+  static const char *names[] = {"llc+l3", "l3", "streaming"};
+  uint8_t kernel_data[4096] = {0};
+  dispatch_t d = {0, GROUP_THREADS, 0, 0, NULL};
+  uint32_t sizes[2];
+  int k, c, size, err = 0;
+
+  sizes[0] = (bytes + GROUP_SIZE * 4 - 1) / (GROUP_SIZE * 4) * (GROUP_SIZE * 4);
+  sizes[1] = CACHE_REUSE_BYTES;
+  size = setup_typed_kernel0(kernel_data, ELEM_INT32);
+  drm_intel_bo *kernel_buffer =
+      drm_intel_bo_alloc(bufmgr, "cache kernel buffer", size, 64);
+  err = drm_intel_bo_subdata(kernel_buffer, 0, size, kernel_data);
+
+  for (k = 0; k < 2; k++) {
+    // the same amount of data goes through the GPU in both cases
+    int runs = k ? L3_SWEEP_RUNS * (sizes[0] / sizes[1]) : L3_SWEEP_RUNS;
+    drm_intel_bo *input_buffer = alloc_int32_input(bufmgr, sizes[k]);
+    drm_intel_bo *output_buffer =
+        drm_intel_bo_alloc(bufmgr, "output buffer", sizes[k], 64);
+
+    d.groups = sizes[k] / (GROUP_SIZE * 4);
+    for (c = CACHE_LLC_L3; c <= CACHE_STREAMING; c++) {
+      d.input_cache = c;
+      d.output_cache = c;
+      double elapsed = time_dispatch0(bufmgr, ctx, kernel_buffer, &d,
+                                      input_buffer, output_buffer, sizes[k],
+                                      runs);
+      fprintf(stderr, "%-9s %-9s %8.2f GB/s\n", k ? "reused" : "read-once",
+              names[c], (double)sizes[k] * runs / elapsed * 1e-9);
+    }
+    drm_intel_bo_unreference(input_buffer);
+    drm_intel_bo_unreference(output_buffer);
+  }
+
+  drm_intel_bo_unreference(kernel_buffer);
+  return err;
+}
+
+// Sizes the doubling kernel on the GPU. The count kernel turns the element
+// count in a header buffer into thread group counts, and the second dispatch
+// loads them into the walker at execution time, so both are queued before the
+// CPU waits once.
+static int run_indirect0(drm_intel_bufmgr *bufmgr, drm_intel_context *ctx,
+                         uint32_t n) {
+  uint8_t kernel_data[4096] = {0};
+  uint32_t header[16] = {n}, dims[3];
+  dispatch_t count = {1, 1, 0, 0};
+  dispatch_t d = {0, GROUP_THREADS, 0, 0};
+  uint32_t groups = (n + GROUP_SIZE - 1) / GROUP_SIZE;
+  // one spare group past the end has to stay untouched
+  uint32_t bytes = (groups + 1) * GROUP_SIZE * sizeof(uint32_t);
+  uint32_t i, correct = 0;
+  int size, count_used, used, err;
+
+  size = setup_count_kernel0(kernel_data);
+  drm_intel_bo *count_kernel_buffer =
+      drm_intel_bo_alloc(bufmgr, "count kernel buffer", size, 64);
+  err = drm_intel_bo_subdata(count_kernel_buffer, 0, size, kernel_data);
+  size = setup_typed_kernel0(kernel_data, ELEM_INT32);
+  drm_intel_bo *kernel_buffer =
+      drm_intel_bo_alloc(bufmgr, "typed kernel buffer", size, 64);
+  err = drm_intel_bo_subdata(kernel_buffer, 0, size, kernel_data);
+
+  drm_intel_bo *header_buffer =
+      drm_intel_bo_alloc(bufmgr, "header buffer", sizeof header, 64);
+  err = drm_intel_bo_subdata(header_buffer, 0, sizeof header, header);
+  drm_intel_bo *indirect_buffer =
+      drm_intel_bo_alloc(bufmgr, "indirect buffer", sizeof header, 64);
+
+  uint32_t *input = malloc(bytes);
+  uint32_t *output = calloc(1, bytes);
+  drm_intel_bo *input_buffer = alloc_int32_input(bufmgr, bytes);
+  drm_intel_bo *output_buffer =
+      drm_intel_bo_alloc(bufmgr, "output buffer", bytes, 64);
+  err = drm_intel_bo_subdata(output_buffer, 0, bytes, output);
+
+  d.indirect = indirect_buffer;
+  drm_intel_bo *count_batch_buffer =
+      setup_dispatch0(bufmgr, count_kernel_buffer, &count, header_buffer,
+                      indirect_buffer, sizeof header, &count_used);
+  drm_intel_bo *batch_buffer = setup_dispatch0(
+      bufmgr, kernel_buffer, &d, input_buffer, output_buffer, bytes, &used);
+
+  err = drm_intel_gem_bo_context_exec(count_batch_buffer, ctx, count_used, 1);
+  err = drm_intel_gem_bo_context_exec(batch_buffer, ctx, used, 1);
+  drm_intel_bo_wait_rendering(batch_buffer);
+
+  err = drm_intel_bo_get_subdata(indirect_buffer, 0, sizeof dims, dims);
+  err = drm_intel_bo_get_subdata(input_buffer, 0, bytes, input);
+  err = drm_intel_bo_get_subdata(output_buffer, 0, bytes, output);
+  for (i = 0; i < bytes / sizeof(uint32_t); i++) {
+    if (output[i] == (i < groups * GROUP_SIZE ? input[i] * 2 : 0))
+      correct++;
+  }
+  fprintf(stderr, "GPU sized the dispatch to {%u, %u, %u} groups\n", dims[0],
+          dims[1], dims[2]);
+  fprintf(stderr, "Computed '%u/%u' correct values!\n", correct,
+          (uint32_t)(bytes / sizeof(uint32_t)));
+
+  free(input);
+  free(output);
+  drm_intel_bo_unreference(count_batch_buffer);
+  drm_intel_bo_unreference(batch_buffer);
+  drm_intel_bo_unreference(count_kernel_buffer);
+  drm_intel_bo_unreference(kernel_buffer);
+  drm_intel_bo_unreference(header_buffer);
+  drm_intel_bo_unreference(indirect_buffer);
+  drm_intel_bo_unreference(input_buffer);
+  drm_intel_bo_unreference(output_buffer);
+  return err;
+}
+
+// Submits count dispatches of the doubling kernel with a group count that
+// changes between them, first as flat batches built from scratch and then as
+// small batches calling a prologue recorded once, and finally as the same
+// small batches submitted through execbuffer2 directly, with relocations and
+// with softpinned buffers. Reports the CPU time spent to build and submit a
+// dispatch.
+static int run_submit0(int fd, drm_intel_bufmgr *bufmgr,
+                       drm_intel_context *ctx, uint32_t count) {
+  static const char *names[SUBMIT_PASSES] = {"Flat", "Chained", "Direct",
+                                             "Pinned"};
+  uint8_t kernel_data[4096] = {0};
+  uint8_t state_data[40960] = {0};
+  uint8_t batch_data[4096] = {0};
+  dispatch_t d = {SUBMIT_GROUPS, GROUP_THREADS, 0, 0};
+  uint32_t bytes = SUBMIT_GROUPS * GROUP_SIZE * sizeof(uint32_t);
+  uint32_t i, pass, correct, shared = 0;
+  int size, used, err;
+  exec_list_t direct;
+  drm_intel_bo *batch_buffers[SUBMIT_BATCHES];
+
+  size = setup_typed_kernel0(kernel_data, ELEM_INT32);
+  drm_intel_bo *kernel_buffer =
+      drm_intel_bo_alloc(bufmgr, "typed kernel buffer", size, 64);
+  err = drm_intel_bo_subdata(kernel_buffer, 0, size, kernel_data);
+
+  uint32_t *input = malloc(bytes);
+  uint32_t *output = malloc(bytes);
+  drm_intel_bo *input_buffer = alloc_int32_input(bufmgr, bytes);
+  drm_intel_bo *output_buffer =
+      drm_intel_bo_alloc(bufmgr, "output buffer", bytes, 64);
+  err = drm_intel_bo_get_subdata(input_buffer, 0, bytes, input);
+
+  // state is shared by all dispatches, only the group count changes
+  drm_intel_bo *state_buffer =
+      drm_intel_bo_alloc(bufmgr, "state buffer", 36864, 4096);
+  setup_heap0(state_data, bytes, &d);
+  setup_curb0(state_data + CURB_OFFSET, &d);
+  setup_idrt0(state_data + IDRT_OFFSET, &d);
+  err = drm_intel_bo_subdata(state_buffer, 0, 36864, state_data);
+  emit_state_relocs0(NULL, state_buffer, input_buffer, output_buffer, &d);
+
+  drm_intel_bo *prologue_buffer =
+      drm_intel_bo_alloc(bufmgr, "prologue buffer", 512, 64);
+  used = setup_prologue0(batch_data, &d);
+  err = drm_intel_bo_subdata(prologue_buffer, 0, used, batch_data);
+  emit_prologue_relocs0(NULL, prologue_buffer, state_buffer, kernel_buffer);
+
+  // GEM object creation is not part of the cost of a dispatch
+  for (i = 0; i < SUBMIT_BATCHES; i++)
+    batch_buffers[i] = drm_intel_bo_alloc(bufmgr, "batch buffer", 512, 64);
+
+  for (pass = 0; pass < SUBMIT_PASSES; pass++) {
+    memset(output, 0, bytes);
+    err = drm_intel_bo_subdata(output_buffer, 0, bytes, output);
+
+    if (pass >= 2) {
+      err = exec_init(&direct, fd, ctx, pass == 3);
+      if (err) {
+        fprintf(stderr, "Kernel lacks NO_RELOC, HANDLE_LUT or softpin\n");
+        break;
+      }
+      // upload the state and prologue again with presumed or pinned
+      // addresses
+      emit_state_relocs0(&direct, state_buffer, input_buffer, output_buffer,
+                         &d);
+      exec_patch0(&direct, state_buffer, state_data);
+      err = drm_intel_bo_subdata(state_buffer, 0, 36864, state_data);
+      used = setup_prologue0(batch_data, &d);
+      emit_prologue_relocs0(&direct, prologue_buffer, state_buffer,
+                            kernel_buffer);
+      exec_patch0(&direct, prologue_buffer, batch_data);
+      err = drm_intel_bo_subdata(prologue_buffer, 0, used, batch_data);
+      shared = direct.count;
+    }
+
+    double start = now();
+    for (i = 0; i < count; i++) {
+      d.groups = SUBMIT_GROUPS - i % SUBMIT_GROUPS;
+      drm_intel_bo *batch_buffer = batch_buffers[i % SUBMIT_BATCHES];
+      // relocations of the batch's previous dispatch
+      drm_intel_gem_bo_clear_relocs(batch_buffer, 0);
+      if (pass == 0) {
+        used = setup_batch0(batch_data, &d);
+        err = drm_intel_bo_subdata(batch_buffer, 0, used, batch_data);
+        emit_prologue_relocs0(NULL, batch_buffer, state_buffer, kernel_buffer);
+        err = drm_intel_gem_bo_context_exec(batch_buffer, ctx, used, 1);
+      } else if (pass == 1) {
+        used = setup_call_batch0(batch_data, &d);
+        err = drm_intel_bo_subdata(batch_buffer, 0, used, batch_data);
+        emit_call_relocs0(NULL, batch_buffer, prologue_buffer);
+        err = drm_intel_gem_bo_context_exec(batch_buffer, ctx, used, 1);
+      } else {
+        // only the batch is new, the shared objects keep their relocations
+        direct.count = shared;
+        used = setup_call_batch0(batch_data, &d);
+        emit_call_relocs0(&direct, batch_buffer, prologue_buffer);
+        exec_patch0(&direct, batch_buffer, batch_data);
+        err = drm_intel_bo_subdata(batch_buffer, 0, used, batch_data);
+        err = exec_submit(&direct, batch_buffer, used);
+      }
+      if (err)
+        break;
+    }
+    double elapsed = now() - start;
+    drm_intel_bo_wait_rendering(output_buffer);
+
+    if (err) {
+      // the command parser may refuse to run a batch from another buffer
+      fprintf(stderr, "%s batches rejected (%d), use flat batches\n",
+              names[pass], err);
+      break;
+    }
+    err = drm_intel_bo_get_subdata(output_buffer, 0, bytes, output);
+    for (i = 0, correct = 0; i < bytes / sizeof(uint32_t); i++) {
+      if (output[i] == input[i] * 2)
+        correct++;
+    }
+    fprintf(stderr, "%s batches: %.2f us per dispatch, '%u/%u' correct\n",
+            names[pass], elapsed * 1e6 / count, correct,
+            (uint32_t)(bytes / sizeof(uint32_t)));
+  }
+
+  free(input);
+  free(output);
+  for (i = 0; i < SUBMIT_BATCHES; i++) {
+    softpin_release(batch_buffers[i]);
+    drm_intel_bo_unreference(batch_buffers[i]);
+  }
+  softpin_release(prologue_buffer);
+  softpin_release(state_buffer);
+  softpin_release(kernel_buffer);
+  softpin_release(input_buffer);
+  softpin_release(output_buffer);
+  drm_intel_bo_unreference(prologue_buffer);
+  drm_intel_bo_unreference(state_buffer);
+  drm_intel_bo_unreference(kernel_buffer);
+  drm_intel_bo_unreference(input_buffer);
+  drm_intel_bo_unreference(output_buffer);
+  return err;
+}
+
+// Submits n dispatches of the doubling kernel through the direct path, their
+// buffers bound by a state_heap_t under one of nine combinations of surface
+// cache policies, so that the six surface states involved are written once
+// and then found again. Up to HEAP_IN_FLIGHT dispatches are in flight and
+// their binding tables come back as they retire. Besides the batch only the
+// CURBE and the descriptor of a dispatch are uploaded, into one of
+// HEAP_IN_FLIGHT state and batch buffers taken up again as they retire.
+static int run_heap0(int fd, drm_intel_bufmgr *bufmgr, drm_intel_context *ctx,
+                     uint32_t n) {
+  uint8_t kernel_data[4096] = {0};
+  uint8_t state_data[40960] = {0};
+  uint8_t batch_data[4096] = {0};
+  gen8_interface_descriptor_t *idrt =
+      (gen8_interface_descriptor_t *)(state_data + IDRT_OFFSET);
+  dispatch_t d = {SUBMIT_GROUPS, GROUP_THREADS, 0, 0};
+  uint32_t bytes = SUBMIT_GROUPS * GROUP_SIZE * sizeof(uint32_t);
+  uint32_t curb_bytes = GROUP_THREADS * 64 * sizeof(uint32_t);
+  completion_t c[HEAP_IN_FLIGHT];
+  drm_intel_bo *state_buffers[HEAP_IN_FLIGHT], *batch_buffers[HEAP_IN_FLIGHT];
+  uint32_t i, j, shared, correct, submitted = 0, retired = 0;
+  uint64_t uploaded = 0;
+  int size, used, table, err;
+  exec_list_t direct;
+  state_heap_t heap;
+  kernel_args_t a;
+
+  err = exec_init(&direct, fd, ctx, 1);
+  if (err) {
+    fprintf(stderr, "Kernel lacks NO_RELOC, HANDLE_LUT or softpin\n");
+    return err;
+  }
+
+  size = setup_typed_kernel0(kernel_data, ELEM_INT32);
+  drm_intel_bo *kernel_buffer =
+      drm_intel_bo_alloc(bufmgr, "typed kernel buffer", size, 64);
+  err = drm_intel_bo_subdata(kernel_buffer, 0, size, kernel_data);
+
+  uint32_t *input = malloc(bytes);
+  uint32_t *output = malloc(bytes);
+  drm_intel_bo *input_buffer = alloc_int32_input(bufmgr, bytes);
+  drm_intel_bo *output_buffer =
+      drm_intel_bo_alloc(bufmgr, "output buffer", bytes, 64);
+  err = drm_intel_bo_get_subdata(input_buffer, 0, bytes, input);
+
+  err = state_heap_init(&heap, bufmgr);
+  for (j = 0; j < HEAP_IN_FLIGHT; j++) {
+    state_buffers[j] = drm_intel_bo_alloc(bufmgr, "state buffer",
+                                          IDRT_OFFSET + sizeof(*idrt), 4096);
+    batch_buffers[j] = drm_intel_bo_alloc(bufmgr, "batch buffer", 512, 64);
+  }
+  setup_curb0(state_data + CURB_OFFSET, &d);
+  exec_add(&direct, kernel_buffer);
+  exec_add(&direct, input_buffer);
+  exec_add(&direct, output_buffer);
+  shared = direct.count;
+
+  double start = now();
+  for (i = 0; i < n && !err; i++) {
+    completion_t *slot = &c[submitted % HEAP_IN_FLIGHT];
+    if (submitted - retired == HEAP_IN_FLIGHT) {
+      err = completion_wait(slot, COMPLETION_TIMEOUT_NS);
+      state_heap_retire(&heap, slot->seqno);
+      completion_release(slot);
+      retired++;
+      if (err)
+        break;
+    }
+
+    d.input_cache = i % 3;
+    d.output_cache = i / 3 % 3;
+    kernel_args_init(&a, io_args, 2);
+    kernel_set_buffer(&a, 0, input_buffer, bytes, d.input_cache);
+    kernel_set_buffer(&a, 1, output_buffer, bytes, d.output_cache);
+
+    // the heap binds the buffers, only their CURBE addresses are per dispatch
+    direct.count = shared;
+    table = state_heap_bind0(&heap, &direct, &a);
+    if (table < 0) {
+      err = table;
+      break;
+    }
+    drm_intel_bo *state_buffer = state_buffers[submitted % HEAP_IN_FLIGHT];
+    drm_intel_bo *batch_buffer = batch_buffers[submitted % HEAP_IN_FLIGHT];
+    setup_idrt0(state_data + IDRT_OFFSET, &d);
+    idrt->desc4.binding_table_pointer = table >> 5;
+    emit_arg_relocs0(&direct, NULL, state_buffer, &a, &d);
+    exec_patch0(&direct, state_buffer, state_data);
+    err = drm_intel_bo_subdata(state_buffer, CURB_OFFSET, curb_bytes,
+                               state_data + CURB_OFFSET);
+    err = drm_intel_bo_subdata(state_buffer, IDRT_OFFSET, sizeof(*idrt), idrt);
+
+    used = setup_batch0(batch_data, &d);
+    emit_base_relocs0(&direct, batch_buffer, heap.bo, state_buffer,
+                      kernel_buffer);
+    exec_patch0(&direct, batch_buffer, batch_data);
+    err = drm_intel_bo_subdata(batch_buffer, 0, used, batch_data);
+    err = exec_submit(&direct, batch_buffer, used);
+    completion_track(slot, batch_buffer);
+    state_heap_fence0(&heap, slot->seqno);
+    submitted++;
+    uploaded += curb_bytes + sizeof(*idrt) + used;
+  }
+  for (j = retired; j < submitted; j++) {
+    if (completion_wait(&c[j % HEAP_IN_FLIGHT], COMPLETION_TIMEOUT_NS))
+      err = -ETIME;
+    completion_release(&c[j % HEAP_IN_FLIGHT]);
+  }
+  double elapsed = now() - start;
+
+  uploaded += heap.written * sizeof(gen8_surface_state_t) +
+              (uint64_t)submitted * HEAP_TABLE_ENTRIES * sizeof(uint32_t);
+  fprintf(stderr,
+          "%u dispatches in %.2f us each, %u surface states written and %u "
+          "found bound, %u binding tables recycled, %.0f state and batch "
+          "bytes uploaded per dispatch\n",
+          submitted, elapsed * 1e6 / (submitted ? submitted : 1),
+          heap.written, heap.reused, heap.recycled,
+          (double)uploaded / (submitted ? submitted : 1));
+  err = drm_intel_bo_get_subdata(output_buffer, 0, bytes, output);
+  for (j = 0, correct = 0; j < bytes / sizeof(uint32_t); j++) {
+    if (output[j] == input[j] * 2)
+      correct++;
+  }
+  fprintf(stderr, "Computed '%u/%u' correct values!\n", correct,
+          (uint32_t)(bytes / sizeof(uint32_t)));
+
+  for (j = 0; j < HEAP_IN_FLIGHT; j++) {
+    softpin_release(state_buffers[j]);
+    softpin_release(batch_buffers[j]);
+    drm_intel_bo_unreference(state_buffers[j]);
+    drm_intel_bo_unreference(batch_buffers[j]);
+  }
+  softpin_release(heap.bo);
+  state_heap_fini(&heap);
+  free(input);
+  free(output);
+  softpin_release(kernel_buffer);
+  softpin_release(input_buffer);
+  softpin_release(output_buffer);
+  drm_intel_bo_unreference(kernel_buffer);
+  drm_intel_bo_unreference(input_buffer);
+  drm_intel_bo_unreference(output_buffer);
+  return err;
+}
+
+// Runs the direct passes of --submit and --heap with every execbuffer checked
+// by exec_check_ioctl0 on its way to the kernel.
+static int run_check_exec0(int fd, drm_intel_bufmgr *bufmgr,
+                           drm_intel_context *ctx, uint32_t count) {
+  int err;
+
+  exec_ioctl = exec_check_ioctl0;
+  err = run_submit0(fd, bufmgr, ctx, count);
+  if (!err)
+    err = run_heap0(fd, bufmgr, ctx, count);
+  exec_ioctl = drmIoctl;
+
+  fprintf(stderr, "Checked %u execbuffers with %u relocations, %u errors\n",
+          exec_record.execs, exec_record.relocs, exec_record.errors);
+  return err ? err : exec_record.errors != 0;
+}
+
+// Capture file of a dispatch: a capture_header_t, then per buffer, the batch
+// last, a capture_bo_t with its contents up to the last non-zero byte and its
+// relocations.
+typedef struct capture_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t gen;
+  uint32_t bo_count;
+  uint32_t exec_length;
+} capture_header_t;
+
+typedef struct capture_bo {
+  uint32_t size;
+  uint32_t length; // bytes stored, the rest is zero
+  uint32_t reloc_count;
+} capture_bo_t;
+
+typedef struct capture_reloc {
+  uint32_t offset;
+  uint32_t target; // index of the target buffer
+  uint32_t delta;
+  uint32_t read_domains;
+  uint32_t write_domain;
+} capture_reloc_t;
+
+// Writes the buffers and relocations recorded in l, the batch being the last
+// buffer and used its length in bytes.
+static int capture_write(const char *path, exec_list_t *l, int used) {
+  capture_header_t header = {CAPTURE_MAGIC, CAPTURE_VERSION, CAPTURE_GEN,
+                             l->count, used};
+  uint32_t i, j;
+  int err = 0;
+
+  FILE *file = fopen(path, "wb");
+  if (!file) {
+    perror(path);
+    return 1;
+  }
+  fwrite(&header, sizeof(header), 1, file);
+  for (i = 0; i < l->count; i++) {
+    capture_bo_t bo = {l->bos[i]->size, l->bos[i]->size,
+                       l->objects[i].relocation_count};
+    uint8_t *data = malloc(bo.size);
+    err = drm_intel_bo_get_subdata(l->bos[i], 0, bo.size, data);
+    while (bo.length && !data[bo.length - 1])
+      bo.length--;
+    fwrite(&bo, sizeof(bo), 1, file);
+    fwrite(data, 1, bo.length, file);
+    for (j = 0; j < bo.reloc_count; j++) {
+      struct drm_i915_gem_relocation_entry *r = &l->relocs[i][j];
+      capture_reloc_t reloc = {r->offset, r->target_handle, r->delta,
+                               r->read_domains, r->write_domain};
+      fwrite(&reloc, sizeof(reloc), 1, file);
+    }
+    free(data);
+  }
+  if (fclose(file)) {
+    perror(path);
+    err = 1;
+  }
+  return err;
+}
+
+// Builds the single 64 element dispatch of main() with its relocations
+// recorded in an execbuffer list, writes it to path and runs it.
+static int run_capture0(int fd, drm_intel_bufmgr *bufmgr,
+                        drm_intel_context *ctx, drm_intel_bo *kernel_buffer,
+                        const char *path) {
+  uint8_t input_data[256] = {0};
+  uint8_t output_data[256] = {0};
+  uint8_t state_data[40960] = {0};
+  uint8_t batch_data[4096] = {0};
+  dispatch_t d = {1, GROUP_THREADS, 0, 0};
+  exec_list_t l;
+  int i, used, correct = 0, err;
+
+  setup_input(input_data);
+  drm_intel_bo *input_buffer =
+      drm_intel_bo_alloc(bufmgr, "input buffer", 256, 64);
+  err = drm_intel_bo_subdata(input_buffer, 0, 256, input_data);
+  drm_intel_bo *output_buffer =
+      drm_intel_bo_alloc(bufmgr, "output buffer", 256, 64);
+  err = drm_intel_bo_subdata(output_buffer, 0, 256, output_data);
+  drm_intel_bo *state_buffer =
+      drm_intel_bo_alloc(bufmgr, "state buffer", 36864, 4096);
+  drm_intel_bo *batch_buffer =
+      drm_intel_bo_alloc(bufmgr, "batch buffer", 512, 64);
+
+  setup_heap0(state_data, 256, &d);
+  setup_curb0(state_data + CURB_OFFSET, &d);
+  setup_idrt0(state_data + IDRT_OFFSET, &d);
+  used = setup_batch0(batch_data, &d);
+
+  err = exec_init(&l, fd, ctx, 0);
+  emit_state_relocs0(&l, state_buffer, input_buffer, output_buffer, &d);
+  // the batch has to come last
+  exec_add(&l, kernel_buffer);
+  emit_prologue_relocs0(&l, batch_buffer, state_buffer, kernel_buffer);
+  exec_patch0(&l, state_buffer, state_data);
+  exec_patch0(&l, batch_buffer, batch_data);
+  err = drm_intel_bo_subdata(state_buffer, 0, 36864, state_data);
+  err = drm_intel_bo_subdata(batch_buffer, 0, 512, batch_data);
+
+  err = capture_write(path, &l, used);
+  if (!err) {
+    err = exec_submit(&l, batch_buffer, used);
+    drm_intel_bo_wait_rendering(batch_buffer);
+    err = drm_intel_bo_get_subdata(output_buffer, 0, 256, output_data);
+    for (i = 0; i < 64; i++) {
+      if (((int *)output_data)[i] == ((int *)input_data)[i] * 2)
+        correct++;
+    }
+    fprintf(stderr, "Captured %u buffers to '%s', computed '%d/%d' correct "
+                    "values!\n",
+            l.count, path, correct, 64);
+  }
+
+  drm_intel_bo_unreference(input_buffer);
+  drm_intel_bo_unreference(output_buffer);
+  drm_intel_bo_unreference(state_buffer);
+  drm_intel_bo_unreference(batch_buffer);
+  return err;
+}
+
+// Reads a capture after checking its header, with every size and relocation
+// kept in bounds. Buffers are zero past their stored length.
+static int capture_read(FILE *file, capture_header_t *header,
+                        capture_bo_t *bos, uint8_t **data,
+                        capture_reloc_t **relocs) {
+  uint32_t i, j;
+
+  if (fread(header, sizeof(*header), 1, file) != 1 ||
+      header->magic != CAPTURE_MAGIC || header->version != CAPTURE_VERSION ||
+      !header->bo_count || header->bo_count > EXEC_MAX_OBJECTS)
+    return 1;
+  for (i = 0; i < header->bo_count; i++) {
+    if (fread(&bos[i], sizeof(bos[i]), 1, file) != 1 ||
+        bos[i].length > bos[i].size || bos[i].size > CAPTURE_MAX_SIZE ||
+        bos[i].reloc_count > EXEC_MAX_RELOCS)
+      return 1;
+    data[i] = calloc(1, bos[i].size);
+    relocs[i] = calloc(bos[i].reloc_count + 1, sizeof(capture_reloc_t));
+    if (!data[i] || !relocs[i] ||
+        fread(data[i], 1, bos[i].length, file) != bos[i].length ||
+        fread(relocs[i], sizeof(capture_reloc_t), bos[i].reloc_count, file) !=
+            bos[i].reloc_count)
+      return 1;
+    for (j = 0; j < bos[i].reloc_count; j++) {
+      // relocated addresses are 64-bit on gen8+
+      if (relocs[i][j].target >= header->bo_count ||
+          (uint64_t)relocs[i][j].offset + sizeof(uint64_t) > bos[i].size)
+        return 1;
+    }
+  }
+  return header->exec_length > bos[header->bo_count - 1].size;
+}
+
+// Prints a hash of every buffer a relocation lets the GPU write, read back
+// from buffers first unless they ran on the software executor.
+static void capture_hash(const capture_header_t *header,
+                         const capture_bo_t *bos, uint8_t **data,
+                         capture_reloc_t **relocs, drm_intel_bo **buffers) {
+  uint32_t i, j, k, written;
+  int err;
+
+  for (i = 0; i < header->bo_count; i++) {
+    for (written = 0, j = 0; j < header->bo_count; j++) {
+      for (k = 0; k < bos[j].reloc_count; k++)
+        written |= relocs[j][k].target == i && relocs[j][k].write_domain;
+    }
+    if (!written)
+      continue;
+    if (buffers)
+      err = drm_intel_bo_get_subdata(buffers[i], 0, bos[i].size, data[i]);
+    fprintf(stderr, "  buffer %u: hash %08x\n", i,
+            fnv1a(data[i], bos[i].size));
+  }
+}
+
+// Runs a capture CAPTURE_RUNS times and prints the time per run and a hash of
+// every buffer the GPU writes, for comparison across hosts and kernels.
+static int capture_replay(drm_intel_bufmgr *bufmgr, drm_intel_context *ctx,
+                          const capture_header_t *header,
+                          const capture_bo_t *bos, uint8_t **data,
+                          capture_reloc_t **relocs) {
+  drm_intel_bo *buffers[EXEC_MAX_OBJECTS];
+  uint32_t i, j;
+  int err;
+
+  for (i = 0; i < header->bo_count; i++) {
+    buffers[i] = drm_intel_bo_alloc(bufmgr, "replay buffer", bos[i].size, 64);
+    err = drm_intel_bo_subdata(buffers[i], 0, bos[i].size, data[i]);
+  }
+  for (i = 0; i < header->bo_count; i++) {
+    for (j = 0; j < bos[i].reloc_count; j++) {
+      capture_reloc_t *r = &relocs[i][j];
+      err = drm_intel_bo_emit_reloc(buffers[i], r->offset, buffers[r->target],
+                                    r->delta, r->read_domains, r->write_domain);
+    }
+  }
+
+  drm_intel_bo *batch_buffer = buffers[header->bo_count - 1];
+  double start = now();
+  for (i = 0; i < CAPTURE_RUNS; i++)
+    err = drm_intel_gem_bo_context_exec(batch_buffer, ctx, header->exec_length,
+                                        1);
+  drm_intel_bo_wait_rendering(batch_buffer);
+  double elapsed = now() - start;
+  fprintf(stderr, "Replayed %d runs, %.2f us per run\n", CAPTURE_RUNS,
+          elapsed * 1e6 / CAPTURE_RUNS);
+  capture_hash(header, bos, data, relocs, buffers);
+
+  for (i = 0; i < header->bo_count; i++)
+    drm_intel_bo_unreference(buffers[i]);
+  return err;
+}
+
+// OA counters. An i915 perf stream turns the OA unit on for the context and
+// MI_REPORT_PERF_COUNT snapshots its counters into a query buffer before and
+// after the walker. The A counters count the same events in every metric set,
+// B and C whatever the set programs into them.
+typedef struct oa_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t gen;
+  uint32_t eus;
+  uint32_t reports; // of OA_REPORT_SIZE bytes, the begin/end pair
+} oa_header_t;
+
+typedef struct oa_metric {
+  const char *name;
+  int counter;
+  int per_eu; // a share of the clocks of all EUs, else of the GPU clocks
+} oa_metric_t;
+
+static const oa_metric_t oa_metrics0[] = {
+    {"GpuBusy", OA_A(0), 0},     {"EuActive", OA_A(7), 1},
+    {"EuStall", OA_A(8), 1},     {"EuFpuBothActive", OA_A(9), 1},
+    {"Fpu0Active", OA_A(10), 1}, {"Fpu1Active", OA_A(11), 1},
+    {"EuSendActive", OA_A(12), 1},
+};
+
+// Metric set of the stream: $GPGPU_OA_METRICS, else the first one the kernel
+// lists under OA_METRICS_PATH, 0 if there is none.
+static uint64_t oa_metrics_set(void) {
+  const char *env = getenv("GPGPU_OA_METRICS");
+  unsigned long long set = 0;
+  char path[512];
+  struct dirent *entry;
+
+  if (env)
+    return strtoull(env, NULL, 0);
+  DIR *dir = opendir(OA_METRICS_PATH);
+  while (dir && !set && (entry = readdir(dir))) {
+    if (entry->d_name[0] == '.')
+      continue;
+    snprintf(path, sizeof path, OA_METRICS_PATH "/%s/id", entry->d_name);
+    FILE *file = fopen(path, "r");
+    if (file && fscanf(file, "%llu", &set) != 1)
+      set = 0;
+    if (file)
+      fclose(file);
+  }
+  if (dir)
+    closedir(dir);
+  return set;
+}
+
+// Opens an i915 perf stream sampling OA reports of ctx, which keeps the OA
+// unit counting until the returned fd is closed. Returns -1 on failure.
+static int oa_open(int fd, drm_intel_context *ctx) {
+  uint32_t ctx_id = 0;
+  uint64_t set = oa_metrics_set();
+  int err = drm_intel_gem_context_get_id(ctx, &ctx_id);
+  uint64_t properties[] = {
+      DRM_I915_PERF_PROP_CTX_HANDLE,     ctx_id,
+      DRM_I915_PERF_PROP_SAMPLE_OA,      1,
+      DRM_I915_PERF_PROP_OA_METRICS_SET, set,
+      DRM_I915_PERF_PROP_OA_FORMAT,      OA_FORMAT,
+  };
+  struct drm_i915_perf_open_param param = {
+      .flags = I915_PERF_FLAG_FD_CLOEXEC,
+      .num_properties = sizeof properties / (2 * sizeof(uint64_t)),
+      .properties_ptr = (uintptr_t)properties};
+
+  if (err) {
+    fprintf(stderr, "No context ID for the perf stream (%d)\n", err);
+    return -1;
+  }
+  if (!set) {
+    fprintf(stderr, "No OA metric set, set $GPGPU_OA_METRICS\n");
+    return -1;
+  }
+  int stream = drmIoctl(fd, DRM_IOCTL_I915_PERF_OPEN, &param);
+  if (stream < 0)
+    perror("i915 perf stream");
+  return stream;
+}
+
+// EUs of the GPU, the GT2 count if the kernel does not tell
+static uint32_t oa_eus(int fd) {
+  drm_i915_getparam_t gp;
+  int eus = 0;
+
+  gp.param = I915_PARAM_EU_TOTAL;
+  gp.value = &eus;
+  if (drmIoctl(fd, DRM_IOCTL_I915_GETPARAM, &gp) || eus <= 0)
+    return SIM_EUS;
+  return eus;
+}
+
+// Counter c of a report: A0-31 are 40 bits, the low dwords from dword 4 and
+// the high bytes from dword 40, A32-35 follow at dword 36, B and C at 48.
+static uint64_t oa_counter0(const uint32_t *report, int c) {
+  const uint8_t *high = (const uint8_t *)(report + 40);
+  if (c < 32)
+    return report[4 + c] | (uint64_t)high[c] << 32;
+  return report[c < OA_B(0) ? 4 + c : 12 + c];
+}
+
+static uint64_t oa_delta0(const uint32_t *begin, const uint32_t *end, int c) {
+  uint64_t mask = c < 32 ? (1ull << 40) - 1 : 0xffffffff;
+  return (oa_counter0(end, c) - oa_counter0(begin, c)) & mask;
+}
+
+// Prints the metrics between two reports of a GPU with eus EUs, then every
+// counter that moved.
+static int oa_decode0(const uint32_t *begin, const uint32_t *end,
+                      uint32_t eus) {
+  static const int banks[] = {OA_A(0), OA_B(0), OA_C(0)};
+  uint32_t ticks = end[1] - begin[1];
+  uint32_t clocks = end[3] - begin[3];
+  double ns = ticks * OA_TIMESTAMP_NS;
+  int i;
+
+  if (begin[0] != OA_REPORT_BEGIN || end[0] != OA_REPORT_END || !clocks ||
+      !ticks) {
+    fprintf(stderr, "Reports %#x and %#x are not an OA report pair\n",
+            begin[0], end[0]);
+    return 1;
+  }
+  fprintf(stderr, "GpuTime %.3f ms, %u GPU clocks at %.0f MHz, %u EUs\n",
+          ns / 1e6, clocks, clocks * 1e3 / ns, eus);
+  for (i = 0; i < sizeof oa_metrics0 / sizeof oa_metrics0[0]; i++) {
+    const oa_metric_t *m = &oa_metrics0[i];
+    double total = (double)clocks * (m->per_eu ? eus : 1);
+    fprintf(stderr, "  %-16s %5.1f%%\n", m->name,
+            100.0 * oa_delta0(begin, end, m->counter) / total);
+  }
+  for (i = 0; i < OA_COUNTERS; i++) {
+    int bank = (i >= OA_B(0)) + (i >= OA_C(0));
+    uint64_t delta = oa_delta0(begin, end, i);
+    if (delta)
+      fprintf(stderr, "  %c%-3d %14llu %10.1f M/s\n", "ABC"[bank],
+              i - banks[bank], (unsigned long long)delta, delta * 1e3 / ns);
+  }
+  return 0;
+}
+
+// Decodes the report pair of a --counters file, no GPU needed.
+static int run_decode_oa0(const char *path) {
+  uint32_t reports[2][OA_REPORT_SIZE / sizeof(uint32_t)];
+  oa_header_t header = {0};
+  int err = 0;
+
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    perror(path);
+    return 1;
+  }
+  if (fread(&header, sizeof header, 1, file) != 1 ||
+      header.magic != OA_MAGIC || header.version != OA_VERSION ||
+      header.reports != 2 || fread(reports, sizeof reports, 1, file) != 1) {
+    fprintf(stderr, "'%s' is not an OA report file or is truncated\n", path);
+    err = 1;
+  } else if (header.gen != CAPTURE_GEN) {
+    fprintf(stderr, "'%s' was recorded on gen%u, not gen%u\n", path,
+            header.gen, CAPTURE_GEN);
+    err = 1;
+  } else {
+    err = oa_decode0(reports[0], reports[1], header.eus);
+  }
+  fclose(file);
+  return err;
+}
+
+// Runs the int32 typed kernel over bytes between two OA reports and decodes
+// them, after writing them to path if it is set.
+static int run_counters0(int fd, drm_intel_bufmgr *bufmgr,
+                         drm_intel_context *ctx, uint32_t bytes,
+                         const char *path) {
+  uint8_t kernel_data[4096] = {0};
+  uint32_t reports[2][OA_REPORT_SIZE / sizeof(uint32_t)] = {{0}};
+  oa_header_t header = {OA_MAGIC, OA_VERSION, CAPTURE_GEN, oa_eus(fd), 2};
+  int size, used, err;
+
+  bytes = (bytes + GROUP_SIZE * 4 - 1) / (GROUP_SIZE * 4) * (GROUP_SIZE * 4);
+  dispatch_t d = {bytes / (GROUP_SIZE * 4), GROUP_THREADS, 0, 0};
+
+  int stream = oa_open(fd, ctx);
+  if (stream < 0)
+    return 1;
+
+  size = setup_typed_kernel0(kernel_data, ELEM_INT32);
+  drm_intel_bo *kernel_buffer =
+      drm_intel_bo_alloc(bufmgr, "typed kernel buffer", size, 64);
+  err = drm_intel_bo_subdata(kernel_buffer, 0, size, kernel_data);
+  drm_intel_bo *input_buffer = alloc_int32_input(bufmgr, bytes);
+  drm_intel_bo *output_buffer =
+      drm_intel_bo_alloc(bufmgr, "output buffer", bytes, 64);
+  d.query = drm_intel_bo_alloc(bufmgr, "query buffer", sizeof reports, 64);
+  err = drm_intel_bo_subdata(d.query, 0, sizeof reports, reports);
+
+  drm_intel_bo *batch_buffer = setup_dispatch0(
+      bufmgr, kernel_buffer, &d, input_buffer, output_buffer, bytes, &used);
+  err = drm_intel_gem_bo_context_exec(batch_buffer, ctx, used, 1);
+  drm_intel_bo_wait_rendering(batch_buffer);
+  err = drm_intel_bo_get_subdata(d.query, 0, sizeof reports, reports);
+  close(stream);
+
+  if (path) {
+    FILE *file = fopen(path, "wb");
+    if (file) {
+      fwrite(&header, sizeof header, 1, file);
+      fwrite(reports, sizeof reports, 1, file);
+    }
+    if (!file || fclose(file))
+      perror(path);
+  }
+  err = oa_decode0(reports[0], reports[1], header.eus);
+
+  drm_intel_bo_unreference(batch_buffer);
+  drm_intel_bo_unreference(kernel_buffer);
+  drm_intel_bo_unreference(input_buffer);
+  drm_intel_bo_unreference(output_buffer);
+  drm_intel_bo_unreference(d.query);
+  return err;
+}
+
+// Software executor. A kernel is translated once into ops, each with its
+// operand regions resolved to byte offsets in the register file and a handler
+// picked for it, and the translation is cached by the binary. EU threads run
+// the ops against a host copy of their GRF, a work-group at a time, switching
+// between the threads of a group whenever one blocks on the barrier.
+typedef struct sim_thread sim_thread_t;
+typedef struct sim_op sim_op_t;
+
+typedef struct sim_operand {
+  int file, type, negate, abs;
+  int invert;                  // negate of a logic op, a bitwise not
+  uint64_t imm;                // immediates are read at offset 0 of imm
+  uint16_t offset[SIMD_WIDTH]; // of every channel in the GRF
+} sim_operand_t;
+
+struct sim_op {
+  void (*run)(sim_thread_t *t, const sim_op_t *op);
+  int opcode, exec_size, cmod, pred, pred_inv, flag, nomask, saturate;
+  int is_float;          // sources are read as doubles rather than int64
+  int jip;               // if: op to continue at when no channel is enabled
+  int eot;               // send: the thread ends with the message
+  int payload, response; // send: first register of the message and reply
+  uint32_t desc;         // send: message descriptor
+  sim_operand_t dst, src0, src1;
+  int offset;       // in bytes from the start of the kernel
+  int issue;        // timing model: cycles the op keeps the EU busy
+  int latency;      // timing model: cycles from issue to the result
+  int regs[3][2];   // timing model: first and last GRF of dst, src0, src1
+};
+
+// Fields of an instruction as encoded, before translation.
+typedef struct sim_region {
+  int file, type, nr, subnr, vstride, width, hstride, negate, abs, indirect;
+  uint64_t imm;
+} sim_region_t;
+
+typedef struct sim_inst {
+  int opcode, align16, pred, pred_inv, exec_size, saturate, flag, nomask;
+  int cmod; // or the shared function of a send
+  int eot;
+  int32_t jip; // in bytes from the instruction
+  uint32_t desc;
+  sim_region_t dst, src0, src1;
+} sim_inst_t;
+
+typedef struct sim_kernel {
+  uint8_t *code; // the binary the ops were translated from
+  uint32_t size, hash;
+  int count;
+  sim_op_t *ops;
+} sim_kernel_t;
+
+typedef struct sim_surface {
+  uint8_t *data;
+  uint32_t size;
+  int readonly;
+} sim_surface_t;
+
+// Cache model of the software executor. With a sim_memory_t attached to the
+// work-groups every untyped message is split into the cache lines it touches,
+// and each line is looked up in L3 and then in LLC, both set associative with
+// LRU replacement. L3 gets as many ways as the L3 preset of the dispatch gives
+// the data port, and each surface uses the caches its MOCS selects. Writes
+// allocate without a fill and dirty lines go down a level when evicted.
+typedef struct sim_level {
+  uint64_t *tags; // (surface + 1) << 32 | line, 0 for an empty way
+  uint64_t *used; // clock of the last access, for LRU
+  uint8_t *dirty;
+  uint32_t sets, ways;
+  uint64_t clock;
+} sim_level_t;
+
+typedef struct sim_traffic {
+  uint64_t lines;         // line requests of the EUs
+  uint64_t l3_hits;       // of all requests
+  uint64_t llc_lines;     // requests that missed or bypassed L3
+  uint64_t llc_hits;
+  uint64_t read, written; // memory traffic in bytes
+  uint64_t written_back;  // dirty LLC lines written by the final flush
+} sim_traffic_t;
+
+typedef struct sim_memory {
+  sim_level_t l3, llc;
+  int l3_cached[SIM_SURFACES];
+  int llc_cached[SIM_SURFACES];
+  sim_traffic_t traffic[SIM_SURFACES]; // by binding table index
+} sim_memory_t;
+
+static void sim_level_init(sim_level_t *l, uint32_t bytes, uint32_t ways) {
+  size_t count;
+
+  memset(l, 0, sizeof *l);
+  if (!ways || bytes < ways * SIM_LINE_SIZE)
+    return;
+  l->ways = ways;
+  l->sets = bytes / SIM_LINE_SIZE / ways;
+  count = (size_t)l->sets * ways;
+  l->tags = calloc(count, sizeof *l->tags);
+  l->used = calloc(count, sizeof *l->used);
+  l->dirty = calloc(count, 1);
+}
+
+static void sim_level_free(sim_level_t *l) {
+  free(l->tags);
+  free(l->used);
+  free(l->dirty);
+}
+
+// Looks tag up in l and allocates it on a miss. Returns whether it hit, and
+// in *evicted the dirty line the allocation pushed out, or 0.
+static int sim_level_access(sim_level_t *l, uint64_t tag, int write,
+                            uint64_t *evicted) {
+  size_t base = (size_t)((uint32_t)tag % l->sets) * l->ways;
+  size_t i, victim = base;
+
+  *evicted = 0;
+  l->clock++;
+  for (i = base; i < base + l->ways; i++) {
+    if (l->tags[i] == tag) {
+      l->used[i] = l->clock;
+      l->dirty[i] |= write;
+      return 1;
+    }
+    if (l->used[i] < l->used[victim])
+      victim = i;
+  }
+  if (l->dirty[victim])
+    *evicted = l->tags[victim];
+  l->tags[victim] = tag;
+  l->used[victim] = l->clock;
+  l->dirty[victim] = write;
+  return 0;
+}
+
+// Writes a dirty line back from L3 into LLC, or into memory when its surface
+// bypasses LLC or the line comes from LLC.
+static void sim_write_back(sim_memory_t *m, uint64_t tag, int from_l3) {
+  int s = (int)(tag >> 32) - 1;
+  uint64_t evicted;
+
+  if (from_l3 && m->llc_cached[s] && m->llc.sets) {
+    sim_level_access(&m->llc, tag, 1, &evicted);
+    if (evicted)
+      sim_write_back(m, evicted, 0);
+  } else {
+    m->traffic[s].written += SIM_LINE_SIZE;
+  }
+}
+
+// Returns the SIM_LEVEL_* that served the access.
+static int sim_memory_access(sim_memory_t *m, int s, uint32_t line,
+                             int write) {
+  sim_traffic_t *t = &m->traffic[s];
+  uint64_t tag = (uint64_t)(s + 1) << 32 | line, evicted;
+  int hit;
+
+  t->lines++;
+  if (m->l3_cached[s] && m->l3.sets) {
+    hit = sim_level_access(&m->l3, tag, write, &evicted);
+    if (evicted)
+      sim_write_back(m, evicted, 1);
+    if (hit || write) {
+      t->l3_hits += hit;
+      return SIM_LEVEL_L3;
+    }
+  }
+  if (m->llc_cached[s] && m->llc.sets) {
+    t->llc_lines++;
+    hit = sim_level_access(&m->llc, tag, write, &evicted);
+    if (evicted)
+      sim_write_back(m, evicted, 0);
+    if (hit || write) {
+      t->llc_hits += hit;
+      return SIM_LEVEL_LLC;
+    }
+  }
+  if (write)
+    t->written += SIM_LINE_SIZE;
+  else
+    t->read += SIM_LINE_SIZE;
+  return SIM_LEVEL_MEMORY;
+}
+
+// Writes back the dirty lines of L3, like the flush at the end of a batch,
+// and then the dirty lines of LLC. Memory sees those once they are evicted,
+// so they are counted as written back at the end of the dispatch, apart from
+// its evictions, and stay cached clean.
+static void sim_memory_flush(sim_memory_t *m) {
+  size_t i, count = (size_t)m->l3.sets * m->l3.ways;
+
+  for (i = 0; i < count; i++) {
+    if (m->l3.dirty[i]) {
+      m->l3.dirty[i] = 0;
+      sim_write_back(m, m->l3.tags[i], 1);
+    }
+  }
+  count = (size_t)m->llc.sets * m->llc.ways;
+  for (i = 0; i < count; i++) {
+    if (m->llc.dirty[i]) {
+      m->llc.dirty[i] = 0;
+      m->traffic[(m->llc.tags[i] >> 32) - 1].written_back += SIM_LINE_SIZE;
+    }
+  }
+}
+
+static void sim_memory_free(sim_memory_t *m) {
+  sim_level_free(&m->l3);
+  sim_level_free(&m->llc);
+}
+
+// Sets the cache model up for d. Data port accesses use the ALL ways of its
+// L3 preset, or the DC ways when there are none, and MOCS {LLC/eLLC type,
+// target cache} keeps a surface in L3 for an L3+LLC+eLLC target and in LLC
+// unless it is uncached.
+static void sim_memory_init0(sim_memory_t *m, const dispatch_t *d) {
+  uint32_t cntl = dispatch_l3(d)->cntl;
+  uint32_t ways = cntl >> 25 & 0x7f ? cntl >> 25 & 0x7f : cntl >> 18 & 0x7f;
+  int s;
+
+  memset(m, 0, sizeof *m);
+  sim_level_init(&m->l3, ways * SIM_L3_WAY_BYTES, ways);
+  sim_level_init(&m->llc, SIM_LLC_BYTES, SIM_LLC_WAYS);
+  for (s = 2; s < SIM_SURFACES; s++) {
+    uint32_t mocs = cache_mocs[s == 2 ? d->input_cache : d->output_cache];
+    m->l3_cached[s] = (mocs >> 3 & 3) == 3;
+    m->llc_cached[s] = (mocs >> 5 & 3) != 1;
+  }
+}
+
+// Timing model of the software executor. Every thread keeps its own clock
+// and a scoreboard of when each of its registers is written: an op issues once
+// the registers it touches are ready and keeps the EU busy for op->issue
+// cycles, its result is ready op->latency cycles after issue, and a message
+// reply arrives after the latency of the level that served it. The estimate
+// is the largest of the issue cycles per EU, the thread lifetimes per thread
+// slot and the cycles the memory traffic of the cache model takes.
+typedef struct sim_timing {
+  const sim_kernel_t *k;
+  uint64_t *count, *issue, *stall; // executions and cycles, by op
+  uint64_t busy;     // issue cycles of all threads
+  uint64_t lifetime; // cycles from dispatch to the end, of all threads
+  uint64_t threads;
+  uint64_t bytes; // memory traffic
+} sim_timing_t;
+
+// Cycles from issuing a message to its reply, by SIM_LEVEL_*.
+static const int sim_latency[] = {64, 128, 256, 512};
+
+typedef struct sim_group {
+  sim_surface_t surfaces[SIM_SURFACES]; // by binding table index
+  sim_surface_t slm;
+  sim_thread_t *threads;
+  int thread_count;
+  int arrived;         // threads that reached the barrier
+  sim_memory_t *memory; // cache model, NULL without one
+  sim_timing_t *timing; // timing model, NULL without one
+  uint32_t arrival;     // timing model: last arrival at the barrier so far
+} sim_group_t;
+
+struct sim_thread {
+  uint8_t grf[SIM_GRF_SIZE];
+  uint16_t flag[4]; // f0.0, f0.1, f1.0, f1.1
+  uint16_t mask;    // channels enabled by control flow
+  uint16_t stack[SIM_MAX_DEPTH];
+  int depth;
+  int pc;
+  int notified; // barrier notifications not yet consumed by a wait
+  int state;    // SIM_RUN, SIM_WAIT or SIM_DONE
+  sim_group_t *group;
+  uint32_t cycle;   // timing model: when the next op can issue
+  uint32_t release; // timing model: when the last barrier let the thread go
+  int level;        // timing model: SIM_LEVEL_* that served the last message
+  uint32_t ready[SIM_GRF_SIZE / 32]; // timing model: when each GRF is written
+};
+
+static sim_kernel_t sim_cache[SIM_CACHE_SIZE];
+static int sim_cached; // translations so far, the oldest entry is replaced
+
+static int sim_is_float(int type) {
+  return type == GEN_TYPE_F || type == GEN_TYPE_DF || type == GEN_TYPE_HF;
+}
+
+static int sim_is_signed(int type) {
+  return type == GEN_TYPE_D || type == GEN_TYPE_W || type == GEN_TYPE_B ||
+         type == GEN_TYPE_Q;
+}
+
+static int sim_is_dword(const sim_operand_t *o) {
+  return (o->type == GEN_TYPE_D || o->type == GEN_TYPE_UD) && !o->negate &&
+         !o->abs && !o->invert;
+}
+
+// Immediates and null sources are read from the operand itself, so handlers
+// read every source the same way.
+static const uint8_t *sim_base(const sim_thread_t *t, const sim_operand_t *s) {
+  return s->file == GEN_FILE_GRF ? t->grf : (const uint8_t *)&s->imm;
+}
+
+static uint16_t sim_exec_mask(const sim_thread_t *t, const sim_op_t *op) {
+  uint16_t mask = (1u << op->exec_size) - 1;
+  if (!op->nomask)
+    mask &= t->mask;
+  if (op->pred && op->opcode != GEN_OPCODE_SEL)
+    mask &= op->pred_inv ? ~t->flag[op->flag] : t->flag[op->flag];
+  return mask;
+}
+
+// Little endian load and store of 1, 2, 4 or 8 bytes.
+static uint64_t sim_load(const uint8_t *p, int size) {
+  uint16_t w;
+  uint32_t d;
+  uint64_t q;
+  switch (size) {
+  case 1:
+    return *p;
+  case 2:
+    memcpy(&w, p, sizeof w);
+    return w;
+  case 4:
+    memcpy(&d, p, sizeof d);
+    return d;
+  }
+  memcpy(&q, p, sizeof q);
+  return q;
+}
+
+static void sim_store(uint8_t *p, int size, uint64_t v) {
+  uint16_t w = v;
+  uint32_t d = v;
+  switch (size) {
+  case 1:
+    *p = v;
+    return;
+  case 2:
+    memcpy(p, &w, sizeof w);
+    return;
+  case 4:
+    memcpy(p, &d, sizeof d);
+    return;
+  }
+  memcpy(p, &v, sizeof v);
+}
+
+// Channel i of a source as an integer, with its modifiers applied.
+static int64_t sim_get_int(const sim_thread_t *t, const sim_operand_t *s,
+                           int i) {
+  int bits = gen_type_size[s->type] * 8;
+  uint64_t raw = sim_load(sim_base(t, s) + s->offset[i], bits / 8);
+  int64_t v = raw;
+
+  if (bits < 64 && sim_is_signed(s->type))
+    v = (int64_t)(raw << (64 - bits)) >> (64 - bits);
+  if (s->abs && v < 0)
+    v = -(uint64_t)v;
+  if (s->negate)
+    v = -(uint64_t)v;
+  return s->invert ? ~v : v;
+}
+
+static double sim_get_float(const sim_thread_t *t, const sim_operand_t *s,
+                            int i) {
+  const uint8_t *p = sim_base(t, s) + s->offset[i];
+  double v;
+  float f;
+  uint16_t h;
+
+  switch (s->type) {
+  case GEN_TYPE_F:
+    memcpy(&f, p, sizeof f);
+    v = f;
+    break;
+  case GEN_TYPE_DF:
+    memcpy(&v, p, sizeof v);
+    break;
+  case GEN_TYPE_HF:
+    memcpy(&h, p, sizeof h);
+    v = half_to_float(h);
+    break;
+  default:
+    return sim_get_int(t, s, i);
+  }
+  if (s->abs && v < 0)
+    v = -v;
+  return s->negate ? -v : v;
+}
+
+// Stores a result converted to type. Floats convert to integers rounding
+// towards zero and saturated to the range of type, like the EU does.
+static void sim_put(uint8_t *p, int type, int saturate, int is_float,
+                    double f, int64_t v) {
+  int bits = gen_type_size[type] * 8;
+  int64_t lo, hi;
+
+  if (sim_is_float(type)) {
+    float x;
+    uint16_t h;
+    if (!is_float)
+      f = v;
+    if (saturate)
+      f = f > 1 ? 1 : f > 0 ? f : 0;
+    if (type == GEN_TYPE_DF) {
+      memcpy(p, &f, sizeof f);
+      return;
+    }
+    x = f;
+    if (type == GEN_TYPE_F) {
+      memcpy(p, &x, sizeof x);
+      return;
+    }
+    h = float_to_half(x);
+    memcpy(p, &h, sizeof h);
+    return;
+  }
+  lo = !sim_is_signed(type) ? 0 : bits == 64 ? INT64_MIN : -(1ll << (bits - 1));
+  hi = bits == 64 ? INT64_MAX
+                  : sim_is_signed(type) ? (1ll << (bits - 1)) - 1
+                                        : (1ll << bits) - 1;
+  if (is_float)
+    v = f != f ? 0 : f <= lo ? lo : f >= hi ? hi : (int64_t)f;
+  else if (saturate)
+    v = v < lo ? lo : v > hi ? hi : v;
+  sim_store(p, bits / 8, v);
+}
+
+// -1, 0 or 1 as a compares to b, 2 if they are unordered.
+static int sim_order(double a, double b) {
+  return a < b ? -1 : a > b ? 1 : a == b ? 0 : 2;
+}
+
+static int sim_order_int(int64_t a, int64_t b) { return a < b ? -1 : a > b; }
+
+static int sim_cond(int cmod, int order) {
+  switch (cmod) {
+  case GEN_COND_Z:
+    return order == 0;
+  case GEN_COND_NZ:
+    return order != 0;
+  case GEN_COND_G:
+    return order == 1;
+  case GEN_COND_GE:
+    return order == 0 || order == 1;
+  case GEN_COND_L:
+    return order == -1;
+  case GEN_COND_LE:
+    return order == 0 || order == -1;
+  }
+  return 0;
+}
+
+// Whether channel i of a sel takes src0, by its condition or else by its
+// predicate.
+static int sim_select(const sim_thread_t *t, const sim_op_t *op, int i,
+                      int order) {
+  if (op->cmod)
+    return sim_cond(op->cmod, order);
+  if (op->pred)
+    return (t->flag[op->flag] >> i & 1) ^ op->pred_inv;
+  return 1;
+}
+
+// Any ALU op. Sources are read as int64, or as double if one of them is a
+// float, and all channels are computed before any of them is written.
+static void sim_alu(sim_thread_t *t, const sim_op_t *op) {
+  uint16_t mask = sim_exec_mask(t, op), flags = 0;
+  int is_float = op->is_float && op->opcode != GEN_OPCODE_CMP;
+  double f[SIMD_WIDTH];
+  int64_t v[SIMD_WIDTH];
+  int i;
+
+  for (i = 0; i < op->exec_size; i++) {
+    int order;
+    f[i] = 0;
+    v[i] = 0;
+    if (!(mask >> i & 1))
+      continue;
+    if (op->is_float) {
+      double a = sim_get_float(t, &op->src0, i);
+      double b = sim_get_float(t, &op->src1, i);
+      order = sim_order(a, b);
+      switch (op->opcode) {
+      case GEN_OPCODE_ADD:
+        f[i] = a + b;
+        break;
+      case GEN_OPCODE_MUL:
+        f[i] = a * b;
+        break;
+      case GEN_OPCODE_SEL:
+        f[i] = sim_select(t, op, i, order) ? a : b;
+        break;
+      default:
+        f[i] = a;
+      }
+      if (op->opcode != GEN_OPCODE_CMP)
+        order = sim_order(f[i], 0);
+    } else {
+      int64_t a = sim_get_int(t, &op->src0, i);
+      int64_t b = sim_get_int(t, &op->src1, i);
+      int bits = gen_type_size[op->src0.type] * 8;
+      int shift = b & (bits == 64 ? 63 : 31);
+      uint64_t low = bits == 64 ? ~0ull : (1ull << bits) - 1;
+      order = sim_order_int(a, b);
+      switch (op->opcode) {
+      case GEN_OPCODE_ADD:
+        v[i] = (uint64_t)a + b;
+        break;
+      case GEN_OPCODE_MUL:
+        v[i] = (uint64_t)a * b;
+        break;
+      case GEN_OPCODE_AND:
+        v[i] = a & b;
+        break;
+      case GEN_OPCODE_OR:
+        v[i] = a | b;
+        break;
+      case GEN_OPCODE_XOR:
+        v[i] = a ^ b;
+        break;
+      case GEN_OPCODE_NOT:
+        v[i] = ~a;
+        break;
+      case GEN_OPCODE_SHL:
+        v[i] = (uint64_t)a << shift;
+        break;
+      case GEN_OPCODE_SHR:
+        v[i] = ((uint64_t)a & low) >> shift;
+        break;
+      case GEN_OPCODE_ASR:
+        v[i] = a >> shift;
+        break;
+      case GEN_OPCODE_SEL:
+        v[i] = sim_select(t, op, i, order) ? a : b;
+        break;
+      default:
+        v[i] = a;
+      }
+      if (op->opcode != GEN_OPCODE_CMP)
+        order = sim_order_int(v[i], 0);
+    }
+    if (op->cmod && sim_cond(op->cmod, order))
+      flags |= 1 << i;
+    if (op->opcode == GEN_OPCODE_CMP)
+      v[i] = -(int64_t)(flags >> i & 1);
+  }
+
+  if (op->dst.file == GEN_FILE_GRF) {
+    for (i = 0; i < op->exec_size; i++) {
+      if (mask >> i & 1)
+        sim_put(t->grf + op->dst.offset[i], op->dst.type, op->saturate,
+                is_float, f[i], v[i]);
+    }
+  }
+  if (op->cmod && op->opcode != GEN_OPCODE_SEL)
+    t->flag[op->flag] = (t->flag[op->flag] & ~mask) | flags;
+}
+
+// Unpredicated 32-bit integer ops without modifiers, the bulk of address
+// arithmetic, skip the conversions of sim_alu.
+#define SIM_DWORD_OP(name, expr)                                               \
+  static void name(sim_thread_t *t, const sim_op_t *op) {                      \
+    const uint8_t *base0 = sim_base(t, &op->src0);                             \
+    const uint8_t *base1 = sim_base(t, &op->src1);                             \
+    uint16_t mask = sim_exec_mask(t, op);                                      \
+    uint32_t a, b, r[SIMD_WIDTH];                                              \
+    int i;                                                                     \
+    for (i = 0; i < op->exec_size; i++) {                                      \
+      memcpy(&a, base0 + op->src0.offset[i], sizeof a);                        \
+      memcpy(&b, base1 + op->src1.offset[i], sizeof b);                        \
+      r[i] = (expr);                                                           \
+    }                                                                          \
+    for (i = 0; i < op->exec_size; i++) {                                      \
+      if (mask >> i & 1)                                                       \
+        memcpy(t->grf + op->dst.offset[i], &r[i], sizeof r[i]);                \
+    }                                                                          \
+  }
+
+SIM_DWORD_OP(sim_mov_dword, a)
+SIM_DWORD_OP(sim_add_dword, a + b)
+SIM_DWORD_OP(sim_mul_dword, a * b)
+SIM_DWORD_OP(sim_and_dword, a & b)
+SIM_DWORD_OP(sim_or_dword, a | b)
+SIM_DWORD_OP(sim_shl_dword, a << (b & 31))
+SIM_DWORD_OP(sim_shr_dword, a >> (b & 31))
+
+static void sim_nop(sim_thread_t *t, const sim_op_t *op) {}
+
+// Translation checks that ifs and endifs pair up within SIM_MAX_DEPTH and
+// that every if jumps to its endif.
+static void sim_if(sim_thread_t *t, const sim_op_t *op) {
+  t->stack[t->depth++] = t->mask;
+  t->mask = sim_exec_mask(t, op);
+  if (!t->mask)
+    t->pc = op->jip;
+}
+
+static void sim_endif(sim_thread_t *t, const sim_op_t *op) {
+  t->mask = t->stack[--t->depth];
+}
+
+// Blocks until the barrier notified the thread, the wait is retried once the
+// thread runs again.
+static void sim_wait(sim_thread_t *t, const sim_op_t *op) {
+  if (t->notified) {
+    t->notified--;
+  } else {
+    t->pc--;
+    t->state = SIM_WAIT;
+  }
+}
+
+// Untyped surface read or write of the enabled channels, one dword each at
+// consecutive addresses. Out of bounds reads return 0 and writes are dropped.
+static void sim_untyped(sim_thread_t *t, const sim_op_t *op) {
+  sim_group_t *g = t->group;
+  int bti = op->desc & 0xff;
+  const sim_surface_t *s = bti == GEN_BTI_SLM ? &g->slm : &g->surfaces[bti];
+  int lanes = (op->desc >> 12 & 3) == GEN_SIMD_MODE_SIMD16 ? 16 : 8;
+  int write = (op->desc >> 14 & 0x1f) == GEN_MSG_UNTYPED_WRITE;
+  int channels = 4 - __builtin_popcount(op->desc >> 8 & 0xf);
+  const uint8_t *payload = t->grf + (op->payload + (op->desc >> 19 & 1)) * 32;
+  uint16_t mask = sim_exec_mask(t, op);
+  uint32_t lines[64]; // distinct cache lines of the message
+  int i, c, j, line_count = 0;
+
+  for (i = 0; i < lanes; i++) {
+    uint32_t addr;
+    if (!(mask >> i & 1))
+      continue;
+    memcpy(&addr, payload + 4 * i, sizeof addr);
+    for (c = 0; c < channels; c++, addr += 4) {
+      int in_bounds = (uint64_t)addr + 4 <= s->size;
+      uint32_t value = 0;
+      if (write) {
+        if (in_bounds && !s->readonly)
+          memcpy(s->data + addr, payload + 4 * (lanes * (c + 1) + i), 4);
+      } else {
+        if (in_bounds)
+          memcpy(&value, s->data + addr, 4);
+        memcpy(t->grf + op->response * 32 + 4 * (lanes * c + i), &value, 4);
+      }
+      if (!g->memory || bti == GEN_BTI_SLM || !in_bounds ||
+          (write && s->readonly))
+        continue;
+      for (j = 0; j < line_count && lines[j] != addr / SIM_LINE_SIZE; j++)
+        ;
+      if (j == line_count)
+        lines[line_count++] = addr / SIM_LINE_SIZE;
+    }
+  }
+  t->level = bti == GEN_BTI_SLM ? SIM_LEVEL_SLM : SIM_LEVEL_L3;
+  for (j = 0; j < line_count; j++) {
+    int level = sim_memory_access(g->memory, bti, lines[j], write);
+    t->level = level > t->level ? level : t->level;
+  }
+  if (op->eot)
+    t->state = SIM_DONE;
+}
+
+// Memory accesses complete in order, so the fence only writes its reply.
+static void sim_fence(sim_thread_t *t, const sim_op_t *op) {
+  memset(t->grf + op->response * 32, 0, (op->desc >> 20 & 0x1f) * 32);
+  if (op->eot)
+    t->state = SIM_DONE;
+}
+
+// The last thread of the group to arrive notifies all of them.
+static void sim_barrier(sim_thread_t *t, const sim_op_t *op) {
+  sim_group_t *g = t->group;
+  int i;
+
+  if (++g->arrived == g->thread_count) {
+    g->arrived = 0;
+    for (i = 0; i < g->thread_count; i++)
+      g->threads[i].notified++;
+  }
+  if (op->eot)
+    t->state = SIM_DONE;
+}
+
+static void sim_end(sim_thread_t *t, const sim_op_t *op) {
+  t->state = SIM_DONE;
+}
+
+static int sim_operand(sim_operand_t *o, const sim_region_t *r, int exec_size,
+                       int dst) {
+  int size = gen_type_size[r->type];
+  int vstride = r->vstride ? 1 << (r->vstride - 1) : 0;
+  int width = dst ? SIMD_WIDTH : 1 << r->width;
+  int hstride = r->hstride ? 1 << (r->hstride - 1) : 0;
+  int i;
+
+  memset(o, 0, sizeof *o);
+  o->file = r->file;
+  o->type = r->type;
+  o->negate = r->negate;
+  o->abs = r->abs;
+  o->imm = r->imm;
+  if (r->file == GEN_FILE_ARF && r->nr == GEN_ARF_NULL) {
+    o->imm = 0;
+    return 0;
+  }
+  if (r->file == GEN_FILE_IMM) {
+    // word immediates are replicated in the dword, read them as dwords
+    if (r->type == GEN_TYPE_W) {
+      o->type = GEN_TYPE_D;
+      o->imm = (int16_t)r->imm;
+    } else if (r->type == GEN_TYPE_UW) {
+      o->type = GEN_TYPE_UD;
+      o->imm = (uint16_t)r->imm;
+    }
+    return dst;
+  }
+  if (r->file != GEN_FILE_GRF || r->indirect || r->vstride == 0xf ||
+      r->width > 4)
+    return 1;
+  for (i = 0; i < exec_size; i++) {
+    int offset = r->nr * 32 + r->subnr +
+                 (dst ? i * hstride
+                      : (i / width) * vstride + (i % width) * hstride) *
+                     size;
+    if (offset + size > SIM_GRF_SIZE)
+      return 1;
+    o->offset[i] = offset;
+  }
+  return 0;
+}
+
+// Messages are checked to fit the register file and the bound surfaces.
+static int sim_translate_send(sim_op_t *op, const sim_inst_t *in) {
+  int mlen = in->desc >> 25 & 0xf, rlen = in->desc >> 20 & 0x1f;
+  int type = in->desc >> 14 & 0x1f, simd = in->desc >> 12 & 3;
+  int lanes = simd == GEN_SIMD_MODE_SIMD16 ? 16 : 8;
+  int channels = 4 - __builtin_popcount(in->desc >> 8 & 0xf);
+  int header = in->desc >> 19 & 1, bti = in->desc & 0xff;
+  int write = type == GEN_MSG_UNTYPED_WRITE;
+
+  op->payload = in->src0.nr;
+  op->response = in->dst.file == GEN_FILE_GRF ? in->dst.nr : 0;
+  if (in->src0.file != GEN_FILE_GRF || op->payload + mlen > 128 ||
+      (rlen && (in->dst.file != GEN_FILE_GRF || op->response + rlen > 128)))
+    return 1;
+
+  switch (in->cmod) {
+  case GEN_SFID_DATAPORT1:
+    if ((type != GEN_MSG_UNTYPED_READ && !write) ||
+        (simd != GEN_SIMD_MODE_SIMD16 && simd != GEN_SIMD_MODE_SIMD8) ||
+        (bti >= SIM_SURFACES && bti != GEN_BTI_SLM) ||
+        mlen < header + lanes / 8 * (1 + write * channels) ||
+        rlen < !write * lanes / 8 * channels)
+      return 1;
+    op->run = sim_untyped;
+    return 0;
+  case GEN_SFID_DATAPORT_DATA:
+    op->run = sim_fence;
+    return type != GEN_MSG_MEMORY_FENCE;
+  case GEN_SFID_GATEWAY:
+    op->run = sim_barrier;
+    return (in->desc & 7) != GEN_GATEWAY_BARRIER;
+  case GEN_SFID_THREAD_SPAWNER:
+    op->run = sim_end;
+    return !in->eot;
+  }
+  return 1;
+}
+
+// Resolves the regions of an instruction and picks the handler for it.
+static int sim_translate_inst(sim_op_t *op, const sim_inst_t *in) {
+  int unary = 0, logic, shift;
+
+  memset(op, 0, sizeof *op);
+  op->opcode = in->opcode;
+  op->exec_size = in->exec_size;
+  op->cmod = in->cmod;
+  op->pred = in->pred;
+  op->pred_inv = in->pred_inv;
+  op->flag = in->flag;
+  op->nomask = in->nomask;
+  op->saturate = in->saturate;
+  op->eot = in->eot;
+  op->desc = in->desc;
+  if (in->align16 || in->pred > 1 || in->exec_size > SIMD_WIDTH)
+    return 1;
+
+  switch (in->opcode) {
+  case GEN_OPCODE_NOP:
+    op->run = sim_nop;
+    return 0;
+  case GEN_OPCODE_IF:
+    op->run = sim_if;
+    return 0;
+  case GEN_OPCODE_ENDIF:
+    op->run = sim_endif;
+    return 0;
+  case GEN_OPCODE_WAIT:
+    op->run = sim_wait;
+    return 0;
+  case GEN_OPCODE_SEND:
+  case GEN_OPCODE_SENDC:
+    op->cmod = 0;
+    return sim_translate_send(op, in);
+  case GEN_OPCODE_MOV:
+  case GEN_OPCODE_NOT:
+    unary = 1;
+    break;
+  case GEN_OPCODE_SEL:
+  case GEN_OPCODE_AND:
+  case GEN_OPCODE_OR:
+  case GEN_OPCODE_XOR:
+  case GEN_OPCODE_SHR:
+  case GEN_OPCODE_SHL:
+  case GEN_OPCODE_ASR:
+  case GEN_OPCODE_CMP:
+  case GEN_OPCODE_ADD:
+  case GEN_OPCODE_MUL:
+    break;
+  default:
+    return 1;
+  }
+
+  if (in->cmod > GEN_COND_LE ||
+      sim_operand(&op->dst, &in->dst, op->exec_size, 1) ||
+      sim_operand(&op->src0, &in->src0, op->exec_size, 0))
+    return 1;
+  if (unary) {
+    op->src1.file = GEN_FILE_IMM;
+    op->src1.type = GEN_TYPE_UD;
+  } else if (sim_operand(&op->src1, &in->src1, op->exec_size, 0)) {
+    return 1;
+  }
+  op->is_float = sim_is_float(op->src0.type) || sim_is_float(op->src1.type);
+  op->run = sim_alu;
+
+  logic = op->opcode == GEN_OPCODE_NOT || op->opcode == GEN_OPCODE_AND ||
+          op->opcode == GEN_OPCODE_OR || op->opcode == GEN_OPCODE_XOR;
+  shift = op->opcode == GEN_OPCODE_SHR || op->opcode == GEN_OPCODE_SHL ||
+          op->opcode == GEN_OPCODE_ASR;
+  if (logic) {
+    op->src0.invert = op->src0.negate;
+    op->src1.invert = op->src1.negate;
+    op->src0.negate = op->src1.negate = 0;
+  }
+  if (op->is_float && (logic || shift))
+    return 1;
+
+  if (op->pred || op->cmod || op->saturate || op->dst.file != GEN_FILE_GRF ||
+      !sim_is_dword(&op->dst) || !sim_is_dword(&op->src0) ||
+      !sim_is_dword(&op->src1))
+    return 0;
+  switch (op->opcode) {
+  case GEN_OPCODE_MOV:
+    op->run = sim_mov_dword;
+    break;
+  case GEN_OPCODE_ADD:
+    op->run = sim_add_dword;
+    break;
+  case GEN_OPCODE_MUL:
+    op->run = sim_mul_dword;
+    break;
+  case GEN_OPCODE_AND:
+    op->run = sim_and_dword;
+    break;
+  case GEN_OPCODE_OR:
+    op->run = sim_or_dword;
+    break;
+  case GEN_OPCODE_SHL:
+    op->run = sim_shl_dword;
+    break;
+  case GEN_OPCODE_SHR:
+    op->run = sim_shr_dword;
+    break;
+  }
+  return 0;
+}
+
+// Source regions share their layout from bit lo on, with the file and type
+// at file_lo.
+static void sim_source0(const uint32_t *inst, int file_lo, int lo,
+                            sim_region_t *r) {
+  r->file = gen_field(inst, file_lo + 1, file_lo);
+  r->type = gen_field(inst, file_lo + 5, file_lo + 2);
+  r->subnr = gen_field(inst, lo + 4, lo);
+  r->nr = gen_field(inst, lo + 12, lo + 5);
+  r->abs = gen_field(inst, lo + 13, lo + 13);
+  r->negate = gen_field(inst, lo + 14, lo + 14);
+  r->indirect = gen_field(inst, lo + 15, lo + 15);
+  r->hstride = gen_field(inst, lo + 17, lo + 16);
+  r->width = gen_field(inst, lo + 20, lo + 18);
+  r->vstride = gen_field(inst, lo + 24, lo + 21);
+}
+
+// Immediates of the types the register file has, vectors are not supported.
+static int sim_imm_type0(int type) {
+  return type <= GEN_TYPE_W || type == GEN_TYPE_F || type == GEN_TYPE_UQ ||
+         type == GEN_TYPE_Q;
+}
+
+// Decodes the instruction at code, see gen_emit and gen_set_* for the layout.
+// Returns its size in bytes, or 0 if it is compacted or cannot be decoded.
+static int sim_decode0(const uint8_t *code, uint32_t size, sim_inst_t *in) {
+  static const int types = sizeof gen_type_size / sizeof gen_type_size[0];
+  uint32_t inst[4];
+
+  if (size < 16)
+    return 0;
+  memcpy(inst, code, sizeof inst);
+  if (gen_field(inst, 29, 29))
+    return 0;
+  memset(in, 0, sizeof *in);
+  in->opcode = gen_field(inst, 6, 0);
+  in->align16 = gen_field(inst, 8, 8);
+  in->pred = gen_field(inst, 19, 16);
+  in->pred_inv = gen_field(inst, 20, 20);
+  in->exec_size = 1 << gen_field(inst, 23, 21);
+  in->cmod = gen_field(inst, 27, 24);
+  in->saturate = gen_field(inst, 31, 31);
+  in->flag = gen_field(inst, 33, 33) * 2 + gen_field(inst, 32, 32);
+  in->nomask = gen_field(inst, 34, 34);
+  in->dst.file = gen_field(inst, 36, 35);
+  in->dst.type = gen_field(inst, 40, 37);
+  in->dst.subnr = gen_field(inst, 52, 48);
+  in->dst.nr = gen_field(inst, 60, 53);
+  in->dst.hstride = gen_field(inst, 62, 61);
+  in->dst.indirect = gen_field(inst, 63, 63);
+  sim_source0(inst, 41, 64, &in->src0);
+  sim_source0(inst, 89, 96, &in->src1);
+  in->jip = inst[2];
+  in->desc = inst[3];
+  in->eot = (in->opcode == GEN_OPCODE_SEND || in->opcode == GEN_OPCODE_SENDC) &&
+            gen_field(inst, 127, 127);
+
+  if (in->src0.file == GEN_FILE_IMM) {
+    in->src0.imm = gen_type_size[in->src0.type] == 8
+                       ? inst[2] | (uint64_t)inst[3] << 32
+                       : inst[3];
+    if (!sim_imm_type0(in->src0.type))
+      return 0;
+  } else if (in->src1.file == GEN_FILE_IMM) {
+    in->src1.imm = inst[3];
+    if (!sim_imm_type0(in->src1.type))
+      return 0;
+  }
+  if (in->dst.type >= types || in->src0.type >= types ||
+      in->src1.type >= types)
+    return 0;
+  return 16;
+}
+
+// GRF registers an operand touches, none for other files.
+static void sim_operand_regs(const sim_operand_t *o, int exec_size,
+                             int *regs) {
+  int i, size = gen_type_size[o->type];
+
+  if (o->file != GEN_FILE_GRF)
+    return;
+  regs[0] = SIM_GRF_SIZE / 32 - 1;
+  regs[1] = 0;
+  for (i = 0; i < exec_size; i++) {
+    int first = o->offset[i] / 32, last = (o->offset[i] + size - 1) / 32;
+    regs[0] = first < regs[0] ? first : regs[0];
+    regs[1] = last > regs[1] ? last : regs[1];
+  }
+}
+
+// Static costs of an op for the timing model. ALU ops issue four 32-bit or
+// two 64-bit channels a cycle, dword integer multiplies a quarter of that.
+// Messages issue in SIM_SEND_ISSUE cycles and their reply fills the response
+// registers, control flow takes a cycle.
+static void sim_cost(sim_op_t *op, const sim_inst_t *in, int offset) {
+  int s, size;
+
+  op->offset = offset;
+  for (s = 0; s < 3; s++) {
+    op->regs[s][0] = 1;
+    op->regs[s][1] = 0;
+  }
+  if (op->opcode == GEN_OPCODE_SEND || op->opcode == GEN_OPCODE_SENDC) {
+    int mlen = in->desc >> 25 & 0xf, rlen = in->desc >> 20 & 0x1f;
+    op->issue = SIM_SEND_ISSUE;
+    op->latency = sim_latency[SIM_LEVEL_L3];
+    op->regs[0][0] = op->response;
+    op->regs[0][1] = op->response + rlen - 1;
+    op->regs[1][0] = op->payload;
+    op->regs[1][1] = op->payload + mlen - 1;
+    return;
+  }
+  if (op->opcode == GEN_OPCODE_IF || op->opcode == GEN_OPCODE_ENDIF ||
+      op->opcode == GEN_OPCODE_WAIT || op->opcode == GEN_OPCODE_NOP) {
+    op->issue = 1;
+    return;
+  }
+  size = gen_type_size[op->dst.type];
+  size = gen_type_size[op->src0.type] > size ? gen_type_size[op->src0.type]
+                                             : size;
+  op->issue = (op->exec_size * (size > 4 ? 2 : 1) + 3) / 4;
+  if (op->opcode == GEN_OPCODE_MUL && !op->is_float && size == 4)
+    op->issue *= 4;
+  op->latency = op->issue + SIM_ALU_LATENCY;
+  sim_operand_regs(&op->dst, op->exec_size, op->regs[0]);
+  sim_operand_regs(&op->src0, op->exec_size, op->regs[1]);
+  sim_operand_regs(&op->src1, op->exec_size, op->regs[2]);
+}
+
+// Translates the kernel in code, or finds the translation of an identical
+// binary. Decoding stops at the first end of thread.
+static const sim_kernel_t *sim_translate0(const uint8_t *code, uint32_t size) {
+  uint32_t hash = fnv1a(code, size);
+  uint32_t offsets[SIM_MAX_OPS], targets[SIM_MAX_OPS], offset = 0;
+  int ifs[SIM_MAX_DEPTH];
+  int i, n, depth = 0, eot = 0;
+  sim_kernel_t *k;
+
+  for (i = 0; i < SIM_CACHE_SIZE; i++) {
+    k = &sim_cache[i];
+    if (k->ops && k->hash == hash && k->size == size &&
+        !memcmp(k->code, code, size))
+      return k;
+  }
+
+  sim_op_t *ops = calloc(SIM_MAX_OPS, sizeof *ops);
+  for (n = 0; n < SIM_MAX_OPS && !eot && offset < size; n++) {
+    sim_inst_t in;
+    int length = sim_decode0(code + offset, size - offset, &in);
+    if (!length || sim_translate_inst(&ops[n], &in)) {
+      fprintf(stderr, "Cannot simulate opcode 0x%02x at byte %u\n",
+              code[offset] & 0x7f, offset);
+      free(ops);
+      return NULL;
+    }
+    sim_cost(&ops[n], &in, offset);
+    offsets[n] = offset;
+    targets[n] = offset + in.jip;
+    eot = in.eot;
+    offset += length;
+  }
+
+  // every if has to jump to its own endif when no channel takes it
+  for (i = 0; i < n && depth >= 0; i++) {
+    if (ops[i].opcode == GEN_OPCODE_IF) {
+      if (depth == SIM_MAX_DEPTH)
+        break;
+      ifs[depth++] = i;
+    } else if (ops[i].opcode == GEN_OPCODE_ENDIF) {
+      if (!depth || targets[ifs[depth - 1]] != offsets[i])
+        break;
+      ops[ifs[--depth]].jip = i;
+    }
+  }
+  if (!eot || i < n || depth) {
+    fprintf(stderr, eot ? "Cannot simulate the control flow at byte %u\n"
+                        : "No end of thread before byte %u\n",
+            i < n ? offsets[i] : offset);
+    free(ops);
+    return NULL;
+  }
+
+  k = &sim_cache[sim_cached++ % SIM_CACHE_SIZE];
+  free(k->code);
+  free(k->ops);
+  k->code = malloc(size);
+  memcpy(k->code, code, size);
+  k->size = size;
+  k->hash = hash;
+  k->count = n;
+  k->ops = ops;
+  return k;
+}
+
+// Runs one work-group until all of its threads ended. Threads run in turn
+// until they block on the barrier or end, if none of them can continue the
+// group deadlocked.
+// Advances the clock of t over op, which just ran.
+static void sim_time_op(sim_timing_t *m, sim_thread_t *t, const sim_op_t *op) {
+  sim_group_t *g = t->group;
+  int i = op - m->k->ops, s, r;
+  int latency = op->run == sim_untyped ? sim_latency[t->level] : op->latency;
+  uint32_t start = t->cycle;
+
+  if (t->state == SIM_WAIT)
+    return; // runs again once notified
+  for (s = 0; s < 3; s++) {
+    for (r = op->regs[s][0]; r <= op->regs[s][1]; r++)
+      start = t->ready[r] > start ? t->ready[r] : start;
+  }
+  if (op->opcode == GEN_OPCODE_WAIT)
+    start = t->release > start ? t->release : start;
+  m->count[i]++;
+  m->issue[i] += op->issue;
+  m->stall[i] += start - t->cycle;
+  m->busy += op->issue;
+  t->cycle = start + op->issue;
+  for (r = op->regs[0][0]; r <= op->regs[0][1]; r++)
+    t->ready[r] = start + latency;
+
+  // the last thread to arrive releases all of them
+  if (op->run == sim_barrier) {
+    g->arrival = t->cycle > g->arrival ? t->cycle : g->arrival;
+    if (!g->arrived) {
+      for (r = 0; r < g->thread_count; r++)
+        g->threads[r].release = g->arrival + SIM_BARRIER_LATENCY;
+      g->arrival = 0;
+    }
+  }
+  if (t->state == SIM_DONE) {
+    m->lifetime += t->cycle + SIM_EOT_LATENCY;
+    m->threads++;
+  }
+}
+
+static int sim_run_group(const sim_kernel_t *k, sim_group_t *g, uint32_t gid,
+                         const uint8_t *curb) {
+  int i, running, progress;
+
+  for (i = 0; i < g->thread_count; i++) {
+    sim_thread_t *t = &g->threads[i];
+    uint32_t header[8] = {0, gid}; // barrier id 0 in r0.2
+    memset(t, 0, sizeof *t);
+    memcpy(t->grf, header, sizeof header);
+    memcpy(t->grf + 32, curb + i * 256, 256);
+    t->mask = 0xffff;
+    t->group = g;
+  }
+  g->arrived = 0;
+  g->arrival = 0;
+
+  do {
+    running = progress = 0;
+    for (i = 0; i < g->thread_count; i++) {
+      sim_thread_t *t = &g->threads[i];
+      if (t->state == SIM_WAIT && t->notified)
+        t->state = SIM_RUN;
+      progress |= t->state == SIM_RUN;
+      while (t->state == SIM_RUN) {
+        const sim_op_t *op = &k->ops[t->pc++];
+        op->run(t, op);
+        if (g->timing)
+          sim_time_op(g->timing, t, op);
+      }
+      running += t->state != SIM_DONE;
+    }
+  } while (running && progress);
+
+  if (running)
+    fprintf(stderr, "Work-group %u deadlocked, %d threads wait forever\n",
+            gid, running);
+  return running;
+}
+
+// Host threads of the software executor, one per core unless
+// $GPGPU_SIM_THREADS says otherwise.
+static int sim_threads(void) {
+  const char *env = getenv("GPGPU_SIM_THREADS");
+  int n = env ? atoi(env) : cpu_threads();
+  return n < 1 ? 1 : n > CPU_MAX_THREADS ? CPU_MAX_THREADS : n;
+}
+
+// Groups not yet started by a host thread, [next, end). The owner takes them
+// from the front, idle threads steal the back half.
+typedef struct sim_range {
+  pthread_mutex_t lock;
+  uint32_t next, end;
+} sim_range_t;
+
+typedef struct sim_pool {
+  const sim_kernel_t *k;
+  const uint8_t *curb;
+  sim_range_t ranges[CPU_MAX_THREADS];
+  int workers;
+  int ordered; // all threads take from ranges[0], in walker order
+  int failed;
+} sim_pool_t;
+
+typedef struct sim_worker {
+  sim_pool_t *pool;
+  int index;
+  sim_group_t group; // register files and SLM of the group being run
+} sim_worker_t;
+
+static int sim_take(sim_range_t *r, uint32_t *gid) {
+  int taken;
+  pthread_mutex_lock(&r->lock);
+  taken = r->next < r->end;
+  if (taken)
+    *gid = r->next++;
+  pthread_mutex_unlock(&r->lock);
+  return taken;
+}
+
+// Moves the back half of the first other range with groups left to range i,
+// or its last group.
+static int sim_steal(sim_pool_t *pool, int i) {
+  uint32_t begin, end;
+  int j;
+
+  for (j = 1; j < pool->workers; j++) {
+    sim_range_t *victim = &pool->ranges[(i + j) % pool->workers];
+    pthread_mutex_lock(&victim->lock);
+    end = victim->end;
+    begin = victim->next + (end - victim->next) / 2;
+    victim->end = begin;
+    pthread_mutex_unlock(&victim->lock);
+    if (begin < end) {
+      pthread_mutex_lock(&pool->ranges[i].lock);
+      pool->ranges[i].next = begin;
+      pool->ranges[i].end = end;
+      pthread_mutex_unlock(&pool->ranges[i].lock);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static int sim_next(sim_pool_t *pool, int i, uint32_t *gid) {
+  if (pool->ordered)
+    return sim_take(&pool->ranges[0], gid);
+  while (!sim_take(&pool->ranges[i], gid)) {
+    if (!sim_steal(pool, i))
+      return 0;
+  }
+  return 1;
+}
+
+static void *sim_worker(void *arg) {
+  sim_worker_t *w = arg;
+  sim_pool_t *pool = w->pool;
+  uint32_t gid;
+
+  while (!__atomic_load_n(&pool->failed, __ATOMIC_RELAXED) &&
+         sim_next(pool, w->index, &gid)) {
+    if (sim_run_group(pool->k, &w->group, gid, pool->curb))
+      __atomic_store_n(&pool->failed, 1, __ATOMIC_RELAXED);
+  }
+  return NULL;
+}
+
+// Runs d on the software executor with the thread payloads in curb and the
+// surfaces bound at their binding table indices. Work-groups are spread over
+// the host threads, each runs whole groups so barriers stay within one
+// thread. Every thread starts on its own slice of the groups and steals from
+// the others once it runs dry, or with $GPGPU_SIM_ORDERED set all threads
+// start groups in the order of the walker. The cache and timing models see
+// the accesses of one host thread, in walker order.
+static int sim_launch0(const sim_kernel_t *k, const dispatch_t *d,
+                       const uint8_t *curb, const sim_surface_t *surfaces,
+                       sim_memory_t *memory, sim_timing_t *timing) {
+  sim_pool_t pool = {0};
+  sim_worker_t workers[CPU_MAX_THREADS];
+  pthread_t threads[CPU_MAX_THREADS];
+  int started[CPU_MAX_THREADS] = {0};
+  const char *ordered = getenv("GPGPU_SIM_ORDERED");
+  int i, n = sim_threads();
+
+  n = d->groups < n ? (d->groups ? d->groups : 1) : n;
+  n = memory || timing ? 1 : n;
+  pool.k = k;
+  pool.curb = curb;
+  pool.workers = n;
+  pool.ordered = ordered && strcmp(ordered, "0");
+  pool.failed = 0;
+
+  for (i = 0; i < n; i++) {
+    sim_range_t *r = &pool.ranges[i];
+    sim_group_t *g = &workers[i].group;
+    pthread_mutex_init(&r->lock, NULL);
+    r->next = pool.ordered ? 0 : (uint64_t)d->groups * i / n;
+    r->end = pool.ordered ? (i ? 0 : d->groups)
+                          : (uint64_t)d->groups * (i + 1) / n;
+    workers[i].pool = &pool;
+    workers[i].index = i;
+    memset(g, 0, sizeof *g);
+    memcpy(g->surfaces, surfaces, sizeof g->surfaces);
+    g->slm.size = slm_size_bytes(slm_size_encoding(d->slm_size));
+    g->slm.data = calloc(1, g->slm.size + 1);
+    g->threads = calloc(d->group_threads, sizeof *g->threads);
+    g->thread_count = d->group_threads;
+    g->memory = memory;
+    g->timing = timing;
+  }
+  for (i = 1; i < n; i++)
+    started[i] = !pthread_create(&threads[i], NULL, sim_worker, &workers[i]);
+  sim_worker(&workers[0]);
+  for (i = 1; i < n; i++) {
+    if (started[i])
+      pthread_join(threads[i], NULL);
+    else
+      sim_worker(&workers[i]);
+  }
+
+  for (i = 0; i < n; i++) {
+    pthread_mutex_destroy(&pool.ranges[i].lock);
+    free(workers[i].group.slm.data);
+    free(workers[i].group.threads);
+  }
+  return pool.failed;
+}
+
+// Runs d with the buffers bound like run_dispatch binds them, size bytes
+// each. The input surface is read only.
+static int sim_dispatch0(const sim_kernel_t *k, const dispatch_t *d,
+                         const void *input_data, void *output_data,
+                         uint32_t size, sim_memory_t *memory,
+                         sim_timing_t *timing) {
+  sim_surface_t surfaces[SIM_SURFACES] = {{0}};
+  dispatch_t bound = *d;
+  int failed;
+
+  if (d->indirect) {
+    fprintf(stderr, "Indirect dispatches need a GPU\n");
+    return 1;
+  }
+  uint8_t *state = calloc(1, CURB_OFFSET + d->group_threads * 256);
+  bound.slm_size = setup_heap0(state, size, d);
+  setup_curb0(state + CURB_OFFSET, &bound);
+  surfaces[2] = (sim_surface_t){(uint8_t *)input_data, size, 1};
+  surfaces[3] = (sim_surface_t){output_data, size, 0};
+  failed =
+      sim_launch0(k, &bound, state + CURB_OFFSET, surfaces, memory, timing);
+  free(state);
+  return failed;
+}
+
+// Translates and runs a kernel, returns the elapsed time or a negative value
+// if it could not be simulated. With timing the kernel runs under the cache
+// and timing models, which fill it in.
+static double sim_time0(const uint8_t *code, int size, const dispatch_t *d,
+                        const void *input, void *output, uint32_t bytes,
+                        sim_timing_t *timing) {
+  double start = now();
+  const sim_kernel_t *k = sim_translate0(code, size);
+  sim_memory_t memory;
+  int s, failed;
+
+  if (!k)
+    return -1;
+  if (!timing)
+    return sim_dispatch0(k, d, input, output, bytes, NULL, NULL)
+               ? -1
+               : now() - start;
+  memset(timing, 0, sizeof *timing);
+  timing->k = k;
+  timing->count = calloc(k->count, sizeof *timing->count);
+  timing->issue = calloc(k->count, sizeof *timing->issue);
+  timing->stall = calloc(k->count, sizeof *timing->stall);
+  sim_memory_init0(&memory, d);
+  failed = sim_dispatch0(k, d, input, output, bytes, &memory, timing);
+  sim_memory_flush(&memory);
+  for (s = 0; s < SIM_SURFACES; s++)
+    timing->bytes += memory.traffic[s].read + memory.traffic[s].written +
+                     memory.traffic[s].written_back;
+  sim_memory_free(&memory);
+  return failed ? -1 : now() - start;
+}
+
+static const char *sim_opcode_name(int opcode) {
+  switch (opcode) {
+  case GEN_OPCODE_MOV:
+    return "mov";
+  case GEN_OPCODE_SEL:
+    return "sel";
+  case GEN_OPCODE_NOT:
+    return "not";
+  case GEN_OPCODE_AND:
+    return "and";
+  case GEN_OPCODE_OR:
+    return "or";
+  case GEN_OPCODE_XOR:
+    return "xor";
+  case GEN_OPCODE_SHR:
+    return "shr";
+  case GEN_OPCODE_SHL:
+    return "shl";
+  case GEN_OPCODE_ASR:
+    return "asr";
+  case GEN_OPCODE_CMP:
+    return "cmp";
+  case GEN_OPCODE_IF:
+    return "if";
+  case GEN_OPCODE_ENDIF:
+    return "endif";
+  case GEN_OPCODE_WAIT:
+    return "wait";
+  case GEN_OPCODE_SEND:
+    return "send";
+  case GEN_OPCODE_SENDC:
+    return "sendc";
+  case GEN_OPCODE_ADD:
+    return "add";
+  case GEN_OPCODE_MUL:
+    return "mul";
+  }
+  return "nop";
+}
+
+// Prints the estimate of a timed run of items work items and the cycles of
+// every op, then frees the counters.
+static void sim_timing_report(sim_timing_t *m, uint32_t items) {
+  uint64_t eus = m->threads < SIM_EUS ? m->threads : SIM_EUS;
+  uint64_t slots = m->threads < SIM_EUS * SIM_EU_THREADS
+                       ? m->threads
+                       : SIM_EUS * SIM_EU_THREADS;
+  double issue = eus ? (double)m->busy / eus : 0;
+  double latency = slots ? (double)m->lifetime / slots : 0;
+  double memory = m->bytes / (SIM_MEMORY_GBPS * 1e3 / SIM_CLOCK_MHZ);
+  double cycles = issue > latency ? issue : latency, total = 0;
+  int i;
+
+  cycles = memory > cycles ? memory : cycles;
+  fprintf(stderr,
+          "         est %8.3f ms, %8.2f Mitems/s, %s bound, issue %.0f, "
+          "latency %.0f, memory %.0f cycles\n",
+          cycles / SIM_CLOCK_MHZ * 1e-3, items * SIM_CLOCK_MHZ / cycles,
+          cycles == memory ? "memory" : cycles == issue ? "issue" : "latency",
+          issue, latency, memory);
+  for (i = 0; i < m->k->count; i++)
+    total += m->issue[i] + m->stall[i];
+  for (i = 0; i < m->k->count; i++) {
+    const sim_op_t *op = &m->k->ops[i];
+    fprintf(stderr,
+            "         %4d %-7s %2d %10llu runs %12llu issue %12llu stall "
+            "%5.1f%%\n",
+            op->offset, sim_opcode_name(op->opcode), op->exec_size,
+            (unsigned long long)m->count[i], (unsigned long long)m->issue[i],
+            (unsigned long long)m->stall[i],
+            total ? 100.0 * (m->issue[i] + m->stall[i]) / total : 0.0);
+  }
+  free(m->count);
+  free(m->issue);
+  free(m->stall);
+}
+
+// Prints how a kernel did, and with timing its estimate.
+static int sim_report(const char *name, uint32_t items, double elapsed,
+                      size_t correct, size_t count, sim_timing_t *timing) {
+  if (elapsed < 0) {
+    fprintf(stderr, "%-8s not simulated\n", name);
+    return 1;
+  }
+  fprintf(stderr, "%-8s %8.3f ms, %8.2f Mitems/s, %zu/%zu correct\n", name,
+          elapsed * 1e3, items / elapsed * 1e-6, correct, count);
+  if (timing)
+    sim_timing_report(timing, items);
+  return correct != count;
+}
+
+// Runs the default, typed, SLM and reduce kernels over n work items on the
+// software executor and checks their results, no GPU needed. With timed set
+// every kernel also gets an estimate of its time on the GPU.
+static int run_simulate0(uint32_t n, int timed) {
+  uint8_t kernel_data[4096] = {0};
+  uint32_t groups = (n + GROUP_SIZE - 1) / GROUP_SIZE;
+  uint32_t items = groups * GROUP_SIZE, bytes = items * sizeof(uint32_t);
+  uint32_t *input = malloc(bytes), *output = malloc(bytes);
+  size_t i, count, correct;
+  int t, size, failed = 0;
+  double elapsed;
+  sim_timing_t timing, *timed_by = timed ? &timing : NULL;
+
+  fprintf(stderr, "Simulating %u work items on %d host threads\n", items,
+          timed ? 1 : sim_threads());
+  if (timed)
+    fprintf(stderr, "Estimating for %d EUs of %d threads at %d MHz\n",
+            SIM_EUS, SIM_EU_THREADS, SIM_CLOCK_MHZ);
+
+  // the default kernel and the typed kernels double every element
+  for (t = -1; t < (int)(sizeof elem_types / sizeof elem_types[0]); t++) {
+    const elem_type_t *et = &elem_types[t < 0 ? 0 : t];
+    dispatch_t d = {groups, GROUP_THREADS};
+    if (t < 0) {
+      setup_kernel0(kernel_data);
+      size = sizeof kernel - 1;
+    } else {
+      size = setup_typed_kernel0(kernel_data, et->elem);
+    }
+    elem_fill(et->elem, (uint8_t *)input, bytes);
+    memset(output, 0, bytes);
+    elapsed = sim_time0(kernel_data, size, &d, input, output, bytes,
+                        timed_by);
+    count = bytes / et->size;
+    for (i = 0, correct = 0; i < count; i++)
+      correct += elem_check(et->elem, (uint8_t *)input, (uint8_t *)output, i);
+    failed |= sim_report(t < 0 ? "kernel" : et->name, items, elapsed, correct,
+                         count, timed_by);
+  }
+
+  // every work-group reversed through SLM
+  dispatch_t slm = {groups, GROUP_THREADS, GROUP_SIZE * sizeof(int), 1};
+  size = setup_slm_kernel0(kernel_data, GROUP_SIZE);
+  elem_fill(ELEM_INT32, (uint8_t *)input, bytes);
+  elapsed = sim_time0(kernel_data, size, &slm, input, output, bytes,
+                      timed_by);
+  for (i = 0, correct = 0; i < items; i++) {
+    size_t group = i - i % GROUP_SIZE, lid = i % GROUP_SIZE;
+    correct += output[i] == input[group + GROUP_SIZE - 1 - lid];
+  }
+  failed |= sim_report("slm", items, elapsed, correct, items, timed_by);
+
+  // every work-group summed into output[group id]
+  dispatch_t reduce = {groups, GROUP_THREADS, 2 * REDUCE_SLM_INDEX, 1};
+  size = setup_reduce_kernel0(kernel_data, REDUCE_SUM, GEN_TYPE_D,
+                              GROUP_THREADS, 0);
+  elapsed = sim_time0(kernel_data, size, &reduce, input, output, bytes,
+                      timed_by);
+  for (i = 0, correct = 0; i < groups; i++) {
+    uint32_t sum = 0, j;
+    for (j = 0; j < GROUP_SIZE; j++)
+      sum += input[i * GROUP_SIZE + j];
+    correct += output[i] == sum;
+  }
+  failed |= sim_report("reduce", items, elapsed, correct, groups, timed_by);
+
+  free(input);
+  free(output);
+  return failed;
+}
+
+static void sim_traffic_report(const sim_memory_t *m, const char *config,
+                               int pass, uint32_t items) {
+  static const char *names[SIM_SURFACES] = {"", "", "input", "output"};
+  int s;
+
+  for (s = 2; s < SIM_SURFACES; s++) {
+    const sim_traffic_t *t = &m->traffic[s];
+    uint64_t bytes = t->read + t->written + t->written_back;
+    fprintf(stderr,
+            "%-19s %-6s pass %d: L3 %5.1f%%, LLC %5.1f%%, %8.2f MB, "
+            "%8.2f MB written back, %5.2f B/item\n",
+            config, names[s], pass,
+            t->lines ? 100.0 * t->l3_hits / t->lines : 0.0,
+            t->llc_lines ? 100.0 * t->llc_hits / t->llc_lines : 0.0,
+            bytes * 1e-6, t->written_back * 1e-6, (double)bytes / items);
+  }
+}
+
+// Doubles bytes of int32 on the software executor with the cache model, under
+// every L3 preset and then under each surface cache policy. Every config runs
+// SIM_CACHE_PASSES times over the same buffers with the caches kept between
+// passes, so the later passes show what the configuration keeps cached.
+static int run_simulate_cache0(uint32_t bytes) {
+  static const char *names[] = {"llc+l3", "l3", "streaming"};
+  size_t presets = sizeof l3_presets / sizeof l3_presets[0], i;
+  uint8_t kernel_data[4096] = {0};
+  uint32_t groups = (bytes + GROUP_SIZE * 4 - 1) / (GROUP_SIZE * 4);
+  uint32_t items = groups * GROUP_SIZE, size = items * sizeof(uint32_t);
+  uint8_t *input, *output;
+  int pass, failed;
+  char config[32];
+
+  // zero bytes leave no work items to divide the traffic by
+  if (!bytes) {
+    fprintf(stderr, "--simulate-cache needs at least one byte\n");
+    return 1;
+  }
+  input = malloc(size);
+  output = malloc(size);
+
+  const sim_kernel_t *k = sim_translate0(
+      kernel_data, setup_typed_kernel0(kernel_data, ELEM_INT32));
+  failed = !k;
+  elem_fill(ELEM_INT32, input, size);
+  fprintf(stderr, "Simulating caches for %u work items, %.0f KB LLC\n", items,
+          SIM_LLC_BYTES / 1024.0);
+
+  for (i = 0; !failed && i < presets + CACHE_STREAMING; i++) {
+    dispatch_t d = {groups, GROUP_THREADS};
+    sim_memory_t m;
+    int c = i < presets ? CACHE_LLC_L3 : (int)(i - presets) + 1;
+    d.l3 = &l3_presets[i < presets ? i : L3_PRESET_DEFAULT];
+    d.input_cache = c;
+    d.output_cache = c;
+    sim_memory_init0(&m, &d);
+    snprintf(config, sizeof config, "%s %s", d.l3->name, names[c]);
+    for (pass = 1; !failed && pass <= SIM_CACHE_PASSES; pass++) {
+      memset(m.traffic, 0, sizeof m.traffic);
+      failed = sim_dispatch0(k, &d, input, output, size, &m, NULL);
+      sim_memory_flush(&m);
+      sim_traffic_report(&m, config, pass, items);
+    }
+    sim_memory_free(&m);
+  }
+
+  free(input);
+  free(output);
+  return failed;
+}
+
+// Where the state base addresses and media loads of a captured batch point,
+// as a buffer of the capture and an offset into it.
+typedef struct capture_state {
+  int surface, dynamic, instruction; // buffer indices, -1 until set
+  uint32_t surface_base, dynamic_base, instruction_base;
+  uint32_t curb_length, curb_address, idrt_address;
+} capture_state_t;
+
+// Buffer the relocation at offset of buffer i points to, with its delta in
+// *delta, or -1 if nothing is relocated there.
+static int capture_target(const capture_bo_t *bos, capture_reloc_t **relocs,
+                          int i, uint32_t offset, uint32_t *delta) {
+  uint32_t j;
+
+  for (j = 0; i >= 0 && j < bos[i].reloc_count; j++) {
+    if (relocs[i][j].offset == offset) {
+      *delta = relocs[i][j].delta;
+      return relocs[i][j].target;
+    }
+  }
+  return -1;
+}
+
+// size bytes at offset of buffer i, NULL unless they are all inside it.
+static uint8_t *capture_at(const capture_bo_t *bos, uint8_t **data, int i,
+                           uint64_t offset, uint64_t size) {
+  if (i < 0 || offset + size > bos[i].size)
+    return NULL;
+  return data[i] + offset;
+}
+
+// Runs the walker at w on the software executor, with the descriptor, CURBE,
+// binding table and buffer surfaces found through s.
+static int capture_walker0(const capture_bo_t *bos, uint8_t **data,
+                           capture_reloc_t **relocs, const capture_state_t *s,
+                           const gen8_gpgpu_walker_t *w) {
+  sim_surface_t surfaces[SIM_SURFACES] = {{0}};
+  dispatch_t d = {0};
+  uint32_t delta, bti;
+
+  const gen8_interface_descriptor_t *idrt =
+      (const gen8_interface_descriptor_t *)capture_at(
+          bos, data, s->dynamic,
+          (uint64_t)s->dynamic_base + s->idrt_address +
+              w->interface_descriptor_offset * sizeof(*idrt),
+          sizeof(*idrt));
+  if (!idrt || w->header & GPGPU_WALKER_INDIRECT ||
+      w->threads.simd_size != 1 || w->groups_y > 1 || w->groups_z > 1 ||
+      idrt->desc5.curbe_read_len != 8) {
+    fprintf(stderr, "Only direct SIMD16 walkers along X with 8 CURBE "
+                    "registers per thread can be simulated\n");
+    return 1;
+  }
+  d.groups = w->groups_x;
+  d.group_threads = w->threads.thread_width_max + 1;
+  d.barrier = idrt->desc6.barrier_enable;
+  d.slm_size = slm_size_bytes(idrt->desc6.slm_sz);
+
+  const uint8_t *curb =
+      capture_at(bos, data, s->dynamic,
+                 (uint64_t)s->dynamic_base + s->curb_address,
+                 d.group_threads * 256);
+  uint32_t kernel = s->instruction_base +
+                    (idrt->desc0.kernel_start_pointer << 6);
+  const uint8_t *code = capture_at(bos, data, s->instruction, kernel, 1);
+  const uint32_t *table = (const uint32_t *)capture_at(
+      bos, data, s->surface,
+      (uint64_t)s->surface_base + (idrt->desc4.binding_table_pointer << 5),
+      SIM_SURFACES * sizeof(uint32_t));
+  if (!curb || s->curb_length < d.group_threads * 256u || !code || !table) {
+    fprintf(stderr, "Walker state is outside the captured buffers\n");
+    return 1;
+  }
+
+  for (bti = 0; bti < SIM_SURFACES; bti++) {
+    uint64_t at = (uint64_t)s->surface_base + table[bti];
+    const gen8_surface_state_t *ss = (const gen8_surface_state_t *)capture_at(
+        bos, data, s->surface, at, sizeof(*ss));
+    if (!table[bti] || !ss || ss->ss0.surface_type != 4)
+      continue;
+    // buffer size - 1 is split across width[6:0], height[20:7], depth[30:21]
+    uint32_t size =
+        (ss->ss2.width | ss->ss2.height << 7 | ss->ss3.depth << 21) + 1;
+    int target = capture_target(bos, relocs, s->surface,
+                                at + offsetof(gen8_surface_state_t, ss8),
+                                &delta);
+    surfaces[bti].data = capture_at(bos, data, target, delta, size);
+    surfaces[bti].size = size;
+    if (!surfaces[bti].data) {
+      fprintf(stderr, "Surface %u is outside the captured buffers\n", bti);
+      return 1;
+    }
+  }
+
+  const sim_kernel_t *k =
+      sim_translate0(code, bos[s->instruction].size - kernel);
+  return !k || sim_launch0(k, &d, curb, surfaces, NULL, NULL);
+}
+
+// Runs the walkers of a capture on the software executor in batch order,
+// following the relocations of the batch to its state, and prints the hashes
+// of the buffers they write like capture_replay.
+static int capture_simulate0(const capture_header_t *header,
+                             const capture_bo_t *bos, uint8_t **data,
+                             capture_reloc_t **relocs) {
+  capture_state_t s = {-1, -1, -1};
+  int batch = header->bo_count - 1, failed = 0;
+  const uint32_t *dw = (const uint32_t *)data[batch];
+  uint32_t i, length, walkers = 0;
+
+  double start = now();
+  for (i = 0; !failed && i < header->exec_length / 4; i += length) {
+    uint32_t at = i * sizeof(uint32_t);
+    uint32_t opcode = dw[i] & 0xffff0000;
+    if (dw[i] == CMD_BATCH_BUFFER_END)
+      break;
+    // MI commands below 0x10 are a single dword, PIPELINE_SELECT has no
+    // length either
+    if (dw[i] >> 29 == 0)
+      length = dw[i] >> 23 < 0x10 ? 1 : (dw[i] & 0xff) + 2;
+    else
+      length = opcode == CMD_PIPELINE_SELECT ? 1 : (dw[i] & 0xff) + 2;
+    if (i + length > header->exec_length / 4)
+      break;
+
+    if ((dw[i] & (0x3f << 23)) == CMD_BATCH_BUFFER_START && !(dw[i] >> 29)) {
+      fprintf(stderr, "Chained batches cannot be simulated\n");
+      failed = 1;
+    } else if (opcode == CMD_STATE_BASE_ADDRESS) {
+      s.surface = capture_target(
+          bos, relocs, batch,
+          at + offsetof(gen8_state_base_address_t, surface_state),
+          &s.surface_base);
+      s.dynamic = capture_target(
+          bos, relocs, batch,
+          at + offsetof(gen8_state_base_address_t, dynamic_state),
+          &s.dynamic_base);
+      s.instruction = capture_target(
+          bos, relocs, batch,
+          at + offsetof(gen8_state_base_address_t, instruction),
+          &s.instruction_base);
+      // the low bits of a base address are its modify flag and MOCS
+      s.surface_base &= ~4095u;
+      s.dynamic_base &= ~4095u;
+      s.instruction_base &= ~4095u;
+    } else if (opcode == CMD_MEDIA_CURBE_LOAD) {
+      const gen8_media_load_t *load = (const gen8_media_load_t *)&dw[i];
+      s.curb_length = load->length;
+      s.curb_address = load->address;
+    } else if (opcode == CMD_MEDIA_INTERFACE_DESCRIPTOR_LOAD) {
+      s.idrt_address = ((const gen8_media_load_t *)&dw[i])->address;
+    } else if (opcode == CMD_GPGPU_WALKER) {
+      failed = capture_walker0(bos, data, relocs, &s,
+                               (const gen8_gpgpu_walker_t *)&dw[i]);
+      walkers++;
+    }
+  }
+  double elapsed = now() - start;
+
+  if (!failed) {
+    fprintf(stderr, "Simulated %u walkers in %.2f ms\n", walkers,
+            elapsed * 1e3);
+    capture_hash(header, bos, data, relocs, NULL);
+  }
+  return failed || !walkers;
+}
+
+// Replays a capture, or describes it and runs it on the software executor
+// when there is no GPU and bufmgr is NULL.
+static int run_replay(drm_intel_bufmgr *bufmgr, drm_intel_context *ctx,
+                      const char *path) {
+  capture_header_t header = {0};
+  capture_bo_t bos[EXEC_MAX_OBJECTS];
+  capture_reloc_t *relocs[EXEC_MAX_OBJECTS] = {0};
+  uint8_t *data[EXEC_MAX_OBJECTS] = {0};
+  uint32_t i;
+  int err;
+
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    perror(path);
+    return 1;
+  }
+  err = capture_read(file, &header, bos, data, relocs);
+  fclose(file);
+
+  if (err) {
+    fprintf(stderr, "'%s' is not a capture file or is truncated\n", path);
+  } else if (header.gen != CAPTURE_GEN) {
+    fprintf(stderr, "'%s' was captured on gen%u, not gen%u\n", path,
+            header.gen, CAPTURE_GEN);
+    err = 1;
+  } else if (!bufmgr) {
+    fprintf(stderr, "gen%u capture, %u buffers, exec length %u\n", header.gen,
+            header.bo_count, header.exec_length);
+    for (i = 0; i < header.bo_count; i++)
+      fprintf(stderr, "  buffer %u: %u bytes, %u stored, %u relocations\n", i,
+              bos[i].size, bos[i].length, bos[i].reloc_count);
+    err = capture_simulate0(&header, bos, data, relocs);
+  } else {
+    err = capture_replay(bufmgr, ctx, &header, bos, data, relocs);
+  }
+
+  for (i = 0; i < EXEC_MAX_OBJECTS; i++) {
+    free(data[i]);
+    free(relocs[i]);
+  }
+  return err;
+}
+
+// Without a usable GPU the default dispatch and --split run on the host cores,
+// --simulate, --simulate-cache and --simulate-timing on the software executor.
+static int run_cpu(int argc, char *argv[]) {
+  uint8_t input_data[256] = {0};
+  int output[64];
+  dispatch_t dispatch = {1, GROUP_THREADS, 0, 0};
+  int *input = (int *)input_data;
+  int i, correct = 0;
+
+  if (argc > 1 && argc <= 3 && !strcmp(argv[1], "--simulate"))
+    return run_simulate0(argc == 3 ? strtoul(argv[2], NULL, 0) : 1 << 20, 0);
+  if (argc > 1 && argc <= 3 && !strcmp(argv[1], "--simulate-timing"))
+    return run_simulate0(argc == 3 ? strtoul(argv[2], NULL, 0) : 1 << 20, 1);
+  if (argc > 1 && argc <= 3 && !strcmp(argv[1], "--simulate-cache"))
+    return run_simulate_cache0(argc == 3 ? strtoul(argv[2], NULL, 0) : 1 << 20);
+  if (argc == 3 && !strcmp(argv[1], "--decode-oa"))
+    return run_decode_oa0(argv[2]);
+  if (argc > 1 && (argc > 3 || strcmp(argv[1], "--split"))) {
+    fprintf(stderr, "Mode '%s' needs a GPU\n", argv[1]);
+    return 1;
+  }
+  fprintf(stderr, "No GPU, running on %d CPU threads\n", cpu_threads());
+  if (argc > 1) {
+    uint32_t bytes = argc == 3 ? strtoul(argv[2], NULL, 0) : 1 << 26;
+    return run_split0(NULL, NULL, NULL, bytes);
+  }
+
+  setup_input(input_data);
+  cpu_dispatch(&dispatch, input_data, output, sizeof output);
+  for (i = 0; i < 64; i++) {
+    if (output[i] == input[i] + input[i])
+      correct++;
+  }
+  fprintf(stderr, "Computed '%d/%d' correct values!\n", correct, 64);
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  uint8_t kernel_data[4096] = {0};
+  uint8_t input_data[256] = {0};
+  dispatch_t dispatch = {1, GROUP_THREADS, 0, 0};
+
+  int i;
+  int err;
+
+  int fd = open("/dev/dri/card0", O_RDWR);
+  if (fd < 0 && argc == 3 && !strcmp(argv[1], "--replay"))
+    return run_replay(NULL, NULL, argv[2]);
+  drm_intel_bufmgr *bufmgr =
+      fd < 0 ? NULL : drm_intel_bufmgr_gem_init(fd, 16384);
+  if (!bufmgr)
+    return run_cpu(argc, argv);
+  drm_intel_context *ctx = drm_intel_gem_context_create(bufmgr);
+  profile_load(drm_intel_bufmgr_gem_get_devid(bufmgr));
+
+  drm_intel_bo *kernel_buffer =
+      drm_intel_bo_alloc(bufmgr, "kernel buffer", 464, 64);
+  setup_kernel0(kernel_data);
+  err = drm_intel_bo_subdata(kernel_buffer, 0, 464, kernel_data);
+
+  if (argc > 1) {
+    if (argc == 4 && !strcmp(argv[1], "--stream")) {
+      err = run_stream(fd, bufmgr, ctx, kernel_buffer, argv[2], argv[3]);
+    } else if (argc == 4 && !strcmp(argv[1], "--mmap")) {
+      err = run_mmap(fd, bufmgr, ctx, kernel_buffer, argv[2], argv[3]);
+    } else if (argc <= 3 && !strcmp(argv[1], "--completions")) {
+      uint32_t n = argc == 3 ? strtoul(argv[2], NULL, 0) : 1000;
+      err = run_completions0(bufmgr, ctx, kernel_buffer, n);
+    } else if (argc <= 3 && !strcmp(argv[1], "--async")) {
+      uint32_t n = argc == 3 ? strtoul(argv[2], NULL, 0) : 1000;
+      err = run_async0(bufmgr, ctx, kernel_buffer, n);
+    } else if (argc == 2 && !strcmp(argv[1], "--slm")) {
+      err = run_slm0(bufmgr, ctx);
+    } else if (argc <= 3 && !strcmp(argv[1], "--reduce")) {
+      uint32_t n = argc == 3 ? strtoul(argv[2], NULL, 0) : 1 << 22;
+      err = run_reduce0(bufmgr, ctx, n);
+    } else if (argc <= 3 && !strcmp(argv[1], "--types")) {
+      uint32_t bytes = argc == 3 ? strtoul(argv[2], NULL, 0) : 1 << 24;
+      err = run_types0(bufmgr, ctx, bytes);
+    } else if (argc <= 3 && !strcmp(argv[1], "--autotune")) {
+      uint32_t bytes = argc == 3 ? strtoul(argv[2], NULL, 0) : 1 << 24;
+      err = run_autotune0(bufmgr, ctx, bytes);
+    } else if (argc <= 3 && !strcmp(argv[1], "--l3-sweep")) {
+      uint32_t bytes = argc == 3 ? strtoul(argv[2], NULL, 0) : 1 << 24;
+      err = run_l3_sweep0(bufmgr, ctx, bytes);
+    } else if (argc <= 3 && !strcmp(argv[1], "--cache-sweep")) {
+      uint32_t bytes = argc == 3 ? strtoul(argv[2], NULL, 0) : 1 << 26;
+      err = run_cache_sweep0(bufmgr, ctx, bytes);
+    } else if (argc <= 3 && !strcmp(argv[1], "--indirect")) {
+      uint32_t n = argc == 3 ? strtoul(argv[2], NULL, 0) : 1000;
+      err = run_indirect0(bufmgr, ctx, n);
+    } else if (argc <= 3 && !strcmp(argv[1], "--submit")) {
+      uint32_t count = argc == 3 ? strtoul(argv[2], NULL, 0) : 10000;
+      err = run_submit0(fd, bufmgr, ctx, count);
+    } else if (argc <= 3 && !strcmp(argv[1], "--check-exec")) {
+      uint32_t count = argc == 3 ? strtoul(argv[2], NULL, 0) : 64;
+      err = run_check_exec0(fd, bufmgr, ctx, count);
+    } else if (argc <= 3 && !strcmp(argv[1], "--heap")) {
+      uint32_t n = argc == 3 ? strtoul(argv[2], NULL, 0) : 10000;
+      err = run_heap0(fd, bufmgr, ctx, n);
+    } else if (argc <= 3 && !strcmp(argv[1], "--split")) {
+      uint32_t bytes = argc == 3 ? strtoul(argv[2], NULL, 0) : 1 << 26;
+      err = run_split0(bufmgr, ctx, kernel_buffer, bytes);
+    } else if (argc <= 3 && !strcmp(argv[1], "--simulate")) {
+      uint32_t n = argc == 3 ? strtoul(argv[2], NULL, 0) : 1 << 20;
+      err = run_simulate0(n, 0);
+    } else if (argc <= 3 && !strcmp(argv[1], "--simulate-timing")) {
+      uint32_t n = argc == 3 ? strtoul(argv[2], NULL, 0) : 1 << 20;
+      err = run_simulate0(n, 1);
+    } else if (argc <= 3 && !strcmp(argv[1], "--simulate-cache")) {
+      uint32_t bytes = argc == 3 ? strtoul(argv[2], NULL, 0) : 1 << 20;
+      err = run_simulate_cache0(bytes);
+    } else if (argc <= 4 && !strcmp(argv[1], "--counters")) {
+      uint32_t bytes = argc >= 3 ? strtoul(argv[2], NULL, 0) : 1 << 24;
+      err = run_counters0(fd, bufmgr, ctx, bytes, argc == 4 ? argv[3] : NULL);
+    } else if (argc == 3 && !strcmp(argv[1], "--decode-oa")) {
+      err = run_decode_oa0(argv[2]);
+    } else if (argc == 3 && !strcmp(argv[1], "--capture")) {
+      err = run_capture0(fd, bufmgr, ctx, kernel_buffer, argv[2]);
+    } else if (argc == 3 && !strcmp(argv[1], "--replay")) {
+      err = run_replay(bufmgr, ctx, argv[2]);
+    } else {
+      fprintf(stderr, "Unknown mode '%s'\n", argv[1]);
+      err = 1;
+    }
+    drm_intel_bo_unreference(kernel_buffer);
+    drm_intel_gem_context_destroy(ctx);
+    drm_intel_bufmgr_destroy(bufmgr);
+    return err;
+  }
+
+  setup_input(input_data);
+  void *output_data = malloc(256);
+  err = run_dispatch0(bufmgr, ctx, kernel_buffer, &dispatch, input_data,
+                      output_data, 256);
+
+  drm_intel_bo_unreference(kernel_buffer);
   drm_intel_gem_context_destroy(ctx);
   drm_intel_bufmgr_destroy(bufmgr);
 